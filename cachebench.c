@@ -0,0 +1,345 @@
+/**************
+ ** Cache microbenchmarks, for make bench
+ **
+ ** The cache is all in proxy.c, so this is built with proxy.c in it (its
+ ** main() renamed out of the way) and times the real functions:
+ **     add     add_cache_object() into a cache with room
+ **     get     get_cache_object() for a random object that's there
+ **     update  update_node() on a random object that's there
+ **     evict   add_cache_object() into a full cache, so every add evicts
+ ** Each is run against caches of 100 objects up to a million, with a few
+ ** distributions of object sizes, from 1 thread up to 8 at once, for
+ ** BENCH_SECONDS a run, and reported as operations a second and latency
+ ** percentiles. (Caches that would take more than BENCH_MEMORY are
+ ** skipped.)
+ **
+ **     cachebench [-n most objects] [-t most threads] [-s seconds a run]
+ **/
+#define main proxy_main
+#include "proxy.c"
+#undef main
+
+#include <math.h>
+
+#define BENCH_SECONDS 0.2       /* each run */
+#define BENCH_SAMPLES 100000    /* latencies kept per thread */
+#define BENCH_MEMORY  (512L << 20) /* biggest cache to fill */
+#define BENCH_ADDED   (64L << 20)  /* most bytes one add run may add */
+#define BENCH_HEADER  "GET / HTTP/1.1\r\n\r\n"
+
+//xorshift64*
+static unsigned long long bench_random(unsigned long long* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static long long bench_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*****
+ * Object sizes
+ *****/
+static int size_small(unsigned long long* rng)
+{
+    (void)rng;
+    return 256;
+}
+
+static int size_uniform(unsigned long long* rng)
+{
+    return 1024 + bench_random(rng) % (31 * 1024);
+}
+
+//Pareto (alpha 1.2, from 512 bytes): mostly small, with a long tail
+static int size_pareto(unsigned long long* rng)
+{
+    double u = (bench_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+    double size = 512 / pow(1 - u, 1 / 1.2);
+    return size > MAX_OBJECT_SIZE ? MAX_OBJECT_SIZE : (int)size;
+}
+
+struct bench_sizes
+{
+    char* name;
+    int (*size)(unsigned long long* rng);
+};
+static struct bench_sizes bench_sizes[] = {
+    {"256B", size_small},
+    {"1-32K", size_uniform},
+    {"pareto", size_pareto},
+};
+#define NSIZES (int)(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+/*****
+ * Runs
+ *****/
+#define OP_ADD    0
+#define OP_GET    1
+#define OP_UPDATE 2
+#define OP_EVICT  3
+static char* bench_ops[] = {"add", "get", "update", "evict"};
+
+static struct cachenode** bench_nodes; //the objects the cache was filled with
+static long bench_population;
+static struct bench_sizes* bench_sizing;
+static long bench_nextid;
+static long bench_added;
+static volatile int bench_stop;
+static pthread_barrier_t bench_start;
+
+struct bench_thread
+{
+    pthread_t tid;
+    int op;
+    unsigned long long rng;
+    unsigned long ops;
+    long long* samples; //a reservoir sample of the latencies, in ns
+    long nsamples;
+    long long finished; //when it stopped (an add run may stop early)
+};
+
+static struct cachenode* bench_object(long id, int size)
+{
+    struct cachenode* n = newNode();
+    n->objname = malloc(32);
+    sprintf(n->objname, "bench/%ld", id);
+    n->header = strdup(BENCH_HEADER);
+    n->data = malloc(size);
+    memset(n->data, 'x', size);
+    n->size = size;
+    n->stored = time(NULL);
+    return n;
+}
+
+static void* bench_thread(void* arg)
+{
+    struct bench_thread* t = arg;
+    char name[32];
+    pthread_barrier_wait(&bench_start);
+    while(!bench_stop)
+    {
+        //(the object to add is made before the clock starts)
+        struct cachenode* obj = NULL;
+        long i = bench_random(&t->rng) % bench_population;
+        if(t->op == OP_ADD || t->op == OP_EVICT)
+        {
+            int size = bench_sizing->size(&t->rng);
+            if(t->op == OP_ADD
+               && __atomic_add_fetch(&bench_added, size, __ATOMIC_RELAXED)
+                  > BENCH_ADDED)
+                break;
+            obj = bench_object(__atomic_fetch_add(&bench_nextid, 1,
+                                                  __ATOMIC_RELAXED), size);
+        }
+        else if(t->op == OP_GET)
+        {
+            sprintf(name, "bench/%ld", i);
+        }
+
+        long long start = bench_ns();
+        if(obj)
+        {
+            add_cache_object(obj);
+        }
+        else if(t->op == OP_GET)
+        {
+            struct cachenode* copy = get_cache_object(name, BENCH_HEADER);
+            long long took = bench_ns() - start;
+            if(copy)
+                free_node(copy);
+            start = bench_ns() - took; //(not timing the free)
+        }
+        else
+        {
+            update_node(bench_nodes[i]);
+        }
+        long long took = bench_ns() - start;
+
+        t->ops++;
+        if(t->ops <= BENCH_SAMPLES)
+            t->samples[t->nsamples++] = took;
+        else
+        {
+            unsigned long j = bench_random(&t->rng) % t->ops;
+            if(j < BENCH_SAMPLES)
+                t->samples[j] = took;
+        }
+    }
+    t->finished = bench_ns();
+    return NULL;
+}
+
+static int bench_compare(const void* a, const void* b)
+{
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_run(int op, int nthreads, double seconds)
+{
+    struct bench_thread threads[nthreads];
+    int i;
+    bench_stop = 0;
+    bench_added = 0;
+    pthread_barrier_init(&bench_start, NULL, nthreads + 1);
+    for(i = 0; i < nthreads; i++)
+    {
+        threads[i].op = op;
+        threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        threads[i].ops = 0;
+        threads[i].samples = malloc(BENCH_SAMPLES * sizeof(long long));
+        threads[i].nsamples = 0;
+        pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i]);
+    }
+    pthread_barrier_wait(&bench_start);
+    long long began = bench_ns();
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    bench_stop = 1;
+
+    unsigned long ops = 0;
+    long nsamples = 0;
+    long long finished = began;
+    for(i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i].tid, NULL);
+        ops += threads[i].ops;
+        nsamples += threads[i].nsamples;
+        if(threads[i].finished > finished)
+            finished = threads[i].finished;
+    }
+    double elapsed = (finished - began) / 1e9;
+    pthread_barrier_destroy(&bench_start);
+
+    long long* all = malloc((nsamples + 1) * sizeof(long long));
+    long n = 0;
+    for(i = 0; i < nthreads; i++)
+    {
+        memcpy(all + n, threads[i].samples,
+               threads[i].nsamples * sizeof(long long));
+        n += threads[i].nsamples;
+        free(threads[i].samples);
+    }
+    qsort(all, n, sizeof(long long), bench_compare);
+    double q[3] = {0.5, 0.99, 0.999};
+    double us[3] = {0, 0, 0};
+    for(i = 0; i < 3 && n > 0; i++)
+    {
+        long at = (long)(q[i] * n);
+        us[i] = all[at < n ? at : n - 1] / 1e3;
+    }
+    free(all);
+
+    printf("%9ld  %-7s %-7s %7d %12.0f %10.2f %10.2f %10.2f\n",
+           bench_population, bench_sizing->name, bench_ops[op], nthreads,
+           ops / elapsed, us[0], us[1], us[2]);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    long most = 1000000;
+    int maxthreads = 8;
+    double seconds = BENCH_SECONDS;
+    int opt;
+    while((opt = getopt(argc, argv, "n:t:s:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'n':
+            most = atol(optarg);
+            break;
+        case 't':
+            maxthreads = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n most objects] [-t most threads] "
+                            "[-s seconds a run]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    //the cache as the proxy sets it up, less the admission filter (which
+    //would turn most of the objects away)
+    struct features_t features;
+    memset(&features, 0, sizeof(features));
+    features.cache = 1;
+    publish_features(&features);
+    pthread_mutex_init(&features_mutex, NULL);
+    pthread_rwlock_init(&cachelock, NULL);
+    thecache.policy = &policies[0];
+    max_cache_size = LONG_MAX;
+
+    printf("Cache benchmarks (%s eviction, %.2fs a run, latencies in us)\n\n",
+           thecache.policy->name, seconds);
+    printf("%9s  %-7s %-7s %7s %12s %10s %10s %10s\n", "objects", "sizes",
+           "op", "threads", "ops/sec", "p50", "p99", "p99.9");
+
+    long population;
+    for(population = 100; population <= most; population *= 10)
+    {
+        int s;
+        for(s = 0; s < NSIZES; s++)
+        {
+            bench_sizing = &bench_sizes[s];
+            unsigned long long rng = 42;
+            double mean = 0;
+            int i;
+            for(i = 0; i < 1000; i++)
+                mean += bench_sizing->size(&rng) / 1000.0;
+            if(population * mean > BENCH_MEMORY)
+            {
+                printf("%9ld  %-7s (skipped: would take %.0f MB)\n",
+                       population, bench_sizing->name,
+                       population * mean / (1 << 20));
+                continue;
+            }
+
+            //fill it up
+            bench_population = population;
+            bench_nodes = malloc(population * sizeof(struct cachenode*));
+            long id;
+            for(id = 0; id < population; id++)
+            {
+                bench_nodes[id] = bench_object(id,
+                                               bench_sizing->size(&rng));
+                add_cache_object(bench_nodes[id]);
+            }
+            bench_nextid = population;
+
+            //the ones that leave the objects where they are first, and
+            //evicting (which frees some of them) last
+            int op;
+            for(op = OP_GET; op <= OP_EVICT; op = (op == OP_UPDATE) ? OP_ADD
+                                                  : (op == OP_ADD) ? OP_EVICT
+                                                  : op + 1)
+            {
+                if(op == OP_EVICT)
+                    max_cache_size = thecache.totalsize;
+                int t;
+                for(t = 1; t <= maxthreads; t *= 2)
+                    bench_run(op, t, seconds);
+                if(op == OP_EVICT)
+                    break;
+            }
+
+            clear_cache();
+            max_cache_size = LONG_MAX;
+            free(bench_nodes);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+/**************
+ ** Response body framing and chunked transfer-coding, see chunked.h
+ **/
+#include <stdlib.h>
+#include <string.h>
+
+#include "csapp.h"
+#include "chunked.h"
+
+void body_reader_init(struct bodyreader* br, rio_t* rp, int framing,
+                      long length)
+{
+    br->rp = rp;
+    br->framing = framing;
+    br->remaining = (framing == BODY_LENGTH) ? length : 0;
+    br->started = 0;
+    br->done = (framing == BODY_LENGTH && length == 0);
+}
+
+//move on to the next chunk: read its size line (and the CRLF ending the
+//chunk before it). after the last chunk, read through the trailers
+static int next_chunk(struct bodyreader* br)
+{
+    char line[MAXLINE];
+    if(br->started)
+    {
+        if(rio_readlineb(br->rp, line, MAXLINE) <= 0)
+            return -1;
+    }
+    br->started = 1;
+    if(rio_readlineb(br->rp, line, MAXLINE) <= 0)
+        return -1;
+
+    //the size is in hex, and may have extensions after a ';'
+    char* end;
+    long size = strtol(line, &end, 16);
+    if(end == line || size < 0)
+        return -1;
+    if(size == 0)
+    {
+        //last chunk: skip any trailer fields up to the blank line
+        int n;
+        while((n = rio_readlineb(br->rp, line, MAXLINE)) > 0
+              && line[0] != '\r' && line[0] != '\n')
+            ;
+        if(n <= 0)
+            return -1;
+        br->done = 1;
+    }
+    br->remaining = size;
+    return 0;
+}
+
+int body_read(struct bodyreader* br, char* buf, int maxlen)
+{
+    if(br->done)
+        return 0;
+
+    if(br->framing == BODY_CLOSE)
+    {
+        //rio_readnb() would wait for all of maxlen, so take whatever the
+        //buffer has or one read() brings
+        int n = rio_readnb(br->rp, buf, 1);
+        if(n <= 0)
+        {
+            br->done = (n == 0);
+            return n;
+        }
+        int more = br->rp->rio_cnt < maxlen-1 ? br->rp->rio_cnt : maxlen-1;
+        if(more > 0)
+            n += rio_readnb(br->rp, buf+1, more);
+        return n;
+    }
+
+    if(br->framing == BODY_CHUNKED && br->remaining == 0)
+    {
+        if(next_chunk(br) < 0)
+            return -1;
+        if(br->done)
+            return 0;
+    }
+
+    //never ask for more than is left, or we'd wait on a connection that
+    //has nothing more to send
+    int want = (br->remaining < maxlen) ? br->remaining : maxlen;
+    int n = rio_readnb(br->rp, buf, want);
+    if(n < want || n <= 0)
+        return -1;
+    br->remaining -= n;
+    if(br->framing == BODY_LENGTH && br->remaining == 0)
+        br->done = 1;
+    return n;
+}
+
+int body_complete(struct bodyreader* br)
+{
+    return br->done && br->framing != BODY_CLOSE;
+}
+
+int chunk_write(int fd, char* buf, int len)
+{
+    if(len <= 0)
+        return 0;
+    char head[32];
+    int n = sprintf(head, "%x\r\n", len);
+    if(rio_writen(fd, head, n) != n
+       || rio_writen(fd, buf, len) != len
+       || rio_writen(fd, "\r\n", 2) != 2)
+        return -1;
+    return 0;
+}
+
+int chunk_finish(int fd)
+{
+    return (rio_writen(fd, "0\r\n\r\n", 5) == 5) ? 0 : -1;
+}
@@ -0,0 +1,47 @@
+/*****
+ ** Response body framing
+ **
+ ** Once an origin connection can stay open after a response, the end of the
+ ** body can't be found by waiting for the origin to close. A body reader
+ ** reads exactly one response body however it's delimited (Content-Length,
+ ** chunked transfer-coding, or the connection closing), handing back the
+ ** de-chunked payload a piece at a time, and leaves the connection at the
+ ** start of the next response.
+ **
+ ** The other half writes a body to a client in chunks, for when we don't
+ ** know its length up front.
+ **/
+#ifndef __CHUNKED_H__
+#define __CHUNKED_H__
+
+//(needs rio_t from csapp.h, which has to be included first)
+
+//how a response body is delimited
+#define BODY_CLOSE   0 /* runs until the origin closes the connection */
+#define BODY_LENGTH  1 /* Content-Length bytes */
+#define BODY_CHUNKED 2 /* Transfer-Encoding: chunked */
+
+struct bodyreader
+{
+    rio_t* rp;
+    int framing;
+    long remaining; //left in the body (LENGTH) or in this chunk (CHUNKED)
+    int started;    //read a chunk size line yet?
+    int done;       //read the whole body, trailers and all
+};
+
+void body_reader_init(struct bodyreader* br, rio_t* rp, int framing,
+                      long length);
+//read the next piece of the body (at most maxlen bytes). returns its length,
+//0 once the body is over, or -1 on a read error or a body cut short
+int body_read(struct bodyreader* br, char* buf, int maxlen);
+//was the body read to its proper end? (the connection can be reused)
+int body_complete(struct bodyreader* br);
+
+//write a piece of a body as one chunk (nothing, for an empty piece)
+//returns 0, or -1 on a write error
+int chunk_write(int fd, char* buf, int len);
+//write the last chunk, which ends the body
+int chunk_finish(int fd);
+
+#endif /* __CHUNKED_H__ */
@@ -0,0 +1,226 @@
+/**************
+ ** Compression for cached objects, see compress.h
+ **/
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+
+#include "csapp.h"
+#include "compress.h"
+
+#define GZIP_WINDOW (15 + 16) /* 32K window, gzip wrapper */
+#define BROTLI_STREAM_QUALITY 5 /* quick enough to do per response */
+
+char* encoding_name(int encoding)
+{
+    switch(encoding)
+    {
+    case ENCODING_GZIP:
+        return "gzip";
+    case ENCODING_BR:
+        return "br";
+    default:
+        return "identity";
+    }
+}
+
+int compressible_type(char* contenttype)
+{
+    static char* types[] = {
+        "text/", "application/json", "application/javascript",
+        "application/x-javascript", "application/xml", "image/svg+xml",
+        NULL
+    };
+    int i;
+    for(i = 0; types[i]; i++)
+    {
+        if(strncasecmp(contenttype, types[i], strlen(types[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int gzip_buffer(void* in, int inlen, void** out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW,
+                    8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    int bound = deflateBound(&zs, inlen);
+    char* buf = malloc(bound);
+    zs.next_in = in;
+    zs.avail_in = inlen;
+    zs.next_out = (Bytef*)buf;
+    zs.avail_out = bound;
+    if(deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    {
+        deflateEnd(&zs);
+        free(buf);
+        return -1;
+    }
+    int outlen = zs.total_out;
+    deflateEnd(&zs);
+    *out = buf;
+    return outlen;
+}
+
+static int unbrotli_to_fd(int fd, void* in, int inlen)
+{
+    BrotliDecoderState* br = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+    if(!br)
+        return -1;
+
+    char buf[MAXBUF];
+    size_t availin = inlen;
+    const uint8_t* nextin = in;
+    BrotliDecoderResult ret;
+    do
+    {
+        size_t availout = sizeof(buf);
+        uint8_t* nextout = (uint8_t*)buf;
+        ret = BrotliDecoderDecompressStream(br, &availin, &nextin,
+                                            &availout, &nextout, NULL);
+        int n = sizeof(buf) - availout;
+        if(n > 0 && rio_writen(fd, buf, n) != n)
+        {
+            ret = BROTLI_DECODER_RESULT_ERROR;
+            break;
+        }
+    } while(ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+    BrotliDecoderDestroyInstance(br);
+    return (ret == BROTLI_DECODER_RESULT_SUCCESS) ? 0 : -1;
+}
+
+int decode_to_fd(int fd, int encoding, void* in, int inlen)
+{
+    if(encoding == ENCODING_BR)
+        return unbrotli_to_fd(fd, in, inlen);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(inflateInit2(&zs, GZIP_WINDOW) != Z_OK)
+        return -1;
+
+    char buf[MAXBUF];
+    int ret = Z_OK;
+    zs.next_in = in;
+    zs.avail_in = inlen;
+    while(ret != Z_STREAM_END)
+    {
+        zs.next_out = (Bytef*)buf;
+        zs.avail_out = sizeof(buf);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END)
+            break;
+        int n = sizeof(buf) - zs.avail_out;
+        if(n > 0 && rio_writen(fd, buf, n) != n)
+        {
+            ret = Z_ERRNO;
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    return (ret == Z_STREAM_END) ? 0 : -1;
+}
+
+struct encoder
+{
+    int encoding;
+    z_stream zs;
+    BrotliEncoderState* br;
+    char* out;
+    size_t outcap;
+};
+
+struct encoder* encoder_new(int encoding)
+{
+    struct encoder* enc = calloc(1, sizeof(struct encoder));
+    enc->encoding = encoding;
+    enc->outcap = MAXBUF;
+    enc->out = malloc(enc->outcap);
+    if(encoding == ENCODING_GZIP)
+    {
+        if(deflateInit2(&enc->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+            return enc;
+    }
+    else if(encoding == ENCODING_BR)
+    {
+        enc->br = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        if(enc->br)
+        {
+            BrotliEncoderSetParameter(enc->br, BROTLI_PARAM_QUALITY,
+                                      BROTLI_STREAM_QUALITY);
+            return enc;
+        }
+    }
+    free(enc->out);
+    free(enc);
+    return NULL;
+}
+
+int encoder_update(struct encoder* enc, void* in, int inlen, int finish,
+                   char** out)
+{
+    size_t outlen = 0;
+    if(enc->encoding == ENCODING_GZIP)
+    {
+        enc->zs.next_in = in;
+        enc->zs.avail_in = inlen;
+        int ret;
+        do
+        {
+            if(enc->outcap - outlen < MAXBUF)
+            {
+                enc->outcap *= 2;
+                enc->out = realloc(enc->out, enc->outcap);
+            }
+            enc->zs.next_out = (Bytef*)enc->out + outlen;
+            enc->zs.avail_out = enc->outcap - outlen;
+            ret = deflate(&enc->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+            if(ret == Z_STREAM_ERROR)
+                return -1;
+            outlen = enc->outcap - enc->zs.avail_out;
+        } while(enc->zs.avail_out == 0 || (finish && ret != Z_STREAM_END));
+    }
+    else
+    {
+        size_t availin = inlen;
+        const uint8_t* nextin = in;
+        do
+        {
+            if(enc->outcap - outlen < MAXBUF)
+            {
+                enc->outcap *= 2;
+                enc->out = realloc(enc->out, enc->outcap);
+            }
+            size_t availout = enc->outcap - outlen;
+            uint8_t* nextout = (uint8_t*)enc->out + outlen;
+            if(!BrotliEncoderCompressStream(enc->br,
+                    finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                    &availin, &nextin, &availout, &nextout, NULL))
+                return -1;
+            outlen = nextout - (uint8_t*)enc->out;
+        } while(availin > 0 || BrotliEncoderHasMoreOutput(enc->br)
+                || (finish && !BrotliEncoderIsFinished(enc->br)));
+    }
+    *out = enc->out;
+    return outlen;
+}
+
+void encoder_free(struct encoder* enc)
+{
+    if(!enc)
+        return;
+    if(enc->encoding == ENCODING_GZIP)
+        deflateEnd(&enc->zs);
+    else
+        BrotliEncoderDestroyInstance(enc->br);
+    free(enc->out);
+    free(enc);
+}
@@ -0,0 +1,43 @@
+/*****
+ ** Compression for cached objects and for clients
+ **
+ ** Text bodies (HTML, CSS, JS, JSON, ...) can be stored in the cache gzip
+ ** compressed. They're sent as they are to clients that accept gzip and
+ ** inflated on the way out for everybody else.
+ **
+ ** Uncompressed text responses can also be compressed (brotli or gzip) on
+ ** their way from the origin to a client that accepts it, with a streaming
+ ** encoder. The compressed copy is the one that's cached.
+ **/
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+//how a cached body is stored
+#define ENCODING_IDENTITY 0 /* exactly as the origin sent it */
+#define ENCODING_GZIP     1 /* gzip'd by the proxy */
+#define ENCODING_BR       2 /* brotli'd by the proxy for a client */
+
+//the Content-Encoding token for an encoding
+char* encoding_name(int encoding);
+
+//is a Content-Type worth compressing?
+int compressible_type(char* contenttype);
+
+//gzip a buffer. returns the compressed length and sets *out (the caller
+//frees it), or -1 if it didn't work out
+int gzip_buffer(void* in, int inlen, void** out);
+//decode a gzip'd or brotli'd buffer straight to a descriptor
+//returns 0 on success, -1 on a write error or bad data
+int decode_to_fd(int fd, int encoding, void* in, int inlen);
+
+//streaming compressor for a response body
+struct encoder;
+struct encoder* encoder_new(int encoding);
+//feed the encoder some more of the body (with finish set on the last call,
+//which may have no input). *out is pointed at whatever compressed output is
+//ready, which stays valid until the next call. returns its length, or -1
+int encoder_update(struct encoder* enc, void* in, int inlen, int finish,
+                   char** out);
+void encoder_free(struct encoder* enc);
+
+#endif /* __COMPRESS_H__ */
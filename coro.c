@@ -0,0 +1,520 @@
+/**************
+ ** Coroutines for request handling, see coro.h
+ **/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+#include "uring.h"
+
+static unsigned long spawned;
+static unsigned long switches;
+static unsigned long detached;
+
+#define CO_RUNNING 0
+#define CO_WAITING 1 //on an fd, and maybe a deadline
+#define CO_DETACH  2 //wants a thread of its own
+#define CO_DONE    3
+
+struct coro
+{
+    ucontext_t ctx;
+    ucontext_t* caller; //whoever resumed it last
+    char* map;          //its stack, guard page included
+    size_t maplen;
+    void (*fn)(void* arg);
+    void (*done)(void* arg);
+    void* arg;
+    int state;
+    struct worker* worker;
+    struct coro* next; //on its worker's run queue
+    //while it's waiting with a timeout
+    long long deadline; //milliseconds, on the monotonic clock
+    int timedout;
+    struct coro* nexttimer;
+    //what its I/O through the ring came to
+    int iores;
+};
+
+struct worker
+{
+    pthread_t tid;
+    int epfd;
+    int wakefd; //an eventfd that says the run queue has something in it
+    pthread_mutex_t lock;
+    struct coro* queue; //new coroutines (under lock)
+    struct coro* queuetail;
+    struct coro* timers; //waiting coroutines with a deadline, unsorted
+    struct uring* ring;  //for the coroutines' socket I/O, if there is one
+    ucontext_t sched;
+};
+
+//what a worker's ring is in its epoll set as (the eventfd is NULL, and
+//everything else is the coroutine waiting on it)
+static char ringready;
+
+static struct worker* workers;
+static int nworkers;
+static unsigned long nextworker;
+
+//the coroutine running on this thread (NULL on a worker between
+//coroutines, and on every other thread)
+static __thread struct coro* current;
+//the coroutine this thread was started for by coro_detach(), if it was
+static __thread struct coro* detachedco;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void coro_free(struct coro* co)
+{
+    munmap(co->map, co->maplen);
+    free(co);
+}
+
+//every coroutine starts here, and leaves through its caller's context
+//rather than returning, since it may not be on the thread it started on
+static void trampoline(void)
+{
+    struct coro* co = current;
+    co->fn(co->arg);
+    coro_exit();
+}
+
+static void* detached_thread(void* arg)
+{
+    pthread_detach(pthread_self());
+    struct coro* co = arg;
+    ucontext_t here;
+    co->caller = &here;
+    co->state = CO_RUNNING;
+    detachedco = co;
+    swapcontext(&here, &co->ctx);
+    detachedco = NULL;
+    coro_free(co);
+    return NULL;
+}
+
+//run a coroutine until it waits, detaches or finishes
+static void resume(struct worker* w, struct coro* co)
+{
+    co->caller = &w->sched;
+    co->state = CO_RUNNING;
+    current = co;
+    swapcontext(&w->sched, &co->ctx);
+    current = NULL;
+    __atomic_add_fetch(&switches, 1, __ATOMIC_RELAXED);
+
+    if(co->state == CO_DONE)
+    {
+        coro_free(co);
+    }
+    else if(co->state == CO_DETACH)
+    {
+        __atomic_add_fetch(&detached, 1, __ATOMIC_RELAXED);
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, detached_thread, co) != 0)
+            detached_thread(co); //then it has this worker to itself
+    }
+}
+
+static void remove_timer(struct worker* w, struct coro* co)
+{
+    struct coro** p;
+    for(p = &w->timers; *p; p = &(*p)->nexttimer)
+    {
+        if(*p == co)
+        {
+            *p = co->nexttimer;
+            return;
+        }
+    }
+}
+
+//milliseconds until the next deadline, as epoll_wait() wants it
+static int next_timeout(struct worker* w)
+{
+    if(!w->timers)
+        return -1;
+    long long soonest = w->timers->deadline;
+    struct coro* co;
+    for(co = w->timers->nexttimer; co; co = co->nexttimer)
+    {
+        if(co->deadline < soonest)
+            soonest = co->deadline;
+    }
+    long long left = soonest - now_ms();
+    return left > 0 ? (int)left : 0;
+}
+
+//a coroutine's I/O through the ring is done (on its worker)
+static void io_done(void* tag, int res)
+{
+    struct coro* co = tag;
+    co->iores = res;
+    resume(co->worker, co);
+}
+
+static void* worker_thread(void* arg)
+{
+    struct worker* w = arg;
+    struct epoll_event events[64];
+    for(;;)
+    {
+        pthread_mutex_lock(&w->lock);
+        struct coro* co = w->queue;
+        w->queue = NULL;
+        w->queuetail = NULL;
+        pthread_mutex_unlock(&w->lock);
+        while(co)
+        {
+            struct coro* next = co->next;
+            resume(w, co);
+            co = next;
+        }
+
+        //the I/O the coroutines have queued since last time all goes in
+        //together (and what completes straight away makes the ring ready)
+        if(w->ring)
+            uring_submit(w->ring);
+
+        int n = epoll_wait(w->epfd, events, 64, next_timeout(w));
+        int i, j;
+        for(i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == &ringready)
+            {
+                uring_reap(w->ring, io_done);
+                continue;
+            }
+            co = events[i].data.ptr;
+            //a coroutine waiting on several fds may have more than one
+            //ready, but it's only resumed for the first
+            for(j = 0; j < i && events[j].data.ptr != co; j++)
+                ;
+            if(j < i)
+                continue;
+            if(!co)
+            {
+                uint64_t count;
+                ssize_t drained = read(w->wakefd, &count, sizeof(count));
+                (void)drained;
+                continue;
+            }
+            if(co->deadline >= 0)
+                remove_timer(w, co);
+            resume(w, co);
+        }
+
+        //then whoever has run out of time (taken off the list first, as
+        //they may well wait again when they're resumed)
+        long long now = now_ms();
+        struct coro* expired = NULL;
+        struct coro** p = &w->timers;
+        while(*p)
+        {
+            co = *p;
+            if(co->deadline > now)
+            {
+                p = &co->nexttimer;
+                continue;
+            }
+            *p = co->nexttimer;
+            co->nexttimer = expired;
+            expired = co;
+        }
+        while(expired)
+        {
+            co = expired;
+            expired = co->nexttimer;
+            co->timedout = 1;
+            resume(w, co);
+        }
+    }
+    return NULL;
+}
+
+int coro_start(int n, int uring)
+{
+    workers = calloc(n, sizeof(struct worker));
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        struct worker* w = &workers[nworkers];
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&w->lock, NULL);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(w->epfd < 0 || w->wakefd < 0
+           || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) < 0)
+        {
+            if(w->epfd >= 0)
+                close(w->epfd);
+            if(w->wakefd >= 0)
+                close(w->wakefd);
+            break;
+        }
+        //(a worker without a ring does its I/O as it would without -u)
+        if(uring && (w->ring = uring_new()))
+        {
+            ev.data.ptr = &ringready;
+            if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, uring_fd(w->ring), &ev) < 0)
+            {
+                uring_free(w->ring);
+                w->ring = NULL;
+            }
+        }
+        if(pthread_create(&w->tid, NULL, worker_thread, w) != 0)
+        {
+            if(w->ring)
+                uring_free(w->ring);
+            close(w->epfd);
+            close(w->wakefd);
+            break;
+        }
+        nworkers++;
+    }
+    return nworkers > 0 ? 0 : -1;
+}
+
+int coro_spawn(void (*fn)(void* arg), void (*done)(void* arg), void* arg)
+{
+    if(nworkers == 0)
+        return -1;
+    struct coro* co = calloc(1, sizeof(struct coro));
+    if(!co)
+        return -1;
+    size_t page = sysconf(_SC_PAGESIZE);
+    co->maplen = COROUTINE_STACK + page;
+    co->map = mmap(NULL, co->maplen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                   -1, 0);
+    if(co->map == MAP_FAILED)
+    {
+        free(co);
+        return -1;
+    }
+    mprotect(co->map, page, PROT_NONE); //the stack grows down into this
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->map + page;
+    co->ctx.uc_stack.ss_size = COROUTINE_STACK;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, trampoline, 0);
+    co->fn = fn;
+    co->done = done;
+    co->arg = arg;
+    co->deadline = -1;
+
+    unsigned long i = __atomic_fetch_add(&nextworker, 1, __ATOMIC_RELAXED);
+    struct worker* w = &workers[i % nworkers];
+    co->worker = w;
+    pthread_mutex_lock(&w->lock);
+    if(w->queuetail)
+        w->queuetail->next = co;
+    else
+        w->queue = co;
+    w->queuetail = co;
+    pthread_mutex_unlock(&w->lock);
+    uint64_t one = 1;
+    ssize_t woken = write(w->wakefd, &one, sizeof(one));
+    (void)woken;
+    __atomic_add_fetch(&spawned, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//have the worker resume co when fd is ready. returns -1 if fd isn't
+//something epoll can wait on (a file, say), which is always ready
+static int arm(struct coro* co, int fd, short events)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT | ((events & POLLIN) ? EPOLLIN : 0)
+                             | ((events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.ptr = co;
+    if(epoll_ctl(co->worker->epfd, EPOLL_CTL_MOD, fd, &ev) < 0
+       && (errno != ENOENT
+           || epoll_ctl(co->worker->epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+        return -1;
+    return 0;
+}
+
+//switch back to the worker until an fd it's armed on is ready, or the
+//timeout runs out. returns 1, or 0 if the time ran out
+static int suspend(struct coro* co, int timeout)
+{
+    struct worker* w = co->worker;
+    co->timedout = 0;
+    co->deadline = -1;
+    if(timeout >= 0)
+    {
+        co->deadline = now_ms() + timeout;
+        co->nexttimer = w->timers;
+        w->timers = co;
+    }
+    co->state = CO_WAITING;
+    swapcontext(&co->ctx, co->caller);
+    co->deadline = -1;
+    return !co->timedout;
+}
+
+int coro_wait(int fd, short events, int timeout)
+{
+    struct coro* co = current;
+    if(!co)
+    {
+        struct pollfd p = { fd, events, 0 };
+        int ready;
+        while((ready = poll(&p, 1, timeout)) < 0 && errno == EINTR)
+            ;
+        return ready != 0;
+    }
+
+    //the fd stays in the set after it fires (one-shot, so disarmed) until
+    //it's closed, which saves adding it again next time. if the time runs
+    //out first it's still armed, though, so then it has to come out
+    if(arm(co, fd, events) < 0)
+        return 1;
+    if(suspend(co, timeout))
+        return 1;
+    epoll_ctl(co->worker->epfd, EPOLL_CTL_DEL, fd, NULL);
+    return 0;
+}
+
+int coro_uring(void)
+{
+    return current && current->worker->ring;
+}
+
+//queue the I/O on the worker's ring, and switch back to the worker until
+//it's done
+static ssize_t ring_io(int fd, void* buf, size_t n, int write, int timeout)
+{
+    struct coro* co = current;
+    uring_queue(co->worker->ring, fd, buf, n, write, timeout, co);
+    co->state = CO_WAITING;
+    swapcontext(&co->ctx, co->caller);
+    if(co->iores == -ECANCELED)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if(co->iores < 0)
+    {
+        errno = -co->iores;
+        return -1;
+    }
+    return co->iores;
+}
+
+ssize_t coro_recv(int fd, void* buf, size_t n, int timeout)
+{
+    return ring_io(fd, buf, n, 0, timeout);
+}
+
+ssize_t coro_send(int fd, const void* buf, size_t n, int timeout)
+{
+    return ring_io(fd, (void*)buf, n, 1, timeout);
+}
+
+int coro_poll(struct pollfd* fds, int nfds, int timeout)
+{
+    struct coro* co = current;
+    int ready;
+    if(co)
+    {
+        int i;
+        int armed = 0;
+        for(i = 0; i < nfds; i++)
+        {
+            if(fds[i].fd < 0)
+                continue;
+            if(arm(co, fds[i].fd, fds[i].events) < 0)
+                break;
+            armed = i + 1;
+        }
+        if(i == nfds)
+            suspend(co, timeout);
+        //the ones that didn't fire are still armed
+        for(i = 0; i < armed; i++)
+        {
+            if(fds[i].fd >= 0)
+                epoll_ctl(co->worker->epfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+        }
+        timeout = 0; //(then poll() says which are ready)
+    }
+    while((ready = poll(fds, nfds, timeout)) < 0 && errno == EINTR)
+        ;
+    return ready;
+}
+
+int coro_connect(int fd, struct sockaddr* addr, socklen_t len)
+{
+    if(!current)
+        return connect(fd, addr, len);
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int rc = connect(fd, addr, len);
+    if(rc < 0 && errno == EINPROGRESS)
+    {
+        coro_wait(fd, POLLOUT, -1);
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        rc = err ? -1 : 0;
+        errno = err;
+    }
+    int saved = errno;
+    fcntl(fd, F_SETFL, flags);
+    errno = saved;
+    return rc;
+}
+
+void coro_detach(void)
+{
+    struct coro* co = current;
+    if(!co)
+        return;
+    co->state = CO_DETACH;
+    swapcontext(&co->ctx, co->caller);
+}
+
+void coro_exit(void)
+{
+    //(a detached coroutine is no longer current, but it can still end)
+    struct coro* co = current ? current : detachedco;
+    if(!co)
+        return;
+    if(co->done)
+        co->done(co->arg);
+    co->state = CO_DONE;
+    setcontext(co->caller);
+}
+
+int coro_running(void)
+{
+    return current != NULL;
+}
+
+void coro_stats(unsigned long* nspawned, unsigned long* nswitches,
+                unsigned long* ndetached)
+{
+    *nspawned = __atomic_load_n(&spawned, __ATOMIC_RELAXED);
+    *nswitches = __atomic_load_n(&switches, __ATOMIC_RELAXED);
+    *ndetached = __atomic_load_n(&detached, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,86 @@
+/*****
+ ** Coroutines for request handling
+ **
+ ** With -c, connections aren't given a thread each. They're run as
+ ** coroutines on a few worker threads, each with an epoll set of its own.
+ ** The handler code stays the same straight-line code: when a read or
+ ** write on a socket would block, the rio functions (and the other places
+ ** that do socket I/O from a handler) call coro_wait(), which parks the
+ ** coroutine on the socket and switches back to its worker to run whatever
+ ** else is ready. Sockets stay in blocking mode for everyone else; in a
+ ** coroutine the I/O is done with MSG_DONTWAIT instead. Outside a coroutine
+ ** coro_wait() just poll()s, so the same code works in ordinary threads.
+ **
+ ** With io_uring (-u), the rio functions' reads and writes go through a
+ ** ring on each worker instead (coro_recv() and coro_send()): the
+ ** coroutine queues its I/O and switches out, the worker submits what all
+ ** of its coroutines have queued in one go, and it resumes each one as its
+ ** I/O completes.
+ **
+ ** The coroutines are stackful (ucontext), because C has nothing like C++
+ ** coroutines and the handlers block from deep in their call chains. Each
+ ** stack is mapped lazily with a guard page below it.
+ **
+ ** What doesn't go through coro_wait() still blocks its whole worker: name
+ ** lookups, disk reads, and waiting on a lock. A handler that's about to
+ ** hold on to its connection for a long time (a tunnel, an HTTP/2 session)
+ ** or do I/O with a lock held should coro_detach() onto a thread first.
+ **/
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#define COROUTINE_STACK   (512 * 1024) /* bytes of stack per coroutine */
+#define COROUTINE_WORKERS 4            /* worker threads, if not given */
+
+//start the worker threads (they inherit the caller's signal mask), each
+//with an io_uring for its coroutines' socket I/O if uring is set (and the
+//kernel has io_uring). returns 0, or -1 if none could be started
+int coro_start(int workers, int uring);
+
+//run fn(arg) as a coroutine on one of the workers, then done(arg) (if
+//it isn't NULL), which is also called if it's ended by coro_exit().
+//returns 0, or -1 if there wasn't the memory for it
+int coro_spawn(void (*fn)(void* arg), void (*done)(void* arg), void* arg);
+
+//wait up to timeout milliseconds (-1 for ever) until fd is ready for
+//events (POLLIN and/or POLLOUT), suspending the coroutine, or the thread
+//when not in one. returns 1 if it's ready, 0 if the time ran out
+int coro_wait(int fd, short events, int timeout);
+
+//does the calling coroutine's socket I/O go through its worker's io_uring?
+//(never when not in a coroutine)
+int coro_uring(void);
+
+//recv() and send() (as if with MSG_NOSIGNAL) through the worker's
+//io_uring, when coro_uring() says so, suspending the coroutine until they
+//complete or timeout milliseconds (-1 for ever) run out, when they return
+//-1 with errno EAGAIN
+ssize_t coro_recv(int fd, void* buf, size_t n, int timeout);
+ssize_t coro_send(int fd, const void* buf, size_t n, int timeout);
+
+//poll() that only suspends the coroutine
+int coro_poll(struct pollfd* fds, int nfds, int timeout);
+
+//connect() a blocking socket, only suspending the coroutine while the
+//connection is set up. returns what connect() would have
+int coro_connect(int fd, struct sockaddr* addr, socklen_t len);
+
+//move the calling coroutine onto a thread of its own, on which it carries
+//on from here. (does nothing when not in a coroutine)
+void coro_detach(void);
+
+//end the calling coroutine (detached or not), as pthread_exit() would end
+//a thread. returns only when not in a coroutine
+void coro_exit(void);
+
+//are we in a coroutine (that hasn't been detached)?
+int coro_running(void);
+
+//numbers for the diagnostics page
+void coro_stats(unsigned long* spawned, unsigned long* switches,
+                unsigned long* detached);
+
+#endif /* __CORO_H__ */
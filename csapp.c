@@ -4,6 +4,8 @@
  **/
 /* $begin csapp.c */
 #include "csapp.h"
+#include <poll.h>
+#include "coro.h"
 
 /************************** 
  * Error-handling functions
@@ -13,6 +15,7 @@
 void unix_error(char *msg) /* unix-style error */
 {
     fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    coro_exit(); /* a coroutine mustn't take its worker thread with it */
     pthread_exit(NULL);
 }
 /* $end unixerror */
@@ -526,6 +529,70 @@ void V(sem_t *sem)
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
+/*
+ * In a coroutine, socket I/O mustn't block the worker thread: it's tried
+ * with MSG_DONTWAIT, and when it would block the coroutine waits for the
+ * socket instead (for no longer than a blocking call would, if the socket
+ * has a timeout). On a worker with an io_uring it's queued on that
+ * instead, with the same timeout. Anything else is read and written as
+ * usual.
+ */
+static int io_timeout(int fd, int option)
+{
+    struct timeval tv;
+    socklen_t len = sizeof(tv);
+    if (getsockopt(fd, SOL_SOCKET, option, &tv, &len) < 0
+        || (tv.tv_sec == 0 && tv.tv_usec == 0))
+        return -1;
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static ssize_t io_read(int fd, void *buf, size_t n)
+{
+    if (!coro_running())
+        return read(fd, buf, n);
+    if (coro_uring()) {
+        ssize_t rc = coro_recv(fd, buf, n, io_timeout(fd, SO_RCVTIMEO));
+        if (rc < 0 && errno == ENOTSOCK)
+            return read(fd, buf, n);
+        return rc;
+    }
+    for (;;) {
+        ssize_t rc = recv(fd, buf, n, MSG_DONTWAIT);
+        if (rc < 0 && errno == ENOTSOCK)
+            return read(fd, buf, n);
+        if (rc >= 0 || errno != EAGAIN)
+            return rc;
+        if (!coro_wait(fd, POLLIN, io_timeout(fd, SO_RCVTIMEO))) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
+static ssize_t io_write(int fd, void *buf, size_t n)
+{
+    if (!coro_running())
+        return write(fd, buf, n);
+    if (coro_uring()) {
+        ssize_t rc = coro_send(fd, buf, n, io_timeout(fd, SO_SNDTIMEO));
+        if (rc < 0 && errno == ENOTSOCK)
+            return write(fd, buf, n);
+        return rc;
+    }
+    for (;;) {
+        ssize_t rc = send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0 && errno == ENOTSOCK)
+            return write(fd, buf, n);
+        if (rc >= 0 || errno != EAGAIN)
+            return rc;
+        if (!coro_wait(fd, POLLOUT, io_timeout(fd, SO_SNDTIMEO))) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
 /*
  * rio_readn - robustly read n bytes (unbuffered)
  */
@@ -537,7 +604,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-	if ((nread = read(fd, bufp, nleft)) < 0) {
+	if ((nread = io_read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
 	    else
@@ -563,7 +630,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
+	if ((nwritten = io_write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
 	    else
@@ -591,7 +658,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+	rp->rio_cnt = io_read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* interrupted by sig handler return */
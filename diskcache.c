@@ -0,0 +1,549 @@
+/**************
+ ** Disk cache: log-structured second cache tier
+ **
+ ** Layout of the cache directory:
+ **     seg-00000001.log, seg-00000002.log, ...
+ ** Each segment is a sequence of records:
+ **     struct diskrecord | objname | header | data
+ ** The highest-numbered segment is the one being appended to.
+ **/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+
+#include "csapp.h"
+#include "diskcache.h"
+#include "coro.h"
+#include "spool.h"
+
+#ifndef DEBUG
+#define debug_printf(...) {}
+#else
+#define debug_printf(...) printf(__VA_ARGS__)
+#endif
+
+#define DISK_MAGIC 0x32585250 /* "PRX2" */
+#define DISK_INDEX_BUCKETS 16384
+
+//on-disk record header
+struct diskrecord
+{
+    uint32_t magic;
+    uint32_t namelen;
+    uint32_t headerlen;
+    uint32_t datalen;
+    uint32_t hdrlen;   //response header part of the data
+    uint32_t encoding; //of the body
+    uint32_t checksum; //of the data
+};
+
+struct segment
+{
+    unsigned id;
+    int fd;
+    off_t size;
+};
+
+//index entry: where the newest copy of a key lives
+struct diskentry
+{
+    uint64_t hash;
+    char* objname;
+    char* header;
+    unsigned segid;
+    off_t offset; //of the data, not the record
+    int size;
+    int hdrlen;
+    int encoding;
+    struct diskentry* next;
+};
+
+static struct
+{
+    int enabled;   //changed under disklock; read anywhere else atomically
+    int maxobject; //no record holds more than this
+    char dir[MAXLINE-32]; //leaves room for the segment file names
+    //segments, oldest first. the last one is appended to
+    struct segment* segs;
+    int nsegs;
+    int capsegs;
+    off_t totalsize;
+    int nobjects;
+    struct diskentry* buckets[DISK_INDEX_BUCKETS];
+} disk;
+
+pthread_mutex_t disklock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t key_hash(char* objname, char* header)
+{
+    uint64_t h = 14695981039346656037ULL;
+    char* p;
+    for(p = objname; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ 0xff) * 1099511628211ULL; //separator
+    for(p = header; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return h;
+}
+
+static uint32_t data_checksum(void* data, int size)
+{
+    uint32_t h = 2166136261U;
+    unsigned char* p = data;
+    int i;
+    for(i = 0; i < size; i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static void segment_path(char* buf, unsigned id)
+{
+    snprintf(buf, MAXLINE, "%s/seg-%08u.log", disk.dir, id);
+}
+
+static struct segment* find_segment(unsigned id)
+{
+    int i;
+    for(i = 0; i < disk.nsegs; i++)
+    {
+        if(disk.segs[i].id == id)
+            return &disk.segs[i];
+    }
+    return NULL;
+}
+
+static struct diskentry* index_find(uint64_t hash, char* objname, char* header)
+{
+    struct diskentry* e = disk.buckets[hash % DISK_INDEX_BUCKETS];
+    while(e)
+    {
+        if(e->hash == hash && strcmp(e->objname, objname) == 0
+           && strcmp(e->header, header) == 0)
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+//point the index at a record, replacing any older copy of the key
+static void index_insert(uint64_t hash, char* objname, char* header,
+                         unsigned segid, off_t offset, struct diskrecord* rec)
+{
+    struct diskentry* e = index_find(hash, objname, header);
+    if(!e)
+    {
+        e = malloc(sizeof(struct diskentry));
+        e->hash = hash;
+        e->objname = strdup(objname);
+        e->header = strdup(header);
+        e->next = disk.buckets[hash % DISK_INDEX_BUCKETS];
+        disk.buckets[hash % DISK_INDEX_BUCKETS] = e;
+        disk.nobjects++;
+    }
+    e->segid = segid;
+    e->offset = offset;
+    e->size = rec->datalen;
+    e->hdrlen = rec->hdrlen;
+    e->encoding = rec->encoding;
+}
+
+//forget every index entry that points into a segment (or all of them if
+//all is set)
+static void index_drop(unsigned segid, int all)
+{
+    int i;
+    for(i = 0; i < DISK_INDEX_BUCKETS; i++)
+    {
+        struct diskentry** link = &disk.buckets[i];
+        while(*link)
+        {
+            struct diskentry* e = *link;
+            if(all || e->segid == segid)
+            {
+                *link = e->next;
+                free(e->objname);
+                free(e->header);
+                free(e);
+                disk.nobjects--;
+            }
+            else
+            {
+                link = &e->next;
+            }
+        }
+    }
+}
+
+static struct segment* add_segment(unsigned id, int fd, off_t size)
+{
+    if(disk.nsegs == disk.capsegs)
+    {
+        disk.capsegs = disk.capsegs ? disk.capsegs*2 : 16;
+        disk.segs = realloc(disk.segs, disk.capsegs*sizeof(struct segment));
+    }
+    struct segment* s = &disk.segs[disk.nsegs++];
+    s->id = id;
+    s->fd = fd;
+    s->size = size;
+    disk.totalsize += size;
+    return s;
+}
+
+//start a new segment to append to
+static struct segment* roll_segment()
+{
+    char path[MAXLINE];
+    unsigned id = disk.nsegs ? disk.segs[disk.nsegs-1].id+1 : 1;
+    segment_path(path, id);
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Disk cache: can't create %s: %s\n",
+                path, strerror(errno));
+        return NULL;
+    }
+    debug_printf("Disk cache: started segment %u\n", id);
+    return add_segment(id, fd, 0);
+}
+
+//delete the oldest segment and everything in it
+static void drop_oldest_segment()
+{
+    char path[MAXLINE];
+    struct segment* s = &disk.segs[0];
+    debug_printf("Disk cache: dropping segment %u\n", s->id);
+
+    index_drop(s->id, 0);
+    segment_path(path, s->id);
+    unlink(path);
+    //readers that are mid-sendfile hold their own dup of the descriptor
+    close(s->fd);
+    disk.totalsize -= s->size;
+    disk.nsegs--;
+    memmove(&disk.segs[0], &disk.segs[1], disk.nsegs*sizeof(struct segment));
+}
+
+//read the records of a segment into the index. a torn record at the end
+//(from a crash mid-append) ends the scan, and the segment is cut back to the
+//last good record. so does a record whose lengths can't be right, before
+//anything is allocated for it
+static off_t scan_segment(unsigned id, int fd)
+{
+    off_t pos = 0;
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+        return 0;
+    struct diskrecord rec;
+    while(pread(fd, &rec, sizeof(rec), pos) == sizeof(rec))
+    {
+        if(rec.magic != DISK_MAGIC)
+            break;
+        off_t left = st.st_size - pos - (off_t)sizeof(rec);
+        if(rec.namelen > (uint32_t)disk.maxobject
+           || rec.headerlen > (uint32_t)disk.maxobject
+           || rec.datalen > (uint32_t)disk.maxobject
+           || rec.hdrlen > rec.datalen
+           || (off_t)rec.namelen + rec.headerlen + rec.datalen > left)
+        {
+            fprintf(stderr, "Disk cache: bad record in segment %u at %ld\n",
+                    id, (long)pos);
+            break;
+        }
+        size_t len = rec.namelen + 1 + rec.headerlen + 1 + rec.datalen;
+        char* buf = malloc(len);
+        char* name = buf;
+        char* header = buf + rec.namelen + 1;
+        char* data = header + rec.headerlen + 1;
+        off_t p = pos + sizeof(rec);
+        if(pread(fd, name, rec.namelen, p) != (ssize_t)rec.namelen
+           || pread(fd, header, rec.headerlen, p + rec.namelen)
+                != (ssize_t)rec.headerlen
+           || pread(fd, data, rec.datalen, p + rec.namelen + rec.headerlen)
+                != (ssize_t)rec.datalen
+           || data_checksum(data, rec.datalen) != rec.checksum)
+        {
+            free(buf);
+            break;
+        }
+        name[rec.namelen] = '\0';
+        header[rec.headerlen] = '\0';
+        index_insert(key_hash(name, header), name, header, id,
+                     p + rec.namelen + rec.headerlen, &rec);
+        free(buf);
+        pos = p + rec.namelen + rec.headerlen + rec.datalen;
+    }
+    return pos;
+}
+
+static int compare_ids(const void* a, const void* b)
+{
+    unsigned x = *(const unsigned*)a;
+    unsigned y = *(const unsigned*)b;
+    return (x > y) - (x < y);
+}
+
+int disk_cache_init(const char* dir, int maxobject)
+{
+    snprintf(disk.dir, sizeof(disk.dir), "%s", dir);
+    disk.maxobject = maxobject;
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Disk cache: can't create %s: %s\n",
+                dir, strerror(errno));
+        return -1;
+    }
+    DIR* d = opendir(dir);
+    if(!d)
+    {
+        fprintf(stderr, "Disk cache: can't open %s: %s\n",
+                dir, strerror(errno));
+        return -1;
+    }
+
+    //find the existing segments and replay them in order
+    unsigned* ids = NULL;
+    int nids = 0, capids = 0;
+    struct dirent* ent;
+    while((ent = readdir(d)) != NULL)
+    {
+        unsigned id;
+        char tail;
+        if(sscanf(ent->d_name, "seg-%8u.lo%c", &id, &tail) == 2
+           && tail == 'g')
+        {
+            if(nids == capids)
+            {
+                capids = capids ? capids*2 : 16;
+                ids = realloc(ids, capids*sizeof(unsigned));
+            }
+            ids[nids++] = id;
+        }
+    }
+    closedir(d);
+    qsort(ids, nids, sizeof(unsigned), compare_ids);
+
+    int i;
+    for(i = 0; i < nids; i++)
+    {
+        char path[MAXLINE];
+        segment_path(path, ids[i]);
+        int fd = open(path, O_RDWR);
+        if(fd < 0)
+            continue;
+        off_t size = scan_segment(ids[i], fd);
+        if(ftruncate(fd, size) < 0)
+            fprintf(stderr, "Disk cache: can't trim %s\n", path);
+        add_segment(ids[i], fd, size);
+    }
+    free(ids);
+
+    while(disk.totalsize > DISK_CACHE_SIZE && disk.nsegs > 1)
+        drop_oldest_segment();
+    if(disk.nsegs == 0 && !roll_segment())
+        return -1;
+
+    __atomic_store_n(&disk.enabled, 1, __ATOMIC_RELEASE);
+    printf("\tDisk cache in %s: %d objects, %ld bytes\n",
+           dir, disk.nobjects, (long)disk.totalsize);
+    return 0;
+}
+
+int disk_cache_enabled()
+{
+    return __atomic_load_n(&disk.enabled, __ATOMIC_ACQUIRE);
+}
+
+void disk_cache_put(char* objname, char* header, void* data, int size,
+                    int hdrlen, int encoding)
+{
+    if(!disk_cache_enabled() || !objname || !header || !data
+       || size > disk.maxobject)
+        return;
+
+    uint64_t hash = key_hash(objname, header);
+    struct diskrecord rec;
+    rec.magic = DISK_MAGIC;
+    rec.namelen = strlen(objname);
+    rec.headerlen = strlen(header);
+    rec.datalen = size;
+    rec.hdrlen = hdrlen;
+    rec.encoding = encoding;
+    rec.checksum = data_checksum(data, size);
+    size_t reclen = sizeof(rec) + rec.namelen + rec.headerlen + size;
+
+    pthread_mutex_lock(&disklock);
+    //(checked again now it can't change: a clear may have turned it off)
+    if(!disk.enabled || index_find(hash, objname, header))
+    {
+        //already demoted once, and segments are immutable
+        pthread_mutex_unlock(&disklock);
+        return;
+    }
+
+    struct segment* s = &disk.segs[disk.nsegs-1];
+    if(s->size > 0 && s->size + (off_t)reclen > DISK_SEGMENT_SIZE)
+    {
+        s = roll_segment();
+        if(!s)
+        {
+            pthread_mutex_unlock(&disklock);
+            return;
+        }
+    }
+
+    struct iovec iov[4];
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = objname;
+    iov[1].iov_len = rec.namelen;
+    iov[2].iov_base = header;
+    iov[2].iov_len = rec.headerlen;
+    iov[3].iov_base = data;
+    iov[3].iov_len = size;
+    if(pwritev(s->fd, iov, 4, s->size) != (ssize_t)reclen)
+    {
+        fprintf(stderr, "Disk cache: write failed: %s\n", strerror(errno));
+        //cut off whatever part of the record made it out
+        if(ftruncate(s->fd, s->size) < 0)
+            fprintf(stderr, "Disk cache: can't trim segment %u\n", s->id);
+        pthread_mutex_unlock(&disklock);
+        return;
+    }
+    index_insert(hash, objname, header, s->id,
+                 s->size + reclen - size, &rec);
+    s->size += reclen;
+    disk.totalsize += reclen;
+    debug_printf("Disk cache: demoted %s (%d bytes) to segment %u\n",
+                 objname, size, s->id);
+
+    while(disk.totalsize > DISK_CACHE_SIZE && disk.nsegs > 1)
+        drop_oldest_segment();
+    pthread_mutex_unlock(&disklock);
+}
+
+int disk_cache_open(char* objname, char* header, struct diskobject* obj)
+{
+    if(!disk_cache_enabled())
+        return 0;
+
+    uint64_t hash = key_hash(objname, header);
+    obj->fd = -1;
+    obj->mapbase = NULL;
+
+    pthread_mutex_lock(&disklock);
+    struct diskentry* e = disk.enabled ? index_find(hash, objname, header)
+                                       : NULL;
+    if(e)
+    {
+        //dup the descriptor so the segment can be dropped under us
+        obj->fd = dup(find_segment(e->segid)->fd);
+        obj->offset = e->offset;
+        obj->size = e->size;
+        obj->hdrlen = e->hdrlen;
+        obj->encoding = e->encoding;
+    }
+    pthread_mutex_unlock(&disklock);
+    return obj->fd >= 0;
+}
+
+ssize_t disk_cache_send(int connfd, struct diskobject* obj,
+                        off_t from, size_t len)
+{
+    off_t offset = obj->offset + from;
+    size_t left = len;
+    //a coroutine can't block in sendfile(), so it waits for room instead,
+    //and so does a thread, so that a client that stops reading is given up
+    //on just as it would be by the spool (or by its send timeout, if the
+    //socket has one)
+    struct timeval tv;
+    socklen_t tvlen = sizeof(tv);
+    int timeout = SPOOL_STALL_TIMEOUT * 1000;
+    if(getsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, &tvlen) == 0
+       && (tv.tv_sec > 0 || tv.tv_usec > 0))
+        timeout = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    int flags = fcntl(connfd, F_GETFL);
+    fcntl(connfd, F_SETFL, flags | O_NONBLOCK);
+    while(left > 0)
+    {
+        ssize_t n = sendfile(connfd, obj->fd, &offset, left);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EAGAIN)
+        {
+            if(!coro_wait(connfd, POLLOUT, timeout))
+                break; //stalled
+            continue;
+        }
+        if(n <= 0)
+            break;
+        left -= n;
+    }
+    fcntl(connfd, F_SETFL, flags);
+    return left == 0 ? (ssize_t)len : -1;
+}
+
+char* disk_cache_map(struct diskobject* obj)
+{
+    //mmap wants a page-aligned offset
+    off_t pagestart = obj->offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    size_t lead = obj->offset - pagestart;
+    obj->maplen = lead + obj->size;
+    obj->mapbase = mmap(NULL, obj->maplen, PROT_READ, MAP_SHARED,
+                        obj->fd, pagestart);
+    if(obj->mapbase == MAP_FAILED)
+    {
+        obj->mapbase = NULL;
+        return NULL;
+    }
+    return (char*)obj->mapbase + lead;
+}
+
+void disk_cache_close(struct diskobject* obj)
+{
+    if(obj->mapbase)
+        munmap(obj->mapbase, obj->maplen);
+    close(obj->fd);
+}
+
+void disk_cache_clear()
+{
+    if(!disk_cache_enabled())
+        return;
+
+    pthread_mutex_lock(&disklock);
+    if(!disk.enabled)
+    {
+        pthread_mutex_unlock(&disklock);
+        return;
+    }
+    index_drop(0, 1);
+    while(disk.nsegs > 0)
+    {
+        char path[MAXLINE];
+        disk.nsegs--;
+        segment_path(path, disk.segs[disk.nsegs].id);
+        unlink(path);
+        close(disk.segs[disk.nsegs].fd);
+    }
+    disk.totalsize = 0;
+    if(!roll_segment())
+        __atomic_store_n(&disk.enabled, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&disklock);
+}
+
+void disk_cache_stats(int* objects, long* bytes, int* segments)
+{
+    pthread_mutex_lock(&disklock);
+    *objects = disk.nobjects;
+    *bytes = disk.totalsize;
+    *segments = disk.nsegs;
+    pthread_mutex_unlock(&disklock);
+}
@@ -0,0 +1,60 @@
+/*****
+ ** Disk cache: the second cache tier
+ **
+ ** Objects evicted from the in-memory cache are demoted into log-structured
+ ** segment files in a cache directory. An in-memory hash index maps
+ ** (object name, request header) to the newest record for that key, and is
+ ** rebuilt by scanning the segments at startup so a restart comes up warm.
+ ** Segments are only ever appended to; when the tier is over its size limit
+ ** the oldest segment is deleted as a whole.
+ **/
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include <sys/types.h>
+
+#define DISK_SEGMENT_SIZE 4194304    /* 4 MB */
+#define DISK_CACHE_SIZE   67108864   /* 64 MB */
+
+//open (or create) the cache directory and rebuild the index from its
+//segments. objects bigger than maxobject bytes aren't kept, and a record
+//found bigger than that on disk is taken for a corrupt one. returns 0 on
+//success, -1 on error
+int disk_cache_init(const char* dir, int maxobject);
+//is the disk tier enabled?
+int disk_cache_enabled();
+
+//an object found on disk. size, hdrlen and encoding mean the same as they
+//do for an in-memory cache object
+struct diskobject
+{
+    int fd;        //our own descriptor for the segment
+    off_t offset;  //where the object starts in it
+    int size;
+    int hdrlen;
+    int encoding;
+    void* mapbase; //set by disk_cache_map()
+    size_t maplen;
+};
+
+//append an object to the disk tier. objects already present are skipped
+void disk_cache_put(char* objname, char* header, void* data, int size,
+                    int hdrlen, int encoding);
+//find an object. returns 1 and fills in obj if it's there (release it with
+//disk_cache_close()), 0 if not
+int disk_cache_open(char* objname, char* header, struct diskobject* obj);
+//send part of an object to connfd with sendfile()
+//returns the number of bytes sent, or -1 on write error or if the client
+//stops taking it (for SPOOL_STALL_TIMEOUT, or connfd's SO_SNDTIMEO)
+ssize_t disk_cache_send(int connfd, struct diskobject* obj,
+                        off_t from, size_t len);
+//map an object read-only into memory, NULL on error
+char* disk_cache_map(struct diskobject* obj);
+void disk_cache_close(struct diskobject* obj);
+//drop every object and delete every segment
+void disk_cache_clear();
+
+//numbers for the diagnostics page
+void disk_cache_stats(int* objects, long* bytes, int* segments);
+
+#endif /* __DISKCACHE_H__ */
@@ -0,0 +1,1020 @@
+/**************
+ ** HTTP/2 front end, see h2.h
+ **/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "csapp.h"
+#include "hpack.h"
+#include "h2.h"
+
+#define H2_STREAM_CLOSED 0x5
+#define H2_MAX_BUFFERED  (4 * H2_WINDOW) /* request body waiting, per stream */
+
+static unsigned long connections;
+static unsigned long streams;
+
+//one request/response exchange on the connection
+struct h2stream
+{
+    uint32_t id;
+    int fd;         //our end of the handler's socketpair, -1 until it starts
+    int chunked;    //the request body goes to the handler chunked
+    int ended;      //the client has sent all of its request
+    int shut;       //...and the handler has all of it
+    char* in;       //request bytes the handler hasn't taken yet
+    int inlen;
+    int incap;
+    int credit;     //request body taken since we last opened the window
+    long window;    //how much response DATA we may still send
+    char* out;      //response bytes read from the handler, not yet sent
+    int outpos;
+    int outlen;
+    int responding; //sent the response HEADERS
+    int eof;        //the handler is done with the response
+};
+
+struct h2conn
+{
+    int fd;
+    rio_t* rp;
+    void (*handler)(int connfd);
+    struct h2admit* admit; //NULL if every stream is let in
+    struct hpack_table decoder;
+    struct h2stream* streams[H2_MAX_STREAMS];
+    int nstreams;
+    uint32_t lastid;
+    long window;        //connection level window for response DATA
+    long initialwindow; //the client's initial stream window
+    int maxframe;       //the client's SETTINGS_MAX_FRAME_SIZE
+    int goaway;         //the client is going away: no new streams
+    int error;          //what to tell the client when we give up on it
+    int broken;         //a write to the client failed
+    unsigned char* block; //a header block arriving in pieces
+    int blocklen;
+    uint32_t blockstream;
+    int blockflags;
+};
+
+//a request being turned back into HTTP/1 as its headers are decoded
+struct requesthead
+{
+    char* method;
+    char* authority;
+    char* path;
+    char* host;
+    char* headers;
+    int len;
+    int cap;
+    char* cookie;
+    int haslength;
+    int bad;
+};
+
+struct handoff
+{
+    void (*handler)(int connfd);
+    int fd;
+    void (*give)(unsigned client); //NULL if the stream didn't take a turn
+    unsigned client;
+};
+
+static void put32(unsigned char* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//append to a buffer that grows as needed
+static void append(char** buf, int* len, int* cap, const char* data, int n)
+{
+    if(*len + n > *cap)
+    {
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+int h2_read_frame(rio_t* rp, struct h2frame* f, unsigned char* payload,
+                  int maxlen)
+{
+    unsigned char hdr[9];
+    if(rio_readnb(rp, hdr, 9) != 9)
+        return -1;
+    f->length = (hdr[0] << 16) | (hdr[1] << 8) | hdr[2];
+    f->type = hdr[3];
+    f->flags = hdr[4];
+    f->stream = get32(hdr + 5) & 0x7fffffff;
+    if(f->length > maxlen)
+        return -1;
+    if(f->length && rio_readnb(rp, payload, f->length) != f->length)
+        return -1;
+    return 0;
+}
+
+int h2_write_frame(int fd, int type, int flags, uint32_t stream,
+                   void* payload, int len)
+{
+    unsigned char hdr[9];
+    hdr[0] = len >> 16;
+    hdr[1] = len >> 8;
+    hdr[2] = len;
+    hdr[3] = type;
+    hdr[4] = flags;
+    put32(hdr + 5, stream);
+
+    //the header and payload together in one go if we can
+    struct iovec iov[2] = {{hdr, 9}, {payload, len}};
+    ssize_t n;
+    while((n = writev(fd, iov, len ? 2 : 1)) < 0 && errno == EINTR)
+        ;
+    if(n < 0)
+        return -1;
+    if(n < 9)
+    {
+        if(rio_writen(fd, hdr + n, 9 - n) != 9 - n)
+            return -1;
+        n = 9;
+    }
+    n -= 9;
+    if(n < len && rio_writen(fd, (char*)payload + n, len - n) != len - n)
+        return -1;
+    return 0;
+}
+
+//write a frame to the client, remembering if that didn't work
+static void send_frame(struct h2conn* c, int type, int flags, uint32_t stream,
+                       void* payload, int len)
+{
+    if(!c->broken && h2_write_frame(c->fd, type, flags, stream, payload,
+                                    len) < 0)
+        c->broken = 1;
+}
+
+static void send_rst(struct h2conn* c, uint32_t stream, uint32_t code)
+{
+    unsigned char p[4];
+    put32(p, code);
+    send_frame(c, H2_RST_STREAM, 0, stream, p, 4);
+}
+
+static void send_window_update(struct h2conn* c, uint32_t stream, int n)
+{
+    unsigned char p[4];
+    put32(p, n);
+    send_frame(c, H2_WINDOW_UPDATE, 0, stream, p, 4);
+}
+
+static struct h2stream* find_stream(struct h2conn* c, uint32_t id)
+{
+    int i;
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(c->streams[i] && c->streams[i]->id == id)
+            return c->streams[i];
+    }
+    return NULL;
+}
+
+static struct h2stream* new_stream(struct h2conn* c, uint32_t id)
+{
+    int i;
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(!c->streams[i])
+        {
+            struct h2stream* s = calloc(1, sizeof(struct h2stream));
+            s->id = id;
+            s->fd = -1;
+            s->window = c->initialwindow;
+            c->streams[i] = s;
+            c->nstreams++;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+//forget a stream. closing our end of the socketpair is how its handler
+//finds out, if it isn't finished already
+static void end_stream(struct h2conn* c, struct h2stream* s)
+{
+    int i;
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(c->streams[i] == s)
+            c->streams[i] = NULL;
+    }
+    c->nstreams--;
+    if(s->fd >= 0)
+        close(s->fd);
+    free(s->in);
+    free(s->out);
+    free(s);
+}
+
+//the stream's handler is done (or its thread was ended)
+static void stream_done(void* arg)
+{
+    struct handoff* h = arg;
+    if(h->give)
+        h->give(h->client);
+    free(h);
+}
+
+static void* stream_thread(void* arg)
+{
+    pthread_detach(pthread_self());
+    struct handoff* h = arg;
+    pthread_cleanup_push(stream_done, h);
+    h->handler(h->fd);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+//hand a stream's request over to a handler thread, if it's let in. if
+//it isn't, or it can't be started, the stream is refused and forgotten
+static void start_stream(struct h2conn* c, struct h2stream* s)
+{
+    struct h2admit* admit = c->admit;
+    int sv[2];
+    if(admit && admit->take(admit->client) < 0)
+    {
+        send_rst(c, s->id, H2_REFUSED_STREAM);
+        end_stream(c, s);
+        return;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        if(admit)
+            admit->give(admit->client);
+        send_rst(c, s->id, H2_REFUSED_STREAM);
+        end_stream(c, s);
+        return;
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    struct handoff* h = malloc(sizeof(struct handoff));
+    h->handler = c->handler;
+    h->fd = sv[1];
+    h->give = admit ? admit->give : NULL;
+    h->client = admit ? admit->client : 0;
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, stream_thread, h) != 0)
+    {
+        free(h);
+        close(sv[0]);
+        close(sv[1]);
+        if(admit)
+            admit->give(admit->client);
+        send_rst(c, s->id, H2_REFUSED_STREAM);
+        end_stream(c, s);
+        return;
+    }
+    s->fd = sv[0];
+    s->out = malloc(H2_MAX_HEAD);
+}
+
+//the client is done sending. the request goes to the handler now if it
+//was waiting to see whether there'd be a body
+static void request_ended(struct h2conn* c, struct h2stream* s)
+{
+    if(s->ended)
+        return;
+    s->ended = 1;
+    if(s->fd < 0)
+    {
+        append(&s->in, &s->inlen, &s->incap, "\r\n", 2);
+        start_stream(c, s);
+    }
+    else if(s->chunked)
+    {
+        append(&s->in, &s->inlen, &s->incap, "0\r\n\r\n", 5);
+    }
+}
+
+static void set_string(char** field, char* value)
+{
+    free(*field);
+    *field = strdup(value);
+}
+
+//hpack callback for a request's headers
+static void request_header(void* arg, char* name, char* value)
+{
+    struct requesthead* r = arg;
+    if(strpbrk(name, "\r\n") || strpbrk(value, "\r\n"))
+    {
+        //no smuggling extra lines into the HTTP/1 request
+        r->bad = 1;
+        return;
+    }
+    if(name[0] == ':')
+    {
+        //(we only speak http to origins, whatever the scheme)
+        if(strcmp(name, ":method") == 0)
+            set_string(&r->method, value);
+        else if(strcmp(name, ":authority") == 0)
+            set_string(&r->authority, value);
+        else if(strcmp(name, ":path") == 0)
+            set_string(&r->path, value);
+        return;
+    }
+    //headers about the connection mean nothing in HTTP/2, and we answer
+    //Expect ourselves by reading the body right away
+    if(strcasecmp(name, "connection") == 0
+       || strcasecmp(name, "keep-alive") == 0
+       || strcasecmp(name, "proxy-connection") == 0
+       || strcasecmp(name, "transfer-encoding") == 0
+       || strcasecmp(name, "upgrade") == 0
+       || strcasecmp(name, "te") == 0
+       || strcasecmp(name, "expect") == 0)
+        return;
+    if(strcasecmp(name, "host") == 0)
+        set_string(&r->host, value);
+    if(strcasecmp(name, "content-length") == 0)
+        r->haslength = 1;
+    if(r->len + strlen(name) + strlen(value) > H2_MAX_HEAD)
+    {
+        r->bad = 1;
+        return;
+    }
+    if(strcasecmp(name, "cookie") == 0)
+    {
+        //cookies can come split up, but HTTP/1 wants them in one line
+        if(r->cookie)
+        {
+            char* joined = malloc(strlen(r->cookie) + strlen(value) + 3);
+            sprintf(joined, "%s; %s", r->cookie, value);
+            free(r->cookie);
+            r->cookie = joined;
+        }
+        else
+        {
+            r->cookie = strdup(value);
+        }
+        return;
+    }
+    append(&r->headers, &r->len, &r->cap, name, strlen(name));
+    append(&r->headers, &r->len, &r->cap, ": ", 2);
+    append(&r->headers, &r->len, &r->cap, value, strlen(value));
+    append(&r->headers, &r->len, &r->cap, "\r\n", 2);
+}
+
+//hpack callback for trailers, which we don't pass on
+static void ignore_header(void* arg, char* name, char* value)
+{
+    (void)arg;
+    (void)name;
+    (void)value;
+}
+
+//a complete header block: either a new request or a request's trailers
+//returns 0, or -1 on a connection error
+static int header_block(struct h2conn* c, uint32_t id, int flags,
+                        unsigned char* block, int len)
+{
+    struct h2stream* s = find_stream(c, id);
+    struct requesthead r;
+    memset(&r, 0, sizeof(r));
+    //the block has to be decoded whatever we do with it, to keep our copy
+    //of the dynamic table in step with the client's
+    if(hpack_decode(&c->decoder, block, len,
+                    s ? ignore_header : request_header, &r) < 0)
+    {
+        c->error = H2_COMPRESSION_ERROR;
+        return -1;
+    }
+
+    if(s)
+    {
+        if(flags & H2_END_STREAM)
+            request_ended(c, s);
+        return 0;
+    }
+    if(id % 2 == 0 || id <= c->lastid)
+    {
+        c->error = H2_PROTOCOL_ERROR;
+        free(r.method);
+        free(r.authority);
+        free(r.path);
+        free(r.host);
+        free(r.headers);
+        free(r.cookie);
+        return -1;
+    }
+    c->lastid = id;
+
+    char* authority = r.authority ? r.authority : r.host;
+    int connect = r.method && strcmp(r.method, "CONNECT") == 0;
+    if(c->goaway || c->nstreams == H2_MAX_STREAMS)
+    {
+        send_rst(c, id, H2_REFUSED_STREAM);
+    }
+    else if(r.bad || !r.method || !authority || (!connect && !r.path))
+    {
+        send_rst(c, id, H2_PROTOCOL_ERROR);
+    }
+    else
+    {
+        __atomic_add_fetch(&streams, 1, __ATOMIC_RELAXED);
+        s = new_stream(c, id);
+        char line[MAXLINE];
+        if(connect)
+        {
+            //the tunnel's bytes are the DATA frames, both ways
+            snprintf(line, MAXLINE, "CONNECT %s HTTP/1.1\r\n\r\n", authority);
+            append(&s->in, &s->inlen, &s->incap, line, strlen(line));
+        }
+        else
+        {
+            append(&s->in, &s->inlen, &s->incap, r.method, strlen(r.method));
+            append(&s->in, &s->inlen, &s->incap, " http://", 8);
+            append(&s->in, &s->inlen, &s->incap, authority, strlen(authority));
+            append(&s->in, &s->inlen, &s->incap, r.path, strlen(r.path));
+            append(&s->in, &s->inlen, &s->incap, " HTTP/1.0\r\n", 11);
+            if(!r.host)
+            {
+                snprintf(line, MAXLINE, "Host: %s\r\n", authority);
+                append(&s->in, &s->inlen, &s->incap, line, strlen(line));
+            }
+            if(r.len)
+                append(&s->in, &s->inlen, &s->incap, r.headers, r.len);
+            if(r.cookie)
+            {
+                append(&s->in, &s->inlen, &s->incap, "cookie: ", 8);
+                append(&s->in, &s->inlen, &s->incap, r.cookie,
+                       strlen(r.cookie));
+                append(&s->in, &s->inlen, &s->incap, "\r\n", 2);
+            }
+        }
+
+        if(flags & H2_END_STREAM)
+        {
+            request_ended(c, s);
+        }
+        else if(connect || r.haslength)
+        {
+            if(!connect)
+                append(&s->in, &s->inlen, &s->incap, "\r\n", 2);
+            start_stream(c, s);
+        }
+        //otherwise it waits to see if there's a body, which would have to
+        //be sent on chunked
+    }
+    free(r.method);
+    free(r.authority);
+    free(r.path);
+    free(r.host);
+    free(r.headers);
+    free(r.cookie);
+    return 0;
+}
+
+static int data_frame(struct h2conn* c, struct h2frame* f,
+                      unsigned char* payload)
+{
+    if(f->stream == 0)
+    {
+        c->error = H2_PROTOCOL_ERROR;
+        return -1;
+    }
+    int off = 0;
+    int pad = 0;
+    if(f->flags & H2_PADDED)
+    {
+        if(f->length < 1 || payload[0] >= f->length)
+        {
+            c->error = H2_PROTOCOL_ERROR;
+            return -1;
+        }
+        pad = payload[0];
+        off = 1;
+    }
+    //the connection's window is opened again right away; each stream's
+    //only as its handler takes the data
+    if(f->length)
+        send_window_update(c, 0, f->length);
+
+    struct h2stream* s = find_stream(c, f->stream);
+    if(!s || s->ended)
+    {
+        if(f->stream > c->lastid)
+        {
+            c->error = H2_PROTOCOL_ERROR;
+            return -1;
+        }
+        send_rst(c, f->stream, H2_STREAM_CLOSED);
+        return 0;
+    }
+    if(s->inlen > H2_MAX_BUFFERED)
+    {
+        //more than the window we gave it
+        send_rst(c, s->id, H2_FLOW_CONTROL_ERROR);
+        end_stream(c, s);
+        return 0;
+    }
+
+    int n = f->length - off - pad;
+    if(n > 0)
+    {
+        if(s->fd < 0)
+        {
+            //a body without a length
+            s->chunked = 1;
+            append(&s->in, &s->inlen, &s->incap,
+                   "Transfer-Encoding: chunked\r\n\r\n", 30);
+            start_stream(c, s);
+            if(!(s = find_stream(c, f->stream)))
+                return 0;
+        }
+        char size[16];
+        if(s->chunked)
+        {
+            sprintf(size, "%x\r\n", n);
+            append(&s->in, &s->inlen, &s->incap, size, strlen(size));
+        }
+        append(&s->in, &s->inlen, &s->incap, (char*)payload + off, n);
+        if(s->chunked)
+            append(&s->in, &s->inlen, &s->incap, "\r\n", 2);
+    }
+    s->credit += f->length;
+    if(f->flags & H2_END_STREAM)
+        request_ended(c, s);
+    return 0;
+}
+
+static int settings_frame(struct h2conn* c, struct h2frame* f,
+                          unsigned char* payload)
+{
+    if(f->stream != 0)
+    {
+        c->error = H2_PROTOCOL_ERROR;
+        return -1;
+    }
+    if(f->flags & H2_ACK)
+        return 0;
+    if(f->length % 6)
+    {
+        c->error = H2_FRAME_SIZE_ERROR;
+        return -1;
+    }
+    int i, j;
+    for(i = 0; i < f->length; i += 6)
+    {
+        int id = (payload[i] << 8) | payload[i+1];
+        uint32_t value = get32(payload + i + 2);
+        if(id == H2_SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if(value > 0x7fffffff)
+            {
+                c->error = H2_FLOW_CONTROL_ERROR;
+                return -1;
+            }
+            //applies to the streams already open, too
+            long delta = (long)value - c->initialwindow;
+            for(j = 0; j < H2_MAX_STREAMS; j++)
+            {
+                if(c->streams[j])
+                    c->streams[j]->window += delta;
+            }
+            c->initialwindow = value;
+        }
+        else if(id == H2_SETTINGS_MAX_FRAME_SIZE)
+        {
+            if(value < H2_FRAME_SIZE || value > 0xffffff)
+            {
+                c->error = H2_PROTOCOL_ERROR;
+                return -1;
+            }
+            c->maxframe = value;
+        }
+        //(the encoder never uses the dynamic table, so the client's table
+        //size doesn't matter to us)
+    }
+    send_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+    return 0;
+}
+
+static int window_update_frame(struct h2conn* c, struct h2frame* f,
+                               unsigned char* payload)
+{
+    if(f->length != 4)
+    {
+        c->error = H2_FRAME_SIZE_ERROR;
+        return -1;
+    }
+    uint32_t inc = get32(payload) & 0x7fffffff;
+    if(f->stream == 0)
+    {
+        if(inc == 0)
+        {
+            c->error = H2_PROTOCOL_ERROR;
+            return -1;
+        }
+        c->window += inc;
+        return 0;
+    }
+    struct h2stream* s = find_stream(c, f->stream);
+    if(s && inc == 0)
+    {
+        send_rst(c, s->id, H2_PROTOCOL_ERROR);
+        end_stream(c, s);
+    }
+    else if(s)
+    {
+        s->window += inc;
+    }
+    return 0;
+}
+
+//deal with one frame from the client. returns 0, or -1 on a connection
+//error (with c->error set)
+static int process_frame(struct h2conn* c, struct h2frame* f,
+                         unsigned char* payload)
+{
+    if(c->block && f->type != H2_CONTINUATION)
+    {
+        //nothing may come between the pieces of a header block
+        c->error = H2_PROTOCOL_ERROR;
+        return -1;
+    }
+
+    switch(f->type)
+    {
+    case H2_DATA:
+        return data_frame(c, f, payload);
+    case H2_HEADERS:
+    {
+        int off = 0;
+        int pad = 0;
+        if(f->flags & H2_PADDED)
+        {
+            if(f->length < 1)
+                break;
+            pad = payload[0];
+            off = 1;
+        }
+        if(f->flags & H2_PRIORITY_FLAG)
+            off += 5;
+        if(f->stream == 0 || off + pad > f->length)
+            break;
+        if(f->flags & H2_END_HEADERS)
+            return header_block(c, f->stream, f->flags, payload + off,
+                                f->length - off - pad);
+        c->block = malloc(H2_MAX_HEAD);
+        c->blocklen = f->length - off - pad;
+        memcpy(c->block, payload + off, c->blocklen);
+        c->blockstream = f->stream;
+        c->blockflags = f->flags;
+        return 0;
+    }
+    case H2_CONTINUATION:
+    {
+        if(!c->block || f->stream != c->blockstream
+           || c->blocklen + f->length > H2_MAX_HEAD)
+            break;
+        memcpy(c->block + c->blocklen, payload, f->length);
+        c->blocklen += f->length;
+        if(!(f->flags & H2_END_HEADERS))
+            return 0;
+        int ret = header_block(c, c->blockstream, c->blockflags, c->block,
+                               c->blocklen);
+        free(c->block);
+        c->block = NULL;
+        return ret;
+    }
+    case H2_RST_STREAM:
+    {
+        struct h2stream* s = find_stream(c, f->stream);
+        if(s)
+            end_stream(c, s);
+        return 0;
+    }
+    case H2_SETTINGS:
+        return settings_frame(c, f, payload);
+    case H2_PING:
+        if(f->length != 8)
+        {
+            c->error = H2_FRAME_SIZE_ERROR;
+            return -1;
+        }
+        if(!(f->flags & H2_ACK))
+            send_frame(c, H2_PING, H2_ACK, 0, payload, 8);
+        return 0;
+    case H2_GOAWAY:
+        c->goaway = 1;
+        return 0;
+    case H2_WINDOW_UPDATE:
+        return window_update_frame(c, f, payload);
+    case H2_PUSH_PROMISE:
+        //clients can't push
+        break;
+    default:
+        //PRIORITY, and anything we don't know, is ignored
+        return 0;
+    }
+    c->error = H2_PROTOCOL_ERROR;
+    return -1;
+}
+
+//turn an HTTP/1 response head into a HEADERS frame (and CONTINUATIONs if
+//it's too big for one frame)
+static void send_headers(struct h2conn* c, struct h2stream* s, char* head,
+                         int headlen, int flags)
+{
+    unsigned char* block = malloc(H2_MAX_HEAD);
+    int len = 0;
+    int status = 502;
+    sscanf(head, "%*s %d", &status);
+    char value[MAXLINE];
+    sprintf(value, "%d", status);
+    len = hpack_encode(block, H2_MAX_HEAD, ":status", value);
+
+    char* line = memchr(head, '\n', headlen);
+    char* end = head + headlen;
+    while(line && ++line < end)
+    {
+        char* eol = memchr(line, '\n', end - line);
+        if(!eol)
+            break;
+        char* colon = memchr(line, ':', eol - line);
+        if(colon && colon > line)
+        {
+            char name[MAXLINE];
+            int n = colon - line;
+            if(n >= MAXLINE)
+                n = MAXLINE - 1;
+            memcpy(name, line, n);
+            name[n] = '\0';
+            char* v = colon + 1;
+            while(v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            n = eol - v;
+            while(n > 0 && (v[n-1] == '\r' || v[n-1] == ' '))
+                n--;
+            if(n >= MAXLINE)
+                n = MAXLINE - 1;
+            memcpy(value, v, n);
+            value[n] = '\0';
+
+            //the connection's framing is HTTP/2's business now
+            if(strcasecmp(name, "connection") != 0
+               && strcasecmp(name, "keep-alive") != 0
+               && strcasecmp(name, "proxy-connection") != 0
+               && strcasecmp(name, "transfer-encoding") != 0
+               && strcasecmp(name, "upgrade") != 0)
+            {
+                n = hpack_encode(block + len, H2_MAX_HEAD - len, name, value);
+                if(n > 0)
+                    len += n;
+            }
+        }
+        line = eol;
+    }
+
+    int pos = 0;
+    int type = H2_HEADERS;
+    do
+    {
+        int n = (len - pos > c->maxframe) ? c->maxframe : len - pos;
+        int last = (pos + n == len);
+        send_frame(c, type, (type == H2_HEADERS ? flags : 0)
+                            | (last ? H2_END_HEADERS : 0),
+                   s->id, block + pos, n);
+        pos += n;
+        type = H2_CONTINUATION;
+    } while(pos < len);
+    free(block);
+}
+
+//read whatever the handler has for us. a response head is sent on as
+//soon as it's all there; the body is left for send_response()
+static void read_response(struct h2conn* c, struct h2stream* s)
+{
+    if(s->outpos)
+    {
+        memmove(s->out, s->out + s->outpos, s->outlen - s->outpos);
+        s->outlen -= s->outpos;
+        s->outpos = 0;
+    }
+    ssize_t n = read(s->fd, s->out + s->outlen, H2_MAX_HEAD - s->outlen);
+    if(n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if(n <= 0)
+        s->eof = 1;
+    else
+        s->outlen += n;
+
+    while(!s->responding)
+    {
+        char* head = s->out + s->outpos;
+        char* end = memmem(head, s->outlen - s->outpos, "\r\n\r\n", 4);
+        if(!end)
+            break;
+        int headlen = end + 4 - head;
+        int status = 0;
+        sscanf(head, "%*s %d", &status);
+        if(status < 100 || status >= 200)
+        {
+            send_headers(c, s, head, headlen, 0);
+            s->responding = 1;
+        }
+        //(interim responses aren't passed on)
+        s->outpos += headlen;
+    }
+    if(!s->responding && (s->eof || s->outlen == H2_MAX_HEAD))
+    {
+        //the handler didn't give us anything we can make sense of
+        char bad[] = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
+        send_headers(c, s, bad, strlen(bad), H2_END_STREAM);
+        end_stream(c, s);
+    }
+}
+
+//move a stream along: hand its handler what request it can take, and
+//send as much response as the windows allow. the stream may be finished
+//and forgotten on the way
+static void pump_stream(struct h2conn* c, struct h2stream* s)
+{
+    if(s->fd < 0)
+        return;
+
+    if(s->inlen > 0)
+    {
+        ssize_t n = send(s->fd, s->in, s->inlen, MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            memmove(s->in, s->in + n, s->inlen - n);
+            s->inlen -= n;
+        }
+        else if(n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            //the handler isn't reading any more, so it's answering already
+            s->inlen = 0;
+        }
+        if(s->inlen == 0 && s->credit && !s->ended)
+        {
+            send_window_update(c, s->id, s->credit);
+            s->credit = 0;
+        }
+    }
+    if(s->inlen == 0 && s->ended && !s->shut)
+    {
+        shutdown(s->fd, SHUT_WR);
+        s->shut = 1;
+    }
+
+    if(!s->responding)
+        return;
+    while(s->outpos < s->outlen && s->window > 0 && c->window > 0)
+    {
+        long n = s->outlen - s->outpos;
+        if(n > c->maxframe)
+            n = c->maxframe;
+        if(n > s->window)
+            n = s->window;
+        if(n > c->window)
+            n = c->window;
+        send_frame(c, H2_DATA, 0, s->id, s->out + s->outpos, n);
+        s->outpos += n;
+        s->window -= n;
+        c->window -= n;
+    }
+    if(s->outpos == s->outlen && s->eof)
+    {
+        send_frame(c, H2_DATA, H2_END_STREAM, s->id, NULL, 0);
+        //if the client is still sending, it can stop
+        if(!s->ended)
+            send_rst(c, s->id, H2_NO_ERROR);
+        end_stream(c, s);
+    }
+}
+
+void h2_serve(int connfd, rio_t* rp, void (*handler)(int connfd),
+              struct h2admit* admit)
+{
+    //the rest of the preface, after the line that's been read already
+    char rest[8];
+    if(rio_readnb(rp, rest, 8) != 8
+       || memcmp(rest, H2_PREFACE + 16, 8) != 0)
+        return;
+    __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+
+    struct h2conn* c = calloc(1, sizeof(struct h2conn));
+    c->fd = connfd;
+    c->rp = rp;
+    c->handler = handler;
+    c->admit = admit;
+    c->window = H2_WINDOW;
+    c->initialwindow = H2_WINDOW;
+    c->maxframe = H2_FRAME_SIZE;
+    hpack_init(&c->decoder);
+
+    //our settings are the defaults, other than a limit on streams
+    unsigned char settings[6] = {0, H2_SETTINGS_MAX_CONCURRENT_STREAMS};
+    put32(settings + 2, H2_MAX_STREAMS);
+    send_frame(c, H2_SETTINGS, 0, 0, settings, 6);
+
+    unsigned char* payload = malloc(H2_FRAME_SIZE);
+    struct pollfd fds[H2_MAX_STREAMS + 1];
+    struct h2stream* polled[H2_MAX_STREAMS + 1];
+    int i;
+    while(!c->broken)
+    {
+        for(i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            if(c->streams[i])
+                pump_stream(c, c->streams[i]);
+        }
+        if(c->broken || (c->goaway && !c->nstreams))
+            break;
+
+        int nfds = 1;
+        fds[0].fd = connfd;
+        fds[0].events = POLLIN;
+        for(i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            struct h2stream* s = c->streams[i];
+            if(!s || s->fd < 0)
+                continue;
+            short events = 0;
+            if(s->inlen > 0)
+                events |= POLLOUT;
+            //only read a response we have somewhere to send
+            if(!s->eof && (!s->responding || s->outpos == s->outlen))
+                events |= POLLIN;
+            if(!events)
+                continue;
+            fds[nfds].fd = s->fd;
+            fds[nfds].events = events;
+            polled[nfds] = s;
+            nfds++;
+        }
+
+        int timeout = (rp->rio_cnt > 0) ? 0
+                    : c->nstreams ? -1 : H2_IDLE_TIMEOUT * 1000;
+        int ready = poll(fds, nfds, timeout);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0 || (ready == 0 && rp->rio_cnt == 0 && !c->nstreams))
+            break;
+
+        //the streams first: a frame could end one of them
+        for(i = 1; i < nfds; i++)
+        {
+            if(fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                struct h2stream* s = polled[i];
+                if(!s->eof && (!s->responding || s->outpos == s->outlen))
+                    read_response(c, s);
+            }
+        }
+        if(rp->rio_cnt > 0 || fds[0].revents)
+        {
+            struct h2frame f;
+            if(h2_read_frame(rp, &f, payload, H2_FRAME_SIZE) < 0)
+                break;
+            if(process_frame(c, &f, payload) < 0)
+            {
+                unsigned char goaway[8];
+                put32(goaway, c->lastid);
+                put32(goaway + 4, c->error);
+                send_frame(c, H2_GOAWAY, 0, 0, goaway, 8);
+                break;
+            }
+        }
+    }
+
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(c->streams[i])
+            end_stream(c, c->streams[i]);
+    }
+    hpack_free(&c->decoder);
+    free(c->block);
+    free(payload);
+    free(c);
+}
+
+void h2_stats(unsigned long* conns, unsigned long* strms)
+{
+    *conns = __atomic_load_n(&connections, __ATOMIC_RELAXED);
+    *strms = __atomic_load_n(&streams, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,104 @@
+/*****
+ ** HTTP/2 front end (cleartext, prior knowledge)
+ **
+ ** A client that opens its connection with the HTTP/2 preface gets all of
+ ** its requests multiplexed over that one connection. Each stream is turned
+ ** back into an HTTP/1 request and handed to the ordinary request handler
+ ** in a thread of its own, over a socketpair, so streams go through the same
+ ** cache lookup and origin fetch as every other request and a slow one
+ ** doesn't hold up the rest. The handler's HTTP/1 response is read back off
+ ** the socketpair and sent to the client as HEADERS and DATA frames.
+ **
+ ** The connection's own thread does all the framing: it reads frames from
+ ** the client, feeds request bodies to the handlers, and sends responses
+ ** as far as the client's flow control windows allow. A response is only
+ ** read from its handler while it can be sent, so a stream the client
+ ** isn't reading backs up into its handler instead of into our memory.
+ **/
+#ifndef __H2_H__
+#define __H2_H__
+
+#include <stdint.h>
+
+//(needs rio_t from csapp.h, which has to be included first)
+
+#define H2_PREFACE       "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_MAX_STREAMS   100   /* concurrent streams per connection */
+#define H2_FRAME_SIZE    16384 /* the default SETTINGS_MAX_FRAME_SIZE */
+#define H2_WINDOW        65535 /* the default initial window size */
+#define H2_MAX_HEAD      65536 /* biggest header block, either way */
+#define H2_IDLE_TIMEOUT  60    /* seconds without a stream */
+
+//frame types
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+//frame flags
+#define H2_END_STREAM    0x1
+#define H2_ACK           0x1
+#define H2_END_HEADERS   0x4
+#define H2_PADDED        0x8
+#define H2_PRIORITY_FLAG 0x20
+
+//error codes
+#define H2_NO_ERROR          0x0
+#define H2_PROTOCOL_ERROR    0x1
+#define H2_INTERNAL_ERROR    0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR  0x6
+#define H2_REFUSED_STREAM    0x7
+#define H2_CANCEL            0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+//settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE      0x1
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+
+struct h2frame
+{
+    int length;
+    int type;
+    int flags;
+    uint32_t stream;
+};
+
+//how a connection's streams are let in, when they have to be: a stream
+//is only started if take(client) returns 0, and is refused (with
+//REFUSED_STREAM) otherwise. give(client) is called once its handler is
+//done, however that ends
+struct h2admit
+{
+    int (*take)(unsigned client);
+    void (*give)(unsigned client);
+    unsigned client; //who the connection is from, as take and give know it
+};
+
+//serve an HTTP/2 connection, once its first line ("PRI * HTTP/2.0") has
+//been read through rp. each stream is handed to handler as a connection
+//of its own, which handler has to close, if admit lets it in (every
+//stream is, when admit is NULL). returns when the client is done
+void h2_serve(int connfd, rio_t* rp, void (*handler)(int connfd),
+              struct h2admit* admit);
+
+//read a frame, with its payload (up to maxlen bytes) into payload
+//returns 0, or -1 if the connection broke or the frame was too big
+int h2_read_frame(rio_t* rp, struct h2frame* f, unsigned char* payload,
+                  int maxlen);
+//write a frame. returns 0, or -1 on a write error
+int h2_write_frame(int fd, int type, int flags, uint32_t stream,
+                   void* payload, int len);
+
+//numbers for the diagnostics page
+void h2_stats(unsigned long* connections, unsigned long* streams);
+
+#endif /* __H2_H__ */
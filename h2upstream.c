@@ -0,0 +1,1117 @@
+/**************
+ ** HTTP/2 to origins, see h2upstream.h
+ **/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "csapp.h"
+#include "hpack.h"
+#include "h2.h"
+#include "h2upstream.h"
+
+#define H2_UPSTREAM_IDLE 30 /* seconds a connection with no streams is kept */
+
+//where we are in reading a request off a stream's socketpair
+#define REQ_HEAD      0
+#define REQ_BODY      1 /* Content-Length bytes */
+#define REQ_CHUNK     2 /* a chunk size line */
+#define REQ_CHUNKDATA 3
+#define REQ_CHUNKEND  4 /* the CRLF after a chunk */
+#define REQ_TRAILERS  5
+#define REQ_DONE      6
+
+//one request/response exchange
+struct ustream
+{
+    uint32_t id;    //0 until its HEADERS have gone out
+    int fd;         //our end of the socketpair
+    int state;      //REQ_*
+    long remaining; //of the body, or of this chunk
+    char* in;       //request bytes read but not sent on yet
+    int inlen;
+    long window;    //how much request DATA we may send
+    char* out;      //response bytes for the proxy to read
+    int outpos;
+    int outlen;
+    int outcap;
+    int credit;     //response DATA passed on since we last opened the window
+    int responded;  //the response has its head
+    int chunked;    //...and its body is going to the proxy chunked
+    int ended;      //the origin is done with the stream
+};
+
+//one HTTP/2 connection to an origin
+struct session
+{
+    char* hostname;
+    int port;
+    int fd;
+    rio_t rio;
+    int wake[2];        //a byte arrives here when a stream is added
+    //(the stream slots, nstreams, maxstreams, dead and initialwindow are
+    //under the lock)
+    struct ustream* streams[H2_MAX_STREAMS];
+    int nstreams;
+    int maxstreams;     //the origin's SETTINGS_MAX_CONCURRENT_STREAMS
+    int dead;           //no new streams
+    uint32_t nextid;
+    long window;        //connection level window for request DATA
+    long initialwindow; //the origin's initial stream window
+    int maxframe;       //the origin's SETTINGS_MAX_FRAME_SIZE
+    int error;          //what to tell the origin when we give up on it
+    int broken;         //a write to the origin failed
+    struct hpack_table decoder;
+    unsigned char* block; //a header block arriving in pieces
+    int blocklen;
+    uint32_t blockstream;
+    int blockflags;
+};
+
+//an origin that answered the preface with something other than HTTP/2
+struct plainorigin
+{
+    char* hostname;
+    int port;
+    time_t until;
+};
+
+//a response head being turned back into HTTP/1
+struct responsehead
+{
+    int status;
+    char* headers;
+    int len;
+    int cap;
+    int haslength;
+};
+
+static struct session* sessions[H2_UPSTREAM_SESSIONS];
+static struct plainorigin plain[H2_UPSTREAM_SESSIONS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long opened;
+static unsigned long streamcount;
+
+static void put32(unsigned char* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void append(char** buf, int* len, int* cap, const char* data, int n)
+{
+    if(*len + n > *cap)
+    {
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+static void send_frame(struct session* c, int type, int flags,
+                       uint32_t stream, void* payload, int len)
+{
+    if(!c->broken && h2_write_frame(c->fd, type, flags, stream, payload,
+                                    len) < 0)
+        c->broken = 1;
+}
+
+static void send_rst(struct session* c, uint32_t stream, uint32_t code)
+{
+    unsigned char p[4];
+    put32(p, code);
+    send_frame(c, H2_RST_STREAM, 0, stream, p, 4);
+}
+
+static void send_window_update(struct session* c, uint32_t stream, int n)
+{
+    unsigned char p[4];
+    put32(p, n);
+    send_frame(c, H2_WINDOW_UPDATE, 0, stream, p, 4);
+}
+
+static struct ustream* find_stream(struct session* c, uint32_t id)
+{
+    struct ustream* s = NULL;
+    int i;
+    pthread_mutex_lock(&lock);
+    for(i = 0; i < H2_MAX_STREAMS && !s; i++)
+    {
+        if(c->streams[i] && c->streams[i]->id == id)
+            s = c->streams[i];
+    }
+    pthread_mutex_unlock(&lock);
+    return s;
+}
+
+//forget a stream. closing our end of the socketpair is how the proxy
+//finds out the response is over (or that it isn't coming)
+static void remove_stream(struct session* c, struct ustream* s)
+{
+    int i;
+    pthread_mutex_lock(&lock);
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(c->streams[i] == s)
+            c->streams[i] = NULL;
+    }
+    c->nstreams--;
+    pthread_mutex_unlock(&lock);
+    close(s->fd);
+    free(s->in);
+    free(s->out);
+    free(s);
+}
+
+static void cancel_stream(struct session* c, struct ustream* s, int code)
+{
+    if(s->id && !s->ended)
+        send_rst(c, s->id, code);
+    remove_stream(c, s);
+}
+
+//pull the next "Name: value" line out of a header block
+//returns 1 and advances *line, or 0 at the end
+static int next_header(char** line, char* end, char* name, char* value)
+{
+    while(*line < end)
+    {
+        char* eol = memchr(*line, '\n', end - *line);
+        if(!eol)
+            return 0;
+        char* start = *line;
+        *line = eol + 1;
+        char* colon = memchr(start, ':', eol - start);
+        if(!colon || colon == start)
+            continue;
+        int n = colon - start;
+        if(n >= MAXLINE)
+            n = MAXLINE - 1;
+        memcpy(name, start, n);
+        name[n] = '\0';
+        char* v = colon + 1;
+        while(v < eol && (*v == ' ' || *v == '\t'))
+            v++;
+        n = eol - v;
+        while(n > 0 && (v[n-1] == '\r' || v[n-1] == ' '))
+            n--;
+        if(n >= MAXLINE)
+            n = MAXLINE - 1;
+        memcpy(value, v, n);
+        value[n] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+//headers that only describe an HTTP/1 connection
+static int hop_by_hop(char* name)
+{
+    return strcasecmp(name, "connection") == 0
+        || strcasecmp(name, "keep-alive") == 0
+        || strcasecmp(name, "proxy-connection") == 0
+        || strcasecmp(name, "transfer-encoding") == 0
+        || strcasecmp(name, "upgrade") == 0;
+}
+
+//send an HTTP/1 request head as HEADERS (and CONTINUATIONs), and work out
+//how its body is delimited. returns 0, or -1 if it made no sense
+static int send_request_headers(struct session* c, struct ustream* s,
+                                char* head, int headlen)
+{
+    char method[32];
+    char path[MAXLINE];
+    if(sscanf(head, "%31s %8191s", method, path) != 2)
+        return -1;
+    char* end = head + headlen;
+    char* first = memchr(head, '\n', headlen);
+    if(!first)
+        return -1;
+    first++;
+
+    char name[MAXLINE];
+    char value[MAXLINE];
+    char authority[MAXLINE];
+    snprintf(authority, MAXLINE, "%s:%d", c->hostname, c->port);
+    s->state = REQ_DONE;
+    char* line = first;
+    while(next_header(&line, end, name, value))
+    {
+        if(strcasecmp(name, "host") == 0)
+            strcpy(authority, value);
+        else if(strcasecmp(name, "content-length") == 0
+                && (s->remaining = atol(value)) > 0)
+            s->state = REQ_BODY;
+        else if(strcasecmp(name, "transfer-encoding") == 0
+                && strcasestr(value, "chunked"))
+            s->state = REQ_CHUNK;
+    }
+
+    unsigned char* block = malloc(H2_MAX_HEAD);
+    int len = 0;
+    int n;
+    char* pseudo[][2] = {
+        {":method", method}, {":scheme", "http"},
+        {":authority", authority}, {":path", path}
+    };
+    int i;
+    for(i = 0; i < 4; i++)
+    {
+        n = hpack_encode(block + len, H2_MAX_HEAD - len, pseudo[i][0],
+                         pseudo[i][1]);
+        if(n < 0)
+        {
+            free(block);
+            return -1;
+        }
+        len += n;
+    }
+    line = first;
+    while(next_header(&line, end, name, value))
+    {
+        if(hop_by_hop(name) || strcasecmp(name, "host") == 0
+           || (strcasecmp(name, "te") == 0 && strcasecmp(value, "trailers")))
+            continue;
+        n = hpack_encode(block + len, H2_MAX_HEAD - len, name, value);
+        if(n < 0)
+        {
+            free(block);
+            return -1;
+        }
+        len += n;
+    }
+
+    s->id = c->nextid;
+    c->nextid += 2;
+    int pos = 0;
+    int type = H2_HEADERS;
+    do
+    {
+        n = (len - pos > c->maxframe) ? c->maxframe : len - pos;
+        int flags = (pos + n == len) ? H2_END_HEADERS : 0;
+        if(type == H2_HEADERS && s->state == REQ_DONE)
+            flags |= H2_END_STREAM;
+        send_frame(c, type, flags, s->id, block + pos, n);
+        pos += n;
+        type = H2_CONTINUATION;
+    } while(pos < len);
+    free(block);
+    return 0;
+}
+
+static void consume(struct ustream* s, int n)
+{
+    memmove(s->in, s->in + n, s->inlen - n);
+    s->inlen -= n;
+}
+
+//send on as much of a stream's request as we have and the windows allow
+//(the stream may be cancelled on the way)
+static void advance_request(struct session* c, struct ustream* s)
+{
+    int progress = 1;
+    while(progress && s->state != REQ_DONE)
+    {
+        progress = 0;
+        char* nl = memchr(s->in, '\n', s->inlen);
+        switch(s->state)
+        {
+        case REQ_HEAD:
+        {
+            char* end = memmem(s->in, s->inlen, "\r\n\r\n", 4);
+            if(!end)
+            {
+                if(s->inlen == H2_MAX_HEAD)
+                    cancel_stream(c, s, H2_CANCEL);
+                return;
+            }
+            int headlen = end + 4 - s->in;
+            if(send_request_headers(c, s, s->in, headlen) < 0)
+            {
+                cancel_stream(c, s, H2_CANCEL);
+                return;
+            }
+            consume(s, headlen);
+            progress = 1;
+            break;
+        }
+        case REQ_BODY:
+        case REQ_CHUNKDATA:
+        {
+            long n = s->inlen;
+            if(n > s->remaining)
+                n = s->remaining;
+            if(n > s->window)
+                n = s->window;
+            if(n > c->window)
+                n = c->window;
+            if(n > c->maxframe)
+                n = c->maxframe;
+            if(n <= 0)
+                break;
+            s->remaining -= n;
+            int last = (s->state == REQ_BODY && s->remaining == 0);
+            send_frame(c, H2_DATA, last ? H2_END_STREAM : 0, s->id, s->in, n);
+            s->window -= n;
+            c->window -= n;
+            consume(s, n);
+            if(s->remaining == 0)
+                s->state = last ? REQ_DONE : REQ_CHUNKEND;
+            progress = 1;
+            break;
+        }
+        case REQ_CHUNK:
+            if(!nl)
+                break;
+            s->remaining = strtol(s->in, NULL, 16);
+            s->state = (s->remaining > 0) ? REQ_CHUNKDATA : REQ_TRAILERS;
+            consume(s, nl + 1 - s->in);
+            progress = 1;
+            break;
+        case REQ_CHUNKEND:
+            if(!nl)
+                break;
+            s->state = REQ_CHUNK;
+            consume(s, nl + 1 - s->in);
+            progress = 1;
+            break;
+        case REQ_TRAILERS:
+            //(trailers aren't passed on)
+            if(!nl)
+                break;
+            if(nl - s->in <= 1)
+            {
+                send_frame(c, H2_DATA, H2_END_STREAM, s->id, NULL, 0);
+                s->state = REQ_DONE;
+            }
+            consume(s, nl + 1 - s->in);
+            progress = 1;
+            break;
+        }
+    }
+}
+
+//take what the proxy has written to a stream
+static void read_request(struct session* c, struct ustream* s)
+{
+    char discard[MAXLINE];
+    ssize_t n;
+    if(s->state == REQ_DONE)
+        n = read(s->fd, discard, MAXLINE);
+    else
+        n = read(s->fd, s->in + s->inlen, H2_MAX_HEAD - s->inlen);
+    if(n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if(n <= 0)
+    {
+        //the proxy has given up on it
+        cancel_stream(c, s, H2_CANCEL);
+        return;
+    }
+    if(s->state != REQ_DONE)
+    {
+        s->inlen += n;
+        advance_request(c, s);
+    }
+}
+
+//hand the proxy as much of the response as it'll take. returns 1 if the
+//stream is still around
+static int flush_response(struct session* c, struct ustream* s)
+{
+    if(s->outpos < s->outlen)
+    {
+        ssize_t n = send(s->fd, s->out + s->outpos, s->outlen - s->outpos,
+                         MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            s->outpos += n;
+        }
+        else if(n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            cancel_stream(c, s, H2_CANCEL);
+            return 0;
+        }
+    }
+    if(s->outpos == s->outlen)
+    {
+        s->outpos = 0;
+        s->outlen = 0;
+        if(s->ended)
+        {
+            remove_stream(c, s);
+            return 0;
+        }
+        //only open the window again once the proxy has taken it all
+        if(s->credit)
+        {
+            send_window_update(c, s->id, s->credit);
+            s->credit = 0;
+        }
+    }
+    return 1;
+}
+
+//hpack callback for a response's headers
+static void response_header(void* arg, char* name, char* value)
+{
+    struct responsehead* r = arg;
+    if(strcmp(name, ":status") == 0)
+    {
+        r->status = atoi(value);
+        return;
+    }
+    if(name[0] == ':' || hop_by_hop(name) || strpbrk(name, "\r\n")
+       || strpbrk(value, "\r\n"))
+        return;
+    if(strcasecmp(name, "content-length") == 0)
+        r->haslength = 1;
+    append(&r->headers, &r->len, &r->cap, name, strlen(name));
+    append(&r->headers, &r->len, &r->cap, ": ", 2);
+    append(&r->headers, &r->len, &r->cap, value, strlen(value));
+    append(&r->headers, &r->len, &r->cap, "\r\n", 2);
+}
+
+static void ignore_header(void* arg, char* name, char* value)
+{
+    (void)arg;
+    (void)name;
+    (void)value;
+}
+
+static void response_ended(struct ustream* s)
+{
+    if(s->chunked)
+        append(&s->out, &s->outlen, &s->outcap, "0\r\n\r\n", 5);
+    s->ended = 1;
+}
+
+//a complete header block: a response head, an interim response, or
+//trailers. returns 0, or -1 on a connection error
+static int header_block(struct session* c, uint32_t id, int flags,
+                        unsigned char* block, int len)
+{
+    struct ustream* s = find_stream(c, id);
+    struct responsehead r;
+    memset(&r, 0, sizeof(r));
+    if(hpack_decode(&c->decoder, block, len,
+                    (s && !s->responded) ? response_header : ignore_header,
+                    &r) < 0)
+    {
+        free(r.headers);
+        c->error = H2_COMPRESSION_ERROR;
+        return -1;
+    }
+    if(s && !s->responded && r.status >= 200)
+    {
+        //a body without a length goes to the proxy chunked, so it can
+        //tell a finished response from one the origin gave up on
+        s->chunked = !r.haslength && !(flags & H2_END_STREAM);
+        char line[MAXLINE];
+        sprintf(line, "HTTP/1.1 %d \r\n", r.status);
+        append(&s->out, &s->outlen, &s->outcap, line, strlen(line));
+        if(r.len)
+            append(&s->out, &s->outlen, &s->outcap, r.headers, r.len);
+        if(s->chunked)
+            append(&s->out, &s->outlen, &s->outcap,
+                   "Transfer-Encoding: chunked\r\n", 28);
+        append(&s->out, &s->outlen, &s->outcap, "Connection: close\r\n\r\n",
+               21);
+        s->responded = 1;
+    }
+    else if(s && !s->responded && !(r.status >= 100 && r.status < 200))
+    {
+        //no status
+        free(r.headers);
+        cancel_stream(c, s, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    //(interim responses and trailers aren't passed on)
+    free(r.headers);
+    if(s && s->responded && (flags & H2_END_STREAM))
+        response_ended(s);
+    return 0;
+}
+
+static int data_frame(struct session* c, struct h2frame* f,
+                      unsigned char* payload)
+{
+    int off = 0;
+    int pad = 0;
+    if(f->stream == 0)
+    {
+        c->error = H2_PROTOCOL_ERROR;
+        return -1;
+    }
+    if(f->flags & H2_PADDED)
+    {
+        if(f->length < 1 || payload[0] >= f->length)
+        {
+            c->error = H2_PROTOCOL_ERROR;
+            return -1;
+        }
+        pad = payload[0];
+        off = 1;
+    }
+    if(f->length)
+        send_window_update(c, 0, f->length);
+
+    struct ustream* s = find_stream(c, f->stream);
+    if(!s || s->ended)
+        return 0;
+    if(!s->responded)
+    {
+        cancel_stream(c, s, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    int n = f->length - off - pad;
+    if(n > 0 && s->chunked)
+    {
+        char size[16];
+        sprintf(size, "%x\r\n", n);
+        append(&s->out, &s->outlen, &s->outcap, size, strlen(size));
+        append(&s->out, &s->outlen, &s->outcap, (char*)payload + off, n);
+        append(&s->out, &s->outlen, &s->outcap, "\r\n", 2);
+    }
+    else if(n > 0)
+    {
+        append(&s->out, &s->outlen, &s->outcap, (char*)payload + off, n);
+    }
+    s->credit += f->length;
+    if(f->flags & H2_END_STREAM)
+        response_ended(s);
+    return 0;
+}
+
+static int settings_frame(struct session* c, struct h2frame* f,
+                          unsigned char* payload)
+{
+    if(f->stream != 0)
+    {
+        c->error = H2_PROTOCOL_ERROR;
+        return -1;
+    }
+    if(f->flags & H2_ACK)
+        return 0;
+    if(f->length % 6)
+    {
+        c->error = H2_FRAME_SIZE_ERROR;
+        return -1;
+    }
+    int i, j;
+    for(i = 0; i < f->length; i += 6)
+    {
+        int id = (payload[i] << 8) | payload[i+1];
+        uint32_t value = get32(payload + i + 2);
+        if(id == H2_SETTINGS_MAX_CONCURRENT_STREAMS)
+        {
+            pthread_mutex_lock(&lock);
+            c->maxstreams = (value < H2_MAX_STREAMS) ? value : H2_MAX_STREAMS;
+            pthread_mutex_unlock(&lock);
+        }
+        else if(id == H2_SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if(value > 0x7fffffff)
+            {
+                c->error = H2_FLOW_CONTROL_ERROR;
+                return -1;
+            }
+            //(new streams take their window from it under the lock)
+            pthread_mutex_lock(&lock);
+            long delta = (long)value - c->initialwindow;
+            for(j = 0; j < H2_MAX_STREAMS; j++)
+            {
+                if(c->streams[j])
+                    c->streams[j]->window += delta;
+            }
+            c->initialwindow = value;
+            pthread_mutex_unlock(&lock);
+        }
+        else if(id == H2_SETTINGS_MAX_FRAME_SIZE)
+        {
+            if(value < H2_FRAME_SIZE || value > 0xffffff)
+            {
+                c->error = H2_PROTOCOL_ERROR;
+                return -1;
+            }
+            c->maxframe = value;
+        }
+    }
+    send_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+    return 0;
+}
+
+//the origin is going away: streams it never got to can be retried by the
+//proxy, which sees them closed without a response
+static void goaway_frame(struct session* c, unsigned char* payload, int len)
+{
+    uint32_t last = (len >= 4) ? (get32(payload) & 0x7fffffff) : 0;
+    int i;
+    pthread_mutex_lock(&lock);
+    c->dead = 1;
+    pthread_mutex_unlock(&lock);
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        pthread_mutex_lock(&lock);
+        struct ustream* s = c->streams[i];
+        pthread_mutex_unlock(&lock);
+        if(s && (s->id == 0 || s->id > last))
+            remove_stream(c, s);
+    }
+}
+
+//deal with one frame from the origin. returns 0, or -1 on a connection
+//error (with c->error set)
+static int process_frame(struct session* c, struct h2frame* f,
+                         unsigned char* payload)
+{
+    if(c->block && f->type != H2_CONTINUATION)
+    {
+        c->error = H2_PROTOCOL_ERROR;
+        return -1;
+    }
+
+    switch(f->type)
+    {
+    case H2_DATA:
+        return data_frame(c, f, payload);
+    case H2_HEADERS:
+    {
+        int off = 0;
+        int pad = 0;
+        if(f->flags & H2_PADDED)
+        {
+            if(f->length < 1)
+                break;
+            pad = payload[0];
+            off = 1;
+        }
+        if(f->flags & H2_PRIORITY_FLAG)
+            off += 5;
+        if(f->stream == 0 || off + pad > f->length)
+            break;
+        if(f->flags & H2_END_HEADERS)
+            return header_block(c, f->stream, f->flags, payload + off,
+                                f->length - off - pad);
+        c->block = malloc(H2_MAX_HEAD);
+        c->blocklen = f->length - off - pad;
+        memcpy(c->block, payload + off, c->blocklen);
+        c->blockstream = f->stream;
+        c->blockflags = f->flags;
+        return 0;
+    }
+    case H2_CONTINUATION:
+    {
+        if(!c->block || f->stream != c->blockstream
+           || c->blocklen + f->length > H2_MAX_HEAD)
+            break;
+        memcpy(c->block + c->blocklen, payload, f->length);
+        c->blocklen += f->length;
+        if(!(f->flags & H2_END_HEADERS))
+            return 0;
+        int ret = header_block(c, c->blockstream, c->blockflags, c->block,
+                               c->blocklen);
+        free(c->block);
+        c->block = NULL;
+        return ret;
+    }
+    case H2_RST_STREAM:
+    {
+        //whatever we had of the response is all there'll be
+        struct ustream* s = find_stream(c, f->stream);
+        if(s)
+            remove_stream(c, s);
+        return 0;
+    }
+    case H2_SETTINGS:
+        return settings_frame(c, f, payload);
+    case H2_PING:
+        if(f->length != 8)
+        {
+            c->error = H2_FRAME_SIZE_ERROR;
+            return -1;
+        }
+        if(!(f->flags & H2_ACK))
+            send_frame(c, H2_PING, H2_ACK, 0, payload, 8);
+        return 0;
+    case H2_GOAWAY:
+        goaway_frame(c, payload, f->length);
+        return 0;
+    case H2_WINDOW_UPDATE:
+    {
+        if(f->length != 4)
+        {
+            c->error = H2_FRAME_SIZE_ERROR;
+            return -1;
+        }
+        uint32_t inc = get32(payload) & 0x7fffffff;
+        if(f->stream == 0)
+        {
+            c->window += inc;
+            return 0;
+        }
+        struct ustream* s = find_stream(c, f->stream);
+        if(s)
+            s->window += inc;
+        return 0;
+    }
+    case H2_PUSH_PROMISE:
+        //we said no to push
+        break;
+    default:
+        return 0;
+    }
+    c->error = H2_PROTOCOL_ERROR;
+    return -1;
+}
+
+static void* session_thread(void* arg)
+{
+    pthread_detach(pthread_self());
+    struct session* c = arg;
+    unsigned char* payload = malloc(H2_FRAME_SIZE);
+    struct pollfd fds[H2_MAX_STREAMS + 2];
+    struct ustream* polled[H2_MAX_STREAMS + 2];
+    int i;
+    while(!c->broken)
+    {
+        //move every stream along as far as it'll go
+        struct ustream* active[H2_MAX_STREAMS];
+        pthread_mutex_lock(&lock);
+        memcpy(active, c->streams, sizeof(active));
+        int done = c->dead && !c->nstreams;
+        pthread_mutex_unlock(&lock);
+        if(done)
+            break;
+        for(i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            if(!active[i])
+                continue;
+            advance_request(c, active[i]);
+        }
+        pthread_mutex_lock(&lock);
+        memcpy(active, c->streams, sizeof(active));
+        pthread_mutex_unlock(&lock);
+        int nfds = 2;
+        fds[0].fd = c->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = c->wake[0];
+        fds[1].events = POLLIN;
+        for(i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            struct ustream* s = active[i];
+            if(!s || !flush_response(c, s))
+                continue;
+            short events = 0;
+            if(s->outlen)
+                events |= POLLOUT;
+            //in the middle of the body, only read what we could send
+            if(((s->state == REQ_BODY || s->state == REQ_CHUNKDATA)
+                && s->window > 0 && c->window > 0)
+               || (s->state != REQ_BODY && s->state != REQ_CHUNKDATA
+                   && s->inlen < H2_MAX_HEAD))
+                events |= POLLIN;
+            fds[nfds].fd = s->fd;
+            fds[nfds].events = events;
+            polled[nfds] = s;
+            nfds++;
+        }
+        if(c->broken)
+            break;
+
+        pthread_mutex_lock(&lock);
+        int idle = !c->nstreams;
+        pthread_mutex_unlock(&lock);
+        int timeout = (c->rio.rio_cnt > 0) ? 0
+                    : idle ? H2_UPSTREAM_IDLE * 1000 : -1;
+        int ready = poll(fds, nfds, timeout);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0)
+            break;
+        if(ready == 0 && c->rio.rio_cnt == 0)
+        {
+            pthread_mutex_lock(&lock);
+            if(!c->nstreams)
+                c->dead = 1;
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+
+        for(i = 2; i < nfds; i++)
+        {
+            if(fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                read_request(c, polled[i]);
+        }
+        if(fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            ssize_t drained = read(c->wake[0], drain, sizeof(drain));
+            (void)drained;
+        }
+        if(c->rio.rio_cnt > 0 || fds[0].revents)
+        {
+            struct h2frame f;
+            if(h2_read_frame(&c->rio, &f, payload, H2_FRAME_SIZE) < 0)
+                break;
+            if(process_frame(c, &f, payload) < 0)
+            {
+                unsigned char goaway[8];
+                put32(goaway, 0);
+                put32(goaway + 4, c->error);
+                send_frame(c, H2_GOAWAY, 0, 0, goaway, 8);
+                break;
+            }
+        }
+    }
+
+    //take it out of the registry first, so nobody adds to it while it goes
+    pthread_mutex_lock(&lock);
+    c->dead = 1;
+    for(i = 0; i < H2_UPSTREAM_SESSIONS; i++)
+    {
+        if(sessions[i] == c)
+            sessions[i] = NULL;
+    }
+    close(c->wake[0]);
+    close(c->wake[1]);
+    pthread_mutex_unlock(&lock);
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(c->streams[i])
+            remove_stream(c, c->streams[i]);
+    }
+    close(c->fd);
+    hpack_free(&c->decoder);
+    free(c->block);
+    free(c->hostname);
+    free(c);
+    free(payload);
+    return NULL;
+}
+
+//open a connection and see if the origin speaks HTTP/2. *reachable is set
+//if it at least answered. returns the session, not yet running, or NULL
+static struct session* handshake(char* hostname, int port,
+                                 int (*connect)(char* hostname, int port),
+                                 int* reachable)
+{
+    int fd = connect(hostname, port);
+    *reachable = (fd >= 0);
+    if(fd < 0)
+        return NULL;
+
+    struct session* c = calloc(1, sizeof(struct session));
+    c->hostname = strdup(hostname);
+    c->port = port;
+    c->fd = fd;
+    c->nextid = 1;
+    c->window = H2_WINDOW;
+    c->initialwindow = H2_WINDOW;
+    c->maxframe = H2_FRAME_SIZE;
+    c->maxstreams = H2_MAX_STREAMS;
+    hpack_init(&c->decoder);
+    rio_readinitb(&c->rio, fd);
+
+    //we don't want pushes
+    unsigned char settings[6] = {0, 0x2};
+    put32(settings + 2, 0);
+    struct timeval wait = {H2_UPSTREAM_HANDSHAKE, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    struct h2frame f;
+    unsigned char* payload = malloc(H2_FRAME_SIZE);
+    int ok = rio_writen(fd, H2_PREFACE, strlen(H2_PREFACE)) > 0
+          && h2_write_frame(fd, H2_SETTINGS, 0, 0, settings, 6) == 0
+          && h2_read_frame(&c->rio, &f, payload, H2_FRAME_SIZE) == 0
+          && f.type == H2_SETTINGS && !(f.flags & H2_ACK)
+          && settings_frame(c, &f, payload) == 0
+          && !c->broken
+          && pipe2(c->wake, O_NONBLOCK) == 0;
+    free(payload);
+    if(!ok)
+    {
+        close(fd);
+        hpack_free(&c->decoder);
+        free(c->hostname);
+        free(c);
+        return NULL;
+    }
+    //frames are only read once poll() says one has started arriving, but
+    //one that then stops short mustn't hold up every stream for ever
+    wait.tv_sec = H2_UPSTREAM_FRAME;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    return c;
+}
+
+//(with the lock held) has this origin turned HTTP/2 down lately?
+static int is_plain(char* hostname, int port)
+{
+    time_t now = time(NULL);
+    int i;
+    for(i = 0; i < H2_UPSTREAM_SESSIONS; i++)
+    {
+        if(plain[i].hostname && plain[i].port == port
+           && strcmp(plain[i].hostname, hostname) == 0)
+            return plain[i].until > now;
+    }
+    return 0;
+}
+
+static void mark_plain(char* hostname, int port)
+{
+    time_t now = time(NULL);
+    int i;
+    int slot = 0;
+    for(i = 0; i < H2_UPSTREAM_SESSIONS; i++)
+    {
+        if(!plain[i].hostname || plain[i].until <= now
+           || (plain[i].port == port
+               && strcmp(plain[i].hostname, hostname) == 0))
+        {
+            slot = i;
+            break;
+        }
+        if(plain[i].until < plain[slot].until)
+            slot = i;
+    }
+    free(plain[slot].hostname);
+    plain[slot].hostname = strdup(hostname);
+    plain[slot].port = port;
+    plain[slot].until = now + H2_UPSTREAM_RETRY;
+}
+
+int h2upstream_get(char* hostname, int port,
+                   int (*connect)(char* hostname, int port))
+{
+    pthread_mutex_lock(&lock);
+    if(is_plain(hostname, port))
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    //a connection to the origin with room for another stream
+    struct session* c = NULL;
+    int toorigin = 0;
+    int freeslot = -1;
+    int i;
+    for(i = 0; i < H2_UPSTREAM_SESSIONS; i++)
+    {
+        struct session* s = sessions[i];
+        if(!s)
+        {
+            freeslot = i;
+            continue;
+        }
+        if(s->port != port || strcmp(s->hostname, hostname) || s->dead)
+            continue;
+        toorigin++;
+        if(s->nstreams < s->maxstreams && (!c || s->nstreams < c->nstreams))
+            c = s;
+    }
+
+    if(!c)
+    {
+        if(toorigin >= H2_UPSTREAM_PER_ORIGIN || freeslot < 0)
+        {
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        //hold the slot while we shake hands, with no room for streams so
+        //nobody picks it, so that a burst of misses to the origin opens a
+        //connection or two rather than one each
+        struct session* held = calloc(1, sizeof(struct session));
+        held->hostname = strdup(hostname);
+        held->port = port;
+        sessions[freeslot] = held;
+        pthread_mutex_unlock(&lock);
+        int reachable;
+        c = handshake(hostname, port, connect, &reachable);
+        pthread_mutex_lock(&lock);
+        sessions[freeslot] = NULL;
+        free(held->hostname);
+        free(held);
+        if(!c)
+        {
+            if(reachable)
+                mark_plain(hostname, port);
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, session_thread, c) != 0)
+        {
+            pthread_mutex_unlock(&lock);
+            close(c->fd);
+            close(c->wake[0]);
+            close(c->wake[1]);
+            hpack_free(&c->decoder);
+            free(c->hostname);
+            free(c);
+            return -1;
+        }
+        sessions[freeslot] = c;
+        opened++;
+    }
+
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    struct ustream* s = calloc(1, sizeof(struct ustream));
+    s->fd = sv[0];
+    s->state = REQ_HEAD;
+    s->in = malloc(H2_MAX_HEAD);
+    s->window = c->initialwindow;
+    for(i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(!c->streams[i])
+        {
+            c->streams[i] = s;
+            break;
+        }
+    }
+    c->nstreams++;
+    streamcount++;
+    //(while we hold the lock the session can't go away)
+    char wake = 1;
+    ssize_t woken = write(c->wake[1], &wake, 1);
+    (void)woken;
+    pthread_mutex_unlock(&lock);
+    return sv[1];
+}
+
+void h2upstream_stats(int* open, unsigned long* connections,
+                      unsigned long* streams)
+{
+    int i;
+    pthread_mutex_lock(&lock);
+    *open = 0;
+    for(i = 0; i < H2_UPSTREAM_SESSIONS; i++)
+    {
+        if(sessions[i])
+            (*open)++;
+    }
+    *connections = opened;
+    *streams = streamcount;
+    pthread_mutex_unlock(&lock);
+}
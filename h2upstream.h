@@ -0,0 +1,38 @@
+/*****
+ ** HTTP/2 to origins
+ **
+ ** With the h2origin feature on, requests to an origin go out as streams
+ ** over a few shared HTTP/2 connections (cleartext, prior knowledge)
+ ** instead of one TCP connection each, so a burst of misses doesn't cost a
+ ** burst of handshakes and sockets. The first connection to an origin finds
+ ** out whether it speaks HTTP/2 at all: one that answers the preface with
+ ** anything but SETTINGS is left to HTTP/1 for H2_UPSTREAM_RETRY seconds.
+ **
+ ** To the rest of the proxy a stream looks like any other connection to the
+ ** origin: h2upstream_get() hands back one end of a socketpair, which takes
+ ** an HTTP/1.1 request and gives back an HTTP/1.1 response that ends when
+ ** the socketpair is closed (so it never lands in the keep-alive pool).
+ ** Each origin connection has a thread that turns the requests into frames
+ ** and the frames back into responses, as far as the flow control windows
+ ** allow in each direction.
+ **/
+#ifndef __H2UPSTREAM_H__
+#define __H2UPSTREAM_H__
+
+#define H2_UPSTREAM_SESSIONS   16  /* HTTP/2 connections, all origins */
+#define H2_UPSTREAM_PER_ORIGIN 2   /* ...and to any one origin */
+#define H2_UPSTREAM_RETRY      300 /* seconds before retrying an HTTP/1 origin */
+#define H2_UPSTREAM_HANDSHAKE  2   /* seconds to wait for the origin's SETTINGS */
+#define H2_UPSTREAM_FRAME      5   /* ...and for the rest of a frame it began */
+
+//open a stream to hostname:port, over an existing connection if one has
+//room, or a new one made with connect(). returns the proxy's end of the
+//stream, which the caller closes, or -1 to use HTTP/1 instead
+int h2upstream_get(char* hostname, int port,
+                   int (*connect)(char* hostname, int port));
+
+//numbers for the diagnostics page
+void h2upstream_stats(int* sessions, unsigned long* opened,
+                      unsigned long* streams);
+
+#endif /* __H2UPSTREAM_H__ */
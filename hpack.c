@@ -0,0 +1,388 @@
+/**************
+ ** HPACK header compression for HTTP/2, see hpack.h
+ **/
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+#define HUFFMAN_SYMBOLS 257 /* every octet, then EOS */
+#define HUFFMAN_MAXBITS 30
+
+static const struct hpack_entry static_table[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""},
+    {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""},
+    {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+    {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+    {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+    {"via", ""}, {"www-authenticate", ""}
+};
+#define STATIC_ENTRIES (int)(sizeof(static_table) / sizeof(static_table[0]))
+
+//the length of each symbol's Huffman code (RFC 7541 appendix B). the code
+//is canonical, so the codes themselves follow from the lengths
+static const unsigned char huffman_lengths[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+//canonical decoding tables: for each code length, the first code of that
+//length, how many there are, and where their symbols start in sorted[]
+static unsigned firstcode[HUFFMAN_MAXBITS+1];
+static int lengthcount[HUFFMAN_MAXBITS+1];
+static int firstsymbol[HUFFMAN_MAXBITS+1];
+static short sorted[HUFFMAN_SYMBOLS];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_build()
+{
+    int len, sym;
+    for(sym = 0; sym < HUFFMAN_SYMBOLS; sym++)
+        lengthcount[huffman_lengths[sym]]++;
+    unsigned code = 0;
+    int pos = 0;
+    for(len = 1; len <= HUFFMAN_MAXBITS; len++)
+    {
+        firstcode[len] = code;
+        firstsymbol[len] = pos;
+        for(sym = 0; sym < HUFFMAN_SYMBOLS; sym++)
+        {
+            if(huffman_lengths[sym] == len)
+                sorted[pos++] = sym;
+        }
+        code = (code + lengthcount[len]) << 1;
+    }
+}
+
+//decode a Huffman coded string into out (which has room for maxlen bytes
+//and a terminator). returns the decoded length, or -1
+static int huffman_decode(unsigned char* in, int inlen, char* out, int maxlen)
+{
+    pthread_once(&huffman_once, huffman_build);
+    int outlen = 0;
+    unsigned code = 0;
+    int len = 0;
+    int ones = 1; //are the bits since the last symbol all 1s?
+    int i, bit;
+    for(i = 0; i < inlen; i++)
+    {
+        for(bit = 7; bit >= 0; bit--)
+        {
+            int b = (in[i] >> bit) & 1;
+            code = (code << 1) | b;
+            len++;
+            ones = ones && b;
+            if(code - firstcode[len] < (unsigned)lengthcount[len])
+            {
+                int sym = sorted[firstsymbol[len] + code - firstcode[len]];
+                //EOS never appears in a string, and neither does a NUL
+                //that we'd have to pass on to an HTTP/1 header
+                if(sym == 256 || sym == 0 || outlen == maxlen)
+                    return -1;
+                out[outlen++] = sym;
+                code = 0;
+                len = 0;
+                ones = 1;
+            }
+            else if(len == HUFFMAN_MAXBITS)
+            {
+                return -1;
+            }
+        }
+    }
+    //the padding is the start of EOS: fewer than 8 bits, all 1s
+    if(len > 7 || !ones)
+        return -1;
+    out[outlen] = '\0';
+    return outlen;
+}
+
+//read an integer with an n-bit prefix. returns 0 and advances *pos, or -1
+static int read_integer(unsigned char* in, int len, int* pos, int n,
+                        unsigned* value)
+{
+    if(*pos >= len)
+        return -1;
+    unsigned mask = (1 << n) - 1;
+    unsigned v = in[(*pos)++] & mask;
+    if(v == mask)
+    {
+        int shift = 0;
+        unsigned char b;
+        do
+        {
+            if(*pos >= len || shift > 21)
+                return -1;
+            b = in[(*pos)++];
+            v += (unsigned)(b & 0x7f) << shift;
+            shift += 7;
+        } while(b & 0x80);
+    }
+    *value = v;
+    return 0;
+}
+
+//read a string literal into a new buffer. returns it, or NULL
+static char* read_string(unsigned char* in, int len, int* pos)
+{
+    if(*pos >= len)
+        return NULL;
+    int huffman = in[*pos] & 0x80;
+    unsigned n;
+    if(read_integer(in, len, pos, 7, &n) < 0 || n > HPACK_MAX_STRING
+       || n > (unsigned)(len - *pos))
+        return NULL;
+    char* s;
+    if(huffman)
+    {
+        //each symbol is at least 5 bits
+        int maxlen = n * 8 / 5;
+        s = malloc(maxlen + 1);
+        if(huffman_decode(in + *pos, n, s, maxlen) < 0)
+        {
+            free(s);
+            return NULL;
+        }
+    }
+    else
+    {
+        if(memchr(in + *pos, '\0', n))
+            return NULL;
+        s = malloc(n + 1);
+        memcpy(s, in + *pos, n);
+        s[n] = '\0';
+    }
+    *pos += n;
+    return s;
+}
+
+void hpack_init(struct hpack_table* t)
+{
+    t->count = 0;
+    t->size = 0;
+    t->maxsize = HPACK_TABLE_SIZE;
+}
+
+static void evict_oldest(struct hpack_table* t)
+{
+    struct hpack_entry* e = &t->entries[--t->count];
+    t->size -= strlen(e->name) + strlen(e->value) + 32;
+    free(e->name);
+    free(e->value);
+}
+
+void hpack_free(struct hpack_table* t)
+{
+    while(t->count)
+        evict_oldest(t);
+}
+
+//add an entry to the dynamic table, taking over the strings
+static void table_add(struct hpack_table* t, char* name, char* value)
+{
+    int size = strlen(name) + strlen(value) + 32;
+    while(t->count && t->size + size > t->maxsize)
+        evict_oldest(t);
+    if(size > t->maxsize)
+    {
+        //too big for the table: it just ends up empty
+        free(name);
+        free(value);
+        return;
+    }
+    memmove(&t->entries[1], &t->entries[0],
+            t->count * sizeof(struct hpack_entry));
+    t->entries[0].name = name;
+    t->entries[0].value = value;
+    t->count++;
+    t->size += size;
+}
+
+//look up an index in the static table followed by the dynamic one
+static struct hpack_entry* table_get(struct hpack_table* t, unsigned index)
+{
+    if(index == 0)
+        return NULL;
+    if(index <= STATIC_ENTRIES)
+        return (struct hpack_entry*)&static_table[index-1];
+    index -= STATIC_ENTRIES + 1;
+    return (index < (unsigned)t->count) ? &t->entries[index] : NULL;
+}
+
+int hpack_decode(struct hpack_table* t, unsigned char* block, int len,
+                 void (*emit)(void* arg, char* name, char* value), void* arg)
+{
+    int pos = 0;
+    int headers = 0;
+    while(pos < len)
+    {
+        unsigned char b = block[pos];
+        unsigned index;
+        if(b & 0x80)
+        {
+            //indexed header field
+            if(read_integer(block, len, &pos, 7, &index) < 0)
+                return -1;
+            struct hpack_entry* e = table_get(t, index);
+            if(!e)
+                return -1;
+            emit(arg, e->name, e->value);
+            headers++;
+            continue;
+        }
+        if((b & 0xe0) == 0x20)
+        {
+            //dynamic table size update, only allowed before any header
+            if(read_integer(block, len, &pos, 5, &index) < 0
+               || index > HPACK_TABLE_SIZE || headers)
+                return -1;
+            t->maxsize = index;
+            while(t->count && t->size > t->maxsize)
+                evict_oldest(t);
+            continue;
+        }
+
+        //a literal, which is added to the table if it's 01xxxxxx
+        int indexing = (b & 0xc0) == 0x40;
+        if(read_integer(block, len, &pos, indexing ? 6 : 4, &index) < 0)
+            return -1;
+        char* name;
+        if(index)
+        {
+            struct hpack_entry* e = table_get(t, index);
+            if(!e)
+                return -1;
+            name = strdup(e->name);
+        }
+        else if(!(name = read_string(block, len, &pos)))
+        {
+            return -1;
+        }
+        char* value = read_string(block, len, &pos);
+        if(!value)
+        {
+            free(name);
+            return -1;
+        }
+        emit(arg, name, value);
+        headers++;
+        if(indexing)
+        {
+            table_add(t, name, value);
+        }
+        else
+        {
+            free(name);
+            free(value);
+        }
+    }
+    return 0;
+}
+
+//write an integer with an n-bit prefix (and the first byte's other bits).
+//returns the bytes written, or -1
+static int write_integer(unsigned char* out, int outlen, int n,
+                         unsigned char flags, unsigned value)
+{
+    unsigned mask = (1 << n) - 1;
+    int pos = 0;
+    if(outlen < 1)
+        return -1;
+    if(value < mask)
+    {
+        out[pos++] = flags | value;
+        return pos;
+    }
+    out[pos++] = flags | mask;
+    value -= mask;
+    while(value >= 0x80)
+    {
+        if(pos >= outlen)
+            return -1;
+        out[pos++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if(pos >= outlen)
+        return -1;
+    out[pos++] = value;
+    return pos;
+}
+
+//write a plain (not Huffman coded) string literal, lowercased if asked
+static int write_string(unsigned char* out, int outlen, char* s, int lower)
+{
+    int len = strlen(s);
+    int n = write_integer(out, outlen, 7, 0, len);
+    if(n < 0 || n + len > outlen)
+        return -1;
+    int i;
+    for(i = 0; i < len; i++)
+        out[n+i] = lower ? tolower((unsigned char)s[i]) : s[i];
+    return n + len;
+}
+
+int hpack_encode(unsigned char* out, int outlen, char* name, char* value)
+{
+    //the best static entry: the name and value, or failing that the name
+    int nameindex = 0;
+    int i;
+    for(i = 0; i < STATIC_ENTRIES; i++)
+    {
+        if(strcasecmp(static_table[i].name, name) != 0)
+            continue;
+        if(strcmp(static_table[i].value, value) == 0 && *value)
+            return write_integer(out, outlen, 7, 0x80, i+1);
+        if(!nameindex)
+            nameindex = i+1;
+    }
+
+    //literal header field without indexing
+    int pos = write_integer(out, outlen, 4, 0x00, nameindex);
+    if(pos < 0)
+        return -1;
+    if(!nameindex)
+    {
+        int n = write_string(out + pos, outlen - pos, name, 1);
+        if(n < 0)
+            return -1;
+        pos += n;
+    }
+    int n = write_string(out + pos, outlen - pos, value, 0);
+    if(n < 0)
+        return -1;
+    return pos + n;
+}
@@ -0,0 +1,45 @@
+/*****
+ ** HPACK header compression for HTTP/2 (RFC 7541)
+ **
+ ** The decoder keeps the dynamic table that the peer's encoder builds up
+ ** (one per connection and direction) and understands every representation,
+ ** Huffman coded strings included. The encoder only ever refers to the
+ ** static table and otherwise writes literals that aren't added to the
+ ** dynamic table, which is always valid and means we never have to keep a
+ ** table of our own in step with the peer.
+ **/
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#define HPACK_TABLE_SIZE 4096 /* SETTINGS_HEADER_TABLE_SIZE, the default */
+#define HPACK_MAX_STRING 16384 /* longest name or value we'll decode */
+
+struct hpack_entry
+{
+    char* name;
+    char* value;
+};
+
+//a decoder's dynamic table, newest entry first
+struct hpack_table
+{
+    struct hpack_entry entries[HPACK_TABLE_SIZE / 32];
+    int count;
+    int size;    //octets, counting 32 per entry like the RFC does
+    int maxsize; //as last set by the encoder, up to HPACK_TABLE_SIZE
+};
+
+void hpack_init(struct hpack_table* t);
+void hpack_free(struct hpack_table* t);
+
+//decode a complete header block, calling emit with each header in order
+//(the strings are only valid during the call). returns 0, or -1 if the
+//block is malformed, which is fatal to the whole connection
+int hpack_decode(struct hpack_table* t, unsigned char* block, int len,
+                 void (*emit)(void* arg, char* name, char* value), void* arg);
+
+//append a header to a block being encoded (the name is lowercased on the
+//way). returns the bytes written, or -1 if it didn't fit in outlen
+int hpack_encode(unsigned char* out, int outlen, char* name, char* value);
+
+#endif /* __HPACK_H__ */
@@ -0,0 +1,607 @@
+/**************
+ ** Load generator, for make loadtest
+ **
+ ** Sends GETs through the proxy (or straight to the origin, without -x)
+ ** for URLs made from a pattern with a %d in it, the number picked with a
+ ** Zipf distribution over -n of them, so a few are asked for a lot and
+ ** most hardly at all, the way real traffic goes.
+ **
+ ** Closed loop (the default), each of the -c connections sends its next
+ ** request as soon as the last one is answered. Open loop (-r), requests
+ ** are due at a steady rate, Poisson spaced, whether the answers are
+ ** keeping up or not, and a request's latency counts from when it was due,
+ ** so time spent waiting for a free connection counts too. With -k
+ ** connections are kept open between requests when the other end allows.
+ **
+ ** At the end it prints the throughput, the latency percentiles and, when
+ ** going through the proxy, the hit ratio over the run (from the proxy's
+ ** /metrics page). Nothing from the first -w seconds is counted.
+ **
+ **     loadgen [-x proxyhost:port] [-c connections] [-d seconds]
+ **             [-w warmup seconds] [-r requests/sec] [-n urls] [-s zipf s]
+ **             [-k] http://host:port/path-with-%d
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define LOADGEN_CONNECTIONS 16
+#define LOADGEN_SECONDS     10
+#define LOADGEN_WARMUP      2
+#define LOADGEN_URLS        1000
+#define LOADGEN_ZIPF        1.0
+#define LOADGEN_BUFFER      65536
+
+//the run, as the command line set it
+static char* proxy;         //host:port, or NULL to go straight to the origin
+static char* pattern;       //the URL, with a %d for which one
+static char origin[256];    //host:port from the pattern
+static int connections = LOADGEN_CONNECTIONS;
+static double seconds = LOADGEN_SECONDS;
+static double warmup = LOADGEN_WARMUP;
+static double rate;         //requests a second, open loop (0 for closed)
+static int urls = LOADGEN_URLS;
+static double zipf_s = LOADGEN_ZIPF;
+static int keepalive;
+
+static double* zipf_cdf;    //urls of them
+static struct addrinfo* target;
+static long long started;   //ns, when the warmup ends
+static long long ending;    //ns, when the run ends
+
+//open loop: when the next request is due
+static pthread_mutex_t schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long next_due;
+
+struct worker
+{
+    pthread_t tid;
+    unsigned long long rng;
+    long long* latencies;   //us, of each request counted
+    long count;
+    long room;
+    unsigned long errors;   //no answer, or not a 2xx
+    unsigned long connects;
+    unsigned long bytes;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long when)
+{
+    struct timespec ts;
+    ts.tv_sec = when / 1000000000LL;
+    ts.tv_nsec = when % 1000000000LL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+//xorshift64*, as a double in [0, 1)
+static double uniform(unsigned long long* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ULL) >> 11)
+           * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void)
+{
+    zipf_cdf = malloc(urls * sizeof(double));
+    double total = 0;
+    int i;
+    for(i = 0; i < urls; i++)
+        total += 1 / pow(i + 1, zipf_s);
+    double sum = 0;
+    for(i = 0; i < urls; i++)
+    {
+        sum += 1 / pow(i + 1, zipf_s) / total;
+        zipf_cdf[i] = sum;
+    }
+    zipf_cdf[urls - 1] = 1;
+}
+
+//which URL (0 the most popular)
+static int zipf_pick(unsigned long long* rng)
+{
+    double u = uniform(rng);
+    int lo = 0, hi = urls - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*****
+ * HTTP
+ *****/
+struct conn
+{
+    int fd;
+    char buf[LOADGEN_BUFFER];
+    int pos;
+    int len;
+};
+
+static int conn_open(struct conn* c)
+{
+    c->fd = socket(target->ai_family, SOCK_STREAM, 0);
+    if(c->fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(c->fd, target->ai_addr, target->ai_addrlen) < 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->pos = c->len = 0;
+    return 0;
+}
+
+static void conn_close(struct conn* c)
+{
+    if(c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+//make sure there's something buffered. returns 0 at the end
+static int conn_fill(struct conn* c)
+{
+    if(c->pos < c->len)
+        return 1;
+    int n;
+    do
+        n = read(c->fd, c->buf, sizeof(c->buf));
+    while(n < 0 && errno == EINTR);
+    if(n <= 0)
+        return 0;
+    c->pos = 0;
+    c->len = n;
+    return 1;
+}
+
+//a line, without its CRLF. returns -1 at the end
+static int conn_line(struct conn* c, char* line, int max)
+{
+    int n = 0;
+    for(;;)
+    {
+        if(!conn_fill(c))
+            return -1;
+        char ch = c->buf[c->pos++];
+        if(ch == '\n')
+            break;
+        if(ch != '\r' && n < max - 1)
+            line[n++] = ch;
+    }
+    line[n] = '\0';
+    return n;
+}
+
+//skip n bytes of body (or up to the end, if n is -1). returns how many
+//there were, or -1 if it ended early
+static long conn_skip(struct conn* c, long n)
+{
+    long skipped = 0;
+    while(n < 0 || skipped < n)
+    {
+        if(!conn_fill(c))
+            return (n < 0) ? skipped : -1;
+        long have = c->len - c->pos;
+        if(n >= 0 && have > n - skipped)
+            have = n - skipped;
+        c->pos += have;
+        skipped += have;
+    }
+    return skipped;
+}
+
+//send a request for url and read the whole answer. returns the body's
+//length, or -1 if there's no good answer. *reuse says whether the
+//connection can take another
+static long fetch(struct conn* c, char* url, int* reuse)
+{
+    char request[2048];
+    char* path = url;
+    if(!proxy)
+    {
+        path = strchr(url + strlen("http://"), '/');
+        if(!path)
+            path = "/";
+    }
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, origin,
+                       keepalive ? "" : "Connection: close\r\n");
+    int sent = 0;
+    while(sent < len)
+    {
+        int n = write(c->fd, request + sent, len - sent);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        sent += n;
+    }
+
+    char line[LOADGEN_BUFFER];
+    if(conn_line(c, line, sizeof(line)) < 0)
+        return -1;
+    int minor = 0, status = 0;
+    if(sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2)
+        return -1;
+    *reuse = keepalive && minor >= 1;
+    long length = -1;
+    int chunked = 0;
+    for(;;)
+    {
+        int n = conn_line(c, line, sizeof(line));
+        if(n < 0)
+            return -1;
+        if(n == 0)
+            break;
+        if(strncasecmp(line, "Content-Length:", 15) == 0)
+            length = atol(line + 15);
+        else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0
+                && strstr(line + 18, "chunked"))
+            chunked = 1;
+        else if(strncasecmp(line, "Connection:", 11) == 0)
+        {
+            if(strstr(line + 11, "close"))
+                *reuse = 0;
+            else if(strstr(line + 11, "eep-alive"))
+                *reuse = keepalive;
+        }
+    }
+
+    long body = 0;
+    if(chunked)
+    {
+        for(;;)
+        {
+            if(conn_line(c, line, sizeof(line)) < 0)
+                return -1;
+            long size = strtol(line, NULL, 16);
+            if(size == 0)
+                break;
+            if(conn_skip(c, size) < 0 || conn_line(c, line, sizeof(line)) < 0)
+                return -1;
+            body += size;
+        }
+        //trailers, to the blank line
+        int n;
+        while((n = conn_line(c, line, sizeof(line))) > 0)
+            ;
+        if(n < 0)
+            return -1;
+    }
+    else if(length >= 0)
+    {
+        if(conn_skip(c, length) < 0)
+            return -1;
+        body = length;
+    }
+    else
+    {
+        //until they close it
+        body = conn_skip(c, -1);
+        *reuse = 0;
+    }
+    return (status >= 200 && status < 300) ? body : -1;
+}
+
+/*****
+ * The run
+ *****/
+static void record(struct worker* w, long long due, long long done)
+{
+    if(due < started || due >= ending)
+        return;
+    if(w->count == w->room)
+    {
+        w->room = w->room ? w->room * 2 : 4096;
+        w->latencies = realloc(w->latencies, w->room * sizeof(long long));
+    }
+    w->latencies[w->count++] = (done - due) / 1000;
+}
+
+static void* worker(void* arg)
+{
+    struct worker* w = arg;
+    struct conn* c = malloc(sizeof(struct conn));
+    c->fd = -1;
+    char url[2048];
+    for(;;)
+    {
+        long long due;
+        if(rate > 0)
+        {
+            //take the next slot, and wait for it
+            pthread_mutex_lock(&schedule_lock);
+            due = next_due;
+            next_due += (long long)(-log(1 - uniform(&w->rng)) / rate * 1e9);
+            pthread_mutex_unlock(&schedule_lock);
+            if(due >= ending)
+                break;
+            sleep_until(due);
+        }
+        else
+        {
+            due = now_ns();
+            if(due >= ending)
+                break;
+        }
+
+        snprintf(url, sizeof(url), pattern, zipf_pick(&w->rng));
+        long body = -1;
+        int reuse = 0;
+        int opened = 0;
+        //a kept connection the other end has since closed gets a second go
+        //on a new one
+        int tries;
+        for(tries = 0; tries < 2 && body < 0; tries++)
+        {
+            int fresh = (c->fd < 0);
+            if(fresh)
+            {
+                if(conn_open(c) < 0)
+                    break;
+                opened++;
+            }
+            body = fetch(c, url, &reuse);
+            if(body < 0 || !reuse)
+                conn_close(c);
+            if(fresh)
+                break;
+        }
+        long long done = now_ns();
+        if(due >= started && due < ending)
+        {
+            if(body < 0)
+                w->errors++;
+            else
+                w->bytes += body;
+            w->connects += opened;
+        }
+        if(body >= 0)
+            record(w, due, done);
+        else if(c->fd < 0 && rate == 0)
+            usleep(1000); //don't spin on a refused connect
+    }
+    conn_close(c);
+    free(c);
+    return NULL;
+}
+
+//the proxy's hit, miss and bypass counts, and the requests it has sent
+//to origins over HTTP/2 and the connections it has opened for them, from
+//its metrics page. returns -1 if the cache counts couldn't be had
+static int proxy_counts(unsigned long* hits, unsigned long* misses,
+                        unsigned long* bypasses, unsigned long* h2sent,
+                        unsigned long* h2opened)
+{
+    struct conn* c = malloc(sizeof(struct conn));
+    int found = 0;
+    if(conn_open(c) == 0)
+    {
+        char* request = "GET http://proxy-configurator/metrics HTTP/1.0\r\n\r\n";
+        if(write(c->fd, request, strlen(request)) == (ssize_t)strlen(request))
+        {
+            char line[LOADGEN_BUFFER];
+            while(conn_line(c, line, sizeof(line)) >= 0)
+            {
+                char* sent = "proxy_h2_origin_requests_total ";
+                char* opened = "proxy_h2_origin_connections_total ";
+                if(strncmp(line, sent, strlen(sent)) == 0)
+                    *h2sent = strtoul(line + strlen(sent), NULL, 10);
+                if(strncmp(line, opened, strlen(opened)) == 0)
+                    *h2opened = strtoul(line + strlen(opened), NULL, 10);
+                char* counts = "proxy_cache_requests_total{result=\"";
+                if(strncmp(line, counts, strlen(counts)) != 0)
+                    continue;
+                char* result = line + strlen(counts);
+                unsigned long n = strtoul(strchr(result, '}') + 1, NULL, 10);
+                if(strncmp(result, "hit\"", 4) == 0)
+                    *hits = n, found++;
+                else if(strncmp(result, "miss\"", 5) == 0)
+                    *misses = n, found++;
+                else if(strncmp(result, "bypass\"", 7) == 0)
+                    *bypasses = n, found++;
+            }
+        }
+        conn_close(c);
+    }
+    free(c);
+    return (found == 3) ? 0 : -1;
+}
+
+static int compare(const void* a, const void* b)
+{
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(char* name)
+{
+    fprintf(stderr, "Usage: %s [-x proxyhost:port] [-c connections] "
+                    "[-d seconds] [-w warmup seconds] [-r requests/sec] "
+                    "[-n urls] [-s zipf s] [-k] http://host:port/path-with-%%d\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "x:c:d:w:r:n:s:k")) != -1)
+    {
+        switch(opt)
+        {
+        case 'x':
+            proxy = optarg;
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            urls = atoi(optarg);
+            break;
+        case 's':
+            zipf_s = atof(optarg);
+            break;
+        case 'k':
+            keepalive = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || connections < 1 || urls < 1 || seconds <= 0
+       || strncmp(argv[optind], "http://", 7) != 0
+       || !strstr(argv[optind], "%d"))
+        usage(argv[0]);
+    pattern = argv[optind];
+    snprintf(origin, sizeof(origin), "%.*s",
+             (int)strcspn(pattern + 7, "/"), pattern + 7);
+
+    //where the connections go
+    char host[256];
+    snprintf(host, sizeof(host), "%s", proxy ? proxy : origin);
+    char* port = strrchr(host, ':');
+    if(port)
+        *port++ = '\0';
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port ? port : "80", &hints, &target);
+    if(err != 0)
+    {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    zipf_init();
+
+    long long now = now_ns();
+    started = now + (long long)(warmup * 1e9);
+    ending = started + (long long)(seconds * 1e9);
+    next_due = now;
+    unsigned long hits = 0, misses = 0, bypasses = 0, h2sent = 0, h2opened = 0;
+    struct worker* workers = calloc(connections, sizeof(struct worker));
+    int i;
+    for(i = 0; i < connections; i++)
+    {
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if(pthread_create(&workers[i].tid, NULL, worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Couldn't start connection %d\n", i);
+            return 1;
+        }
+    }
+    sleep_until(started);
+    int counted = proxy && proxy_counts(&hits, &misses, &bypasses, &h2sent,
+                                        &h2opened) == 0;
+    sleep_until(ending);
+    unsigned long hits2, misses2, bypasses2, h2sent2 = 0, h2opened2 = 0;
+    counted = counted && proxy_counts(&hits2, &misses2, &bypasses2, &h2sent2,
+                                      &h2opened2) == 0;
+
+    long total = 0;
+    unsigned long errors = 0, connects = 0, bytes = 0;
+    for(i = 0; i < connections; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+        connects += workers[i].connects;
+        bytes += workers[i].bytes;
+    }
+    long long* all = malloc((total + 1) * sizeof(long long));
+    long n = 0;
+    for(i = 0; i < connections; i++)
+    {
+        memcpy(all + n, workers[i].latencies,
+               workers[i].count * sizeof(long long));
+        n += workers[i].count;
+        free(workers[i].latencies);
+    }
+    qsort(all, n, sizeof(long long), compare);
+
+    printf("%s loop, %d connections%s, %d URLs (Zipf s=%.2f), %.1fs",
+           rate > 0 ? "Open" : "Closed", connections,
+           keepalive ? " (kept alive)" : "", urls, zipf_s, seconds);
+    if(rate > 0)
+        printf(" at %.0f requests/sec", rate);
+    printf("%s%s\n\n", proxy ? " through " : "", proxy ? proxy : "");
+    printf("Requests:    %ld (%lu failed)\n", n, errors);
+    printf("Throughput:  %.1f requests/sec, %.2f MB/sec\n", n / seconds,
+           bytes / seconds / (1 << 20));
+    printf("Connections: %lu opened (%.2f requests each)\n", connects,
+           connects ? (double)(n + errors) / connects : 0.0);
+    if(counted)
+    {
+        unsigned long h = hits2 - hits;
+        unsigned long looked = h + (misses2 - misses) + (bypasses2 - bypasses);
+        printf("Hit ratio:   %.1f%% (%lu of %lu)\n",
+               looked ? 100.0 * h / looked : 0.0, h, looked);
+        if(h2sent2 > h2sent)
+            printf("HTTP/2:      %lu requests to origins, over %lu "
+                   "connections in all\n", h2sent2 - h2sent, h2opened2);
+    }
+    else if(proxy)
+    {
+        printf("Hit ratio:   unknown (couldn't read the proxy's metrics)\n");
+    }
+    printf("Latency:     ");
+    if(n > 0)
+    {
+        double q[] = {0.5, 0.9, 0.99, 0.999};
+        char* names[] = {"p50", "p90", "p99", "p99.9"};
+        for(i = 0; i < 4; i++)
+        {
+            long at = (long)(q[i] * n);
+            printf("%s %.2fms  ", names[i], all[at < n ? at : n - 1] / 1e3);
+        }
+        printf("max %.2fms\n", all[n - 1] / 1e3);
+    }
+    else
+    {
+        printf("no requests answered\n");
+    }
+    free(all);
+    return (n > 0) ? 0 : 1;
+}
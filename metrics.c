@@ -0,0 +1,286 @@
+/**************
+ ** Counters for the metrics page, see metrics.h
+ **/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+//a thread's counters, on a cache line (or more) of their own
+struct counters
+{
+    unsigned long count[NMETRICS];
+    unsigned long histogram[NSTAGES][HISTOGRAM_BUCKETS];
+    struct lockstats locks[NLOCKSITES];
+    struct counters* next;     //on the list of every block
+    struct counters* nextfree; //on the list of blocks whose threads ended
+} __attribute__((aligned(64)));
+
+static struct counters* all;   //newest first, only ever pushed onto
+static struct counters* spare; //under sparelock
+static pthread_mutex_t sparelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t owner;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static __thread struct counters* mine;
+
+//the thread is ending, so its block is free for the next one
+static void release(void* arg)
+{
+    struct counters* c = arg;
+    pthread_mutex_lock(&sparelock);
+    c->nextfree = spare;
+    spare = c;
+    pthread_mutex_unlock(&sparelock);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&owner, release);
+}
+
+//the first count on a thread: find it a block
+static struct counters* claim(void)
+{
+    pthread_once(&once, make_key);
+    pthread_mutex_lock(&sparelock);
+    struct counters* c = spare;
+    if(c)
+        spare = c->nextfree;
+    pthread_mutex_unlock(&sparelock);
+    if(!c)
+    {
+        if(posix_memalign((void**)&c, 64, sizeof(struct counters)) != 0)
+            return NULL;
+        memset(c, 0, sizeof(struct counters));
+        //a reader may be walking the list, so the block has to be all
+        //there before it can be seen
+        c->next = __atomic_load_n(&all, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&all, &c->next, c, 1,
+                                           __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(owner, c);
+    mine = c;
+    return c;
+}
+
+//add to one of the calling thread's numbers (atomic only so a reader
+//never sees half a store)
+static void bump(unsigned long* x, unsigned long n)
+{
+    __atomic_store_n(x, *x + n, __ATOMIC_RELAXED);
+}
+
+static void raise_to(unsigned long* x, unsigned long n)
+{
+    if(n > *x)
+        __atomic_store_n(x, n, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum metric which, unsigned long n)
+{
+    struct counters* c = mine;
+    if(!c && !(c = claim()))
+        return;
+    bump(&c->count[which], n);
+}
+
+long long metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//which bucket a value goes in. past the first 2*HISTOGRAM_SUB, v is in
+//[2^e, 2^(e+1)), and its top five bits pick one of that range's buckets
+static int bucket_of(long long v)
+{
+    if(v < 0)
+        v = 0;
+    if(v < 2 * HISTOGRAM_SUB)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    if(e >= HISTOGRAM_MAX_LOG)
+        return HISTOGRAM_BUCKETS - 1;
+    return (e - 4) * HISTOGRAM_SUB + (v >> (e - 4));
+}
+
+//the biggest value that goes in a bucket
+static long long bucket_top(int b)
+{
+    if(b < 2 * HISTOGRAM_SUB)
+        return b;
+    int e = b / HISTOGRAM_SUB + 3;
+    long long sub = b % HISTOGRAM_SUB + HISTOGRAM_SUB;
+    return ((sub + 1) << (e - 4)) - 1;
+}
+
+void metrics_time(enum stage which, long long usec)
+{
+    struct counters* c = mine;
+    if(!c && !(c = claim()))
+        return;
+    bump(&c->histogram[which][bucket_of(usec)], 1);
+}
+
+unsigned long metrics_quantiles(enum stage which, int n, double* q,
+                                long long* values)
+{
+    static unsigned long merged[HISTOGRAM_BUCKETS];
+    static pthread_mutex_t mergelock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mergelock);
+    memset(merged, 0, sizeof(merged));
+    unsigned long total = 0;
+    int i;
+    struct counters* c;
+    for(c = __atomic_load_n(&all, __ATOMIC_ACQUIRE); c; c = c->next)
+    {
+        for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            unsigned long k = __atomic_load_n(&c->histogram[which][i],
+                                              __ATOMIC_RELAXED);
+            merged[i] += k;
+            total += k;
+        }
+    }
+    int j;
+    for(j = 0; j < n; j++)
+    {
+        //the first bucket that takes the running count up to the rank
+        unsigned long rank = (unsigned long)(q[j] * total + 0.5);
+        if(rank < 1)
+            rank = 1;
+        unsigned long seen = 0;
+        values[j] = 0;
+        for(i = 0; total > 0 && i < HISTOGRAM_BUCKETS; i++)
+        {
+            seen += merged[i];
+            if(seen >= rank)
+            {
+                values[j] = bucket_top(i);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mergelock);
+    return total;
+}
+
+//the lock has just been taken, after waiting since start if it was
+//contended (start is 0 if it wasn't)
+static long long count_taken(enum locksite site, long long start)
+{
+    long long now = metrics_now();
+    struct counters* c = mine;
+    if(!c && !(c = claim()))
+        return now;
+    struct lockstats* st = &c->locks[site];
+    bump(&st->taken, 1);
+    if(start)
+    {
+        bump(&st->contended, 1);
+        bump(&st->waitusec, now - start);
+        raise_to(&st->maxwait, now - start);
+    }
+    return now;
+}
+
+static void count_held(enum locksite site, long long taken)
+{
+    long long held = metrics_now() - taken;
+    //(the thread may not be the one that took it, if it was a coroutine
+    //that moved, but it's the thread's own block that gets the count)
+    struct counters* c = mine;
+    if(!c && !(c = claim()))
+        return;
+    struct lockstats* st = &c->locks[site];
+    bump(&st->holdusec, held);
+    raise_to(&st->maxhold, held);
+}
+
+long long metrics_lock(pthread_mutex_t* lock, enum locksite site)
+{
+    long long start = 0;
+    if(pthread_mutex_trylock(lock) != 0)
+    {
+        start = metrics_now();
+        pthread_mutex_lock(lock);
+    }
+    return count_taken(site, start);
+}
+
+long long metrics_rdlock(pthread_rwlock_t* lock, enum locksite site)
+{
+    long long start = 0;
+    if(pthread_rwlock_tryrdlock(lock) != 0)
+    {
+        start = metrics_now();
+        pthread_rwlock_rdlock(lock);
+    }
+    return count_taken(site, start);
+}
+
+long long metrics_wrlock(pthread_rwlock_t* lock, enum locksite site)
+{
+    long long start = 0;
+    if(pthread_rwlock_trywrlock(lock) != 0)
+    {
+        start = metrics_now();
+        pthread_rwlock_wrlock(lock);
+    }
+    return count_taken(site, start);
+}
+
+void metrics_unlock(pthread_mutex_t* lock, enum locksite site,
+                    long long taken)
+{
+    pthread_mutex_unlock(lock);
+    count_held(site, taken);
+}
+
+void metrics_rwunlock(pthread_rwlock_t* lock, enum locksite site,
+                      long long taken)
+{
+    pthread_rwlock_unlock(lock);
+    count_held(site, taken);
+}
+
+void metrics_locks(enum locksite site, struct lockstats* out)
+{
+    memset(out, 0, sizeof(*out));
+    struct counters* c;
+    for(c = __atomic_load_n(&all, __ATOMIC_ACQUIRE); c; c = c->next)
+    {
+        struct lockstats* st = &c->locks[site];
+        out->taken += __atomic_load_n(&st->taken, __ATOMIC_RELAXED);
+        out->contended += __atomic_load_n(&st->contended, __ATOMIC_RELAXED);
+        out->waitusec += __atomic_load_n(&st->waitusec, __ATOMIC_RELAXED);
+        out->holdusec += __atomic_load_n(&st->holdusec, __ATOMIC_RELAXED);
+        unsigned long maxwait = __atomic_load_n(&st->maxwait,
+                                                __ATOMIC_RELAXED);
+        unsigned long maxhold = __atomic_load_n(&st->maxhold,
+                                                __ATOMIC_RELAXED);
+        if(maxwait > out->maxwait)
+            out->maxwait = maxwait;
+        if(maxhold > out->maxhold)
+            out->maxhold = maxhold;
+    }
+}
+
+void metrics_read(unsigned long* totals)
+{
+    int i;
+    for(i = 0; i < NMETRICS; i++)
+        totals[i] = 0;
+    struct counters* c;
+    for(c = __atomic_load_n(&all, __ATOMIC_ACQUIRE); c; c = c->next)
+    {
+        for(i = 0; i < NMETRICS; i++)
+            totals[i] += __atomic_load_n(&c->count[i], __ATOMIC_RELAXED);
+    }
+}
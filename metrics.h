@@ -0,0 +1,114 @@
+/*****
+ ** Counters for the metrics page
+ **
+ ** Counting on the request path shouldn't slow the request path down, so
+ ** nothing here is shared between threads while counting: each thread adds
+ ** to a block of counters of its own (a plain store, since it's the only
+ ** one writing to it), and only whoever reads the metrics goes through
+ ** every block and adds them up. Blocks are never freed. When a thread
+ ** ends its block goes to the next thread to start, still holding its
+ ** counts, so the totals only ever go up and there are only ever as many
+ ** blocks as there have been threads at once.
+ **
+ ** The blocks also hold a latency histogram for each stage of a request.
+ ** They're log-linear, like an HDR histogram's: values up to
+ ** 2*HISTOGRAM_SUB microseconds get a bucket each, and every power of two
+ ** above that is split into HISTOGRAM_SUB buckets, so a value is only
+ ** ever out by 1/HISTOGRAM_SUB (about 6%) at most, from microseconds up
+ ** to an hour, in a few hundred buckets.
+ **
+ ** And they count what happens at each place the cache lock and the
+ ** features lock are taken: how often, how long it took to get the lock
+ ** when somebody else had it, and how long it was then held. The lock is
+ ** tried first, so an uncontended lock costs one clock read each way.
+ **/
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <pthread.h>
+
+enum metric
+{
+    METRIC_REQUESTS,     //requests for http URLs
+    METRIC_HITS,         //...answered from the cache (either tier, or slices)
+    METRIC_MISSES,       //...looked for in the cache and not found
+    METRIC_BYPASSES,     //...that couldn't come from the cache
+    METRIC_CACHE_BYTES,  //body bytes sent from the cache
+    METRIC_ORIGIN_BYTES, //body bytes sent from origins (after encoding)
+    METRIC_CONNECTS,     //connections opened to origins
+    METRIC_CONNECT_USEC, //...and the microseconds it took to open them
+    METRIC_EVICTIONS,    //objects evicted from the memory cache
+    NMETRICS
+};
+
+//the stages a request goes through, each timed on its own
+enum stage
+{
+    STAGE_PARSE,    //the request line and headers, read and picked over
+    STAGE_LOOKUP,   //looking in the cache (both tiers)
+    STAGE_DNS,      //looking up the origin's address
+    STAGE_CONNECT,  //connecting to it
+    STAGE_TTFB,     //the request sent, until the status line is back
+    STAGE_TRANSFER, //...and from there to the end of the body
+    NSTAGES
+};
+
+//the places a lock is taken
+enum locksite
+{
+    LOCK_LOOKUP,      //cachelock: searching the cache
+    LOCK_TOUCH,       //...moving a hit up for the eviction policy
+    LOCK_INSERT,      //...adding an object, and evicting for it
+    LOCK_CLEAR,       //...clearing the cache
+    LOCK_POLICY,      //...switching eviction policies
+    LOCK_SNAPSHOT,    //...saving a snapshot
+    LOCK_INFO,        //...rendering the diagnostics page
+    LOCK_FEATURE_SET, //features_mutex: the configurator changing a setting
+    NLOCKSITES
+};
+
+//what's been counted for one of them
+struct lockstats
+{
+    unsigned long taken;     //times the lock was taken
+    unsigned long contended; //...when it wasn't free straight away
+    unsigned long waitusec;  //time spent waiting for it, all told
+    unsigned long maxwait;
+    unsigned long holdusec;  //time it was held, all told
+    unsigned long maxhold;
+};
+
+#define HISTOGRAM_SUB     16         /* buckets per power of two */
+#define HISTOGRAM_MAX_LOG 32         /* up to 2^32 microseconds */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_LOG - 3) * HISTOGRAM_SUB)
+
+//add n to one of the calling thread's counters
+void metrics_add(enum metric which, unsigned long n);
+//add up every thread's counters into totals (NMETRICS of them)
+void metrics_read(unsigned long* totals);
+
+//microseconds on the monotonic clock, for timing things
+long long metrics_now(void);
+//count a stage taking usec microseconds in the calling thread's histogram
+void metrics_time(enum stage which, long long usec);
+//merge every thread's histogram for a stage, and find the values (in
+//microseconds) at each of the n quantiles in q (0.5 for the median).
+//returns how many times the stage was timed (when nothing is known, the
+//values are all 0)
+unsigned long metrics_quantiles(enum stage which, int n, double* q,
+                                long long* values);
+
+//take a lock at a site. returns when it was taken, to be handed to the
+//matching unlock
+long long metrics_lock(pthread_mutex_t* lock, enum locksite site);
+long long metrics_rdlock(pthread_rwlock_t* lock, enum locksite site);
+long long metrics_wrlock(pthread_rwlock_t* lock, enum locksite site);
+//let it go again, counting how long it was held
+void metrics_unlock(pthread_mutex_t* lock, enum locksite site,
+                    long long taken);
+void metrics_rwunlock(pthread_rwlock_t* lock, enum locksite site,
+                      long long taken);
+//add up every thread's counts for a site
+void metrics_locks(enum locksite site, struct lockstats* out);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,237 @@
+/**************
+ ** Admission control for connections, see overload.h
+ **/
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "overload.h"
+
+//a connection waiting for its turn
+struct waiting
+{
+    void* conn;
+    unsigned addr;
+    long long since; //milliseconds, on the monotonic clock
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waited; //there's somebody in the queue
+static int (*run)(void* conn);
+static void (*refuse)(void* conn, int status);
+static int limit = OVERLOAD_ACTIVE;
+static int active;
+static int longlived;
+static struct waiting queue[OVERLOAD_QUEUE]; //oldest at head
+static int head;
+static int count;
+static unsigned short clients[OVERLOAD_CLIENTS];
+
+static unsigned long queued;
+static unsigned long shed;
+static unsigned long limited;
+static unsigned long failed;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned short* client(unsigned addr)
+{
+    return &clients[(addr * 2654435761u) >> 20 & (OVERLOAD_CLIENTS - 1)];
+}
+
+//turn away whatever has waited too long, oldest first (call locked)
+static void shed_stale(long long now)
+{
+    while(count > 0 && now - queue[head].since > OVERLOAD_TARGET)
+    {
+        struct waiting* w = &queue[head];
+        head = (head + 1) % OVERLOAD_QUEUE;
+        count--;
+        (*client(w->addr))--;
+        shed++;
+        refuse(w->conn, OVERLOAD_BUSY);
+    }
+}
+
+//turns away whoever's waited too long even when nothing comes or goes
+static void* sweeper(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for(;;)
+    {
+        while(count == 0)
+            pthread_cond_wait(&waited, &lock);
+        long long due = queue[head].since + OVERLOAD_TARGET + 1;
+        struct timespec ts;
+        ts.tv_sec = due / 1000;
+        ts.tv_nsec = (due % 1000) * 1000000;
+        pthread_cond_timedwait(&waited, &lock, &ts);
+        shed_stale(now_ms());
+    }
+    return NULL;
+}
+
+int overload_init(int n, int (*runfn)(void* conn),
+                  void (*refusefn)(void* conn, int status))
+{
+    limit = (n > 0) ? n : OVERLOAD_ACTIVE;
+    run = runfn;
+    refuse = refusefn;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waited, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, sweeper, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void overload_arrive(void* conn, unsigned addr)
+{
+    pthread_mutex_lock(&lock);
+    unsigned short* c = client(addr);
+    if(*c >= OVERLOAD_PER_CLIENT)
+    {
+        limited++;
+        pthread_mutex_unlock(&lock);
+        refuse(conn, OVERLOAD_TOO_MANY);
+        return;
+    }
+    (*c)++;
+    long long now = now_ms();
+    shed_stale(now);
+
+    //nobody jumps the queue
+    if(active < limit && count == 0)
+    {
+        active++;
+        pthread_mutex_unlock(&lock);
+        if(run(conn) == 0)
+            return;
+        pthread_mutex_lock(&lock);
+        failed++;
+        pthread_mutex_unlock(&lock);
+        refuse(conn, OVERLOAD_BUSY);
+        overload_leave(addr);
+        return;
+    }
+    if(count == OVERLOAD_QUEUE)
+    {
+        (*c)--;
+        shed++;
+        pthread_mutex_unlock(&lock);
+        refuse(conn, OVERLOAD_BUSY);
+        return;
+    }
+    struct waiting* w = &queue[(head + count++) % OVERLOAD_QUEUE];
+    w->conn = conn;
+    w->addr = addr;
+    w->since = now;
+    queued++;
+    pthread_cond_signal(&waited);
+    pthread_mutex_unlock(&lock);
+}
+
+int overload_take(unsigned addr)
+{
+    pthread_mutex_lock(&lock);
+    unsigned short* c = client(addr);
+    if(*c >= OVERLOAD_PER_CLIENT)
+    {
+        limited++;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    shed_stale(now_ms());
+    if(active >= limit || count > 0)
+    {
+        shed++;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    (*c)++;
+    active++;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+//give up a turn, to whoever's waited longest if anybody has, and addr's
+//count with it if drop is set (call locked; returns unlocked)
+static void give_turn(unsigned addr, int drop)
+{
+    for(;;)
+    {
+        active--;
+        if(drop)
+            (*client(addr))--;
+        shed_stale(now_ms());
+        if(count == 0 || active >= limit)
+            break;
+
+        //the turn goes to whoever's waited longest
+        struct waiting w = queue[head];
+        head = (head + 1) % OVERLOAD_QUEUE;
+        count--;
+        active++;
+        pthread_mutex_unlock(&lock);
+        if(run(w.conn) == 0)
+            return;
+        refuse(w.conn, OVERLOAD_BUSY);
+        pthread_mutex_lock(&lock);
+        failed++;
+        addr = w.addr; //and it gives its turn back
+        drop = 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void overload_leave(unsigned addr)
+{
+    pthread_mutex_lock(&lock);
+    give_turn(addr, 1);
+}
+
+int overload_hold_long(unsigned addr)
+{
+    pthread_mutex_lock(&lock);
+    if(longlived >= OVERLOAD_LONG)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    longlived++;
+    give_turn(addr, 0);
+    return 0;
+}
+
+void overload_leave_long(unsigned addr)
+{
+    pthread_mutex_lock(&lock);
+    longlived--;
+    (*client(addr))--;
+    pthread_mutex_unlock(&lock);
+}
+
+void overload_stats(int* nactive, int* nwaiting, int* nlonglived,
+                    unsigned long* nqueued, unsigned long* nshed,
+                    unsigned long* nlimited, unsigned long* nfailed)
+{
+    pthread_mutex_lock(&lock);
+    *nactive = active;
+    *nwaiting = count;
+    *nlonglived = longlived;
+    *nqueued = queued;
+    *nshed = shed;
+    *nlimited = limited;
+    *nfailed = failed;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,78 @@
+/*****
+ ** Admission control for connections
+ **
+ ** Every connection used to get a thread (or a coroutine) the moment it was
+ ** accepted, however many were already running, so too much traffic ended
+ ** in thread creation failing or the memory running out, with every client
+ ** slowed down on the way. Now only so many connections are handled at
+ ** once. The rest wait their turn in a queue, and one that has waited more
+ ** than OVERLOAD_TARGET milliseconds is turned away with a quick 503 rather
+ ** than being handled so late it's no use to anybody: a queue that old is
+ ** one that isn't draining. When even the queue is full, new connections
+ ** are turned away straight off.
+ **
+ ** One address can only have OVERLOAD_PER_CLIENT connections running or
+ ** waiting, so a single busy client can't take every turn; past that it
+ ** gets a 429. The counts are kept in OVERLOAD_CLIENTS buckets by a hash of
+ ** the address, so two addresses that land in the same bucket share one.
+ **
+ ** A connection that was let in has to be given back with overload_leave()
+ ** however its handler ends, which starts the next one waiting.
+ **
+ ** A connection that turns into a CONNECT tunnel or an HTTP/2 session can
+ ** last as long as the client likes, mostly idle, so it doesn't keep its
+ ** turn: it hands it on and takes one of OVERLOAD_LONG places kept for
+ ** those instead (still counted against its address), and is given back
+ ** with overload_leave_long().
+ **
+ ** The streams of an HTTP/2 session are requests like any other, though,
+ ** so each one has to get a turn of its own (charged to the session's
+ ** address) with overload_take(). A stream can't wait in the queue, so
+ ** one that can't have a turn straight away is refused instead.
+ **/
+#ifndef __OVERLOAD_H__
+#define __OVERLOAD_H__
+
+#define OVERLOAD_ACTIVE     512  /* connections handled at once, if not given */
+#define OVERLOAD_QUEUE      1024 /* connections waiting for a turn */
+#define OVERLOAD_TARGET     100  /* ms a connection may wait for its turn */
+#define OVERLOAD_PER_CLIENT 64   /* connections from one address */
+#define OVERLOAD_CLIENTS    4096 /* buckets the per-address counts go in */
+#define OVERLOAD_LONG       1024 /* tunnels and HTTP/2 sessions at once */
+
+//what a turned away connection is answered with
+#define OVERLOAD_BUSY     503
+#define OVERLOAD_TOO_MANY 429
+
+//set the limit, and how connections are started and turned away, and
+//start the thread that sheds the queue (it inherits the caller's signal
+//mask). run() returns 0, or -1 if the connection couldn't be started (and
+//is then turned away with OVERLOAD_BUSY). refuse() may be called with the
+//lock held, so it mustn't block or call back in here. returns 0, or -1 if
+//the thread couldn't be started, when the queue is only shed as
+//connections come and go
+int overload_init(int active, int (*run)(void* conn),
+                  void (*refuse)(void* conn, int status));
+
+//a connection from addr (an IPv4 address) has been accepted: run it now,
+//queue it, or turn it away
+void overload_arrive(void* conn, unsigned addr);
+//take a turn for a request from addr (an HTTP/2 stream) if there's one
+//free now, and nobody's waiting. returns 0, or -1 if there isn't one or
+//addr is over its limit. it's given back with overload_leave()
+int overload_take(unsigned addr);
+//a connection from addr that was run has finished
+void overload_leave(unsigned addr);
+//a connection from addr that was run is becoming a tunnel or an HTTP/2
+//session: swap its turn for a long-lived place. returns 0, or -1 if they
+//are all taken (when it keeps its turn, and leaves with overload_leave())
+int overload_hold_long(unsigned addr);
+//...and a long-lived connection from addr has finished
+void overload_leave_long(unsigned addr);
+
+//numbers for the diagnostics page
+void overload_stats(int* active, int* waiting, int* longlived,
+                    unsigned long* queued, unsigned long* shed,
+                    unsigned long* limited, unsigned long* failed);
+
+#endif /* __OVERLOAD_H__ */
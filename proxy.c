@@ -2,11 +2,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <pthread.h>
 #include <sys/time.h>
 #include <time.h>
+#include <stdint.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/random.h>
 
 /******************
  ** NOTE: using the thread-friendly version of csapp.*
@@ -16,6 +20,24 @@
  **
  **/
 #include "csapp.h"
+#include "diskcache.h"
+#include "sketch.h"
+#include "compress.h"
+#include "chunked.h"
+#include "upstream.h"
+#include "relay.h"
+#include "h2.h"
+#include "h2upstream.h"
+#include "uring.h"
+#include "coro.h"
+#include "workpool.h"
+#include "spool.h"
+#include "overload.h"
+#include "metrics.h"
+
+#if URING_BUFSIZE > RIO_BUFSIZE
+#error "what the io_uring front end reads up front has to fit in a rio_t"
+#endif
 
 #ifndef DEBUG
 #define debug_printf(...) {}
@@ -31,6 +53,9 @@
 
 #define MAX_OBJECT_SIZE 102400 /* 100 KB */
 #define MAX_CACHE_SIZE 1048576 /* 1 MB */
+#define CLIENT_READ_TIMEOUT 10 /* seconds a client may leave a read waiting */
+//what the memory cache holds: MAX_CACHE_SIZE, except in the benchmarks
+long max_cache_size = MAX_CACHE_SIZE;
 
 //cache implemented as a lined list
 struct cachenode
@@ -39,57 +64,307 @@ struct cachenode
     void* data;
     char* objname;
     int size;
+    int hdrlen;    //how much of data is the response header block
+    int encoding;  //how the body after the headers is stored
+    time_t stored; //when it went into the cache
+    int maxage;    //freshness lifetime from Cache-Control, 0 if none given
+    //eviction policy bookkeeping
+    int freq;        //hits (GDSF, S3-FIFO)
+    double priority; //GDSF priority
+    unsigned long seq; //GDSF: the order it went in, for breaking ties
+    int heapindex;   //GDSF: where it is in the heap
+    int queue;       //S3-FIFO queue (small or main)
+    struct cachenode* qprev; //S3-FIFO: its neighbours in that queue
+    struct cachenode* qnext;
     struct cachenode* prev;
     struct cachenode* next;
 };
 
+/*****
+ * Eviction policies
+ *  The cache is always one list, with new objects linked in at the head.
+ *  A policy decides what happens to an object when it's hit, and which
+ *  object goes when the cache is full, and keeps whatever it needs to find
+ *  that object without walking the list (which may be a million objects
+ *  long, with the lock held). Every hook is called with the cache
+ *  write-locked, except that touched() is called under the read lock for
+ *  policies with touch_readlocked set, and must then only use atomics.
+ *****/
+struct evict_policy
+{
+    char* name;
+    char* setpath; //configurator path that selects it
+    int touch_readlocked;
+    //the policy was just switched on: set up every object already cached
+    void (*reset)();
+    //an object was just linked in at the head
+    void (*inserted)(struct cachenode* obj);
+    //an object was hit
+    void (*touched)(struct cachenode* obj);
+    //the object that would go next, without changing anything
+    struct cachenode* (*peek)();
+    //the object that goes next (may shuffle the list on the way)
+    struct cachenode* (*victim)();
+    //the victim was unlinked from the list
+    void (*evicted)(struct cachenode* obj);
+};
+
+//hit ratio and byte hit ratio, counted while each policy is in charge
+struct policy_stats
+{
+    unsigned long requests;
+    unsigned long hits;
+    unsigned long long bytes;
+    unsigned long long hitbytes;
+};
+
 struct listcache
 {
     int totalsize;
+    int rejected; //objects turned away by the admission filter
+    struct evict_policy* policy;
     struct cachenode* head;
     struct cachenode* tail;
 };
 pthread_rwlock_t cachelock;
 
+/*****
+ * Range requests
+ *  A client's Range (and If-Range) header is taken out of its request
+ *  headers before the cache lookup, so it finds the whole object, and the
+ *  ranges are cut out of that.
+ *****/
+#define MAX_RANGES 16 /* more than this and we send the whole thing */
+struct rangerequest
+{
+    char range[MAXLINE];   //the Range value, "" if none
+    char ifrange[MAXLINE]; //the If-Range value, "" if none
+};
+//one range of bytes, first and last inclusive
+struct byterange
+{
+    long first;
+    long last;
+};
+
+
+/*****
+ * Large objects
+ *  A response too big to cache whole is cached as SLICE_SIZE slices of its
+ *  body, each its own cache object named "<object>#slice<n>", so only the
+ *  parts of a big file that get asked for take up room. Every slice carries
+ *  the object's 200 headers (with the whole Content-Length), so any one of
+ *  them says how to answer. Slices that aren't cached are fetched from the
+ *  origin with a Range request for just that slice.
+ *****/
+#define SLICE_SIZE 65536 /* 64 KB */
+//where missing slices come from. the connection is opened when it's first
+//needed, and kept for the next slice
+struct sliceorigin
+{
+    char* hostname;
+    int port;
+    char* path;
+    char* header; //the client's request headers
+    int fd;       //-1 until there's a connection
+    int h2;       //try an HTTP/2 stream first (the h2origin feature)
+    rio_t rio;
+};
+
 
 
 //for handling the connection
 void handle_connection(int connfd);
+//...when the start of the request (len bytes of data) has already been read,
+//for conn if admission control let it in (NULL if it didn't come that way)
+struct newconn;
+void handle_read_connection(int connfd, char* data, int len,
+                            struct newconn* conn);
 void* new_connection_thread(void* arg);
+void new_connection_coroutine(void* arg);
+//a new connection's handler is done with it, however it ended
+void connection_done(void* arg);
+//give a new connection a thread (or a coroutine, or, sequentially, handle
+//it right here), when admission control lets it have one
+void dispatch_connection(int connfd, char* data, int len);
+//start a connection admission control has let in. returns 0, or -1 if
+//there was neither a coroutine nor a thread for it
+int start_connection(void* arg);
+//answer a connection admission control turned away, and close it
+void refuse_connection(void* arg, int status);
+
+//a connection on its way to its thread, with whatever has been read of it
+struct newconn
+{
+    int fd;
+    unsigned addr; //the client's address, for its admission control count
+    int longlived; //it's a tunnel or an HTTP/2 session, not holding a turn
+    int len;
+    char data[];
+};
+//a connection that's becoming a tunnel or an HTTP/2 session gives up its
+//turn for a long-lived place. returns 0, or -1 if there isn't one free
+//(when it keeps the turn)
+int connection_goes_long(struct newconn* conn);
+
+//set up a CONNECT tunnel and relay it until it's done
+void handle_tunnel(int connfd, rio_t* proxy_client, char* requestline);
 
 //get the hostname and path from a URL
 void parse_url(char buffer[MAXLINE], char* hostname, char* path, int *port);
-//make a GET request to the server
-//returns whether or not the headers think it's a good idea to cache
-void make_GET_request(char* path,
+//make a request to the server (as HTTP/1.1, asking it to keep the
+//connection open), passing along the client's Range if it had one
+//returns 0, or -1 if the request couldn't be written
+int make_request(char* method,
+                    char* hostname,
+                    int port,
+                    char* path,
                     char* buffer,
-                    int server_fd);
-//copy the HTTP request from the client to a buffer
+                    int server_fd,
+                    int negotiate,
+                    struct rangerequest* rr);
+//stream a request body from the client to the server, however the
+//client's headers say it's delimited. returns 0, or -1 if either side
+//let us down
+int send_request_body(rio_t* proxy_client, int server_fd, char* requestheader);
+//copy the HTTP request from the client to a buffer. returns NULL if the
+//client didn't send all of it in time
 char* copy_request(rio_t* proxy_client);
-//write a buffer to the server
-void write_request(int server_fd, char* buffer);
-//read back from the server to the client
-void serve_to_client(int connfd, rio_t* server_connection, 
-        char* hostname, char* path, int cachestatus, char* cachereq);
+//copy the client's request headers into out (which needs strlen(buffer)
+//plus MAXLINE bytes), leaving out hop-by-hop headers. when negotiating,
+//only offer the codings we understand. returns the length
+int copy_request_headers(char* out, char* buffer, int negotiate);
+//find a header in a block of header lines and copy out its value
+//returns 1 if it's there, 0 if not
+int find_header(char* headers, int len, char* name, char* value, int maxlen);
+//does a request's Accept-Encoding allow a content-coding?
+int accepts_encoding(char* requestheader, char* coding);
+//is a response a plain 200 with a body that's worth compressing?
+int compressible_response(char* headers, int hdrlen);
+//rewrite a response header block for a body in some content-coding (and of
+//some length, or -1 to leave it out). out needs hdrlen+MAXLINE bytes
+int encode_headers(char* headers, int hdrlen, int encoding, int bodylen,
+                   char* out);
+//which coding (if any) should a plain response be compressed with for
+//this client?
+int client_encoding(char* headers, int hdrlen, char* requestheader);
+//send a cached object to the client, dealing with its storage encoding
+//returns 0 on success, -1 on a write error
+int serve_cached_object(int connfd, struct cachenode* obj, char* requestheader,
+                        struct rangerequest* rr);
+//send an object from the disk tier to the client
+int serve_disk_object(int connfd, struct diskobject* obj, char* requestheader,
+                      struct rangerequest* rr);
+//take every line for a header out of a block of request headers
+//returns 1 if there were any
+int remove_header(char* headers, char* name);
+//parse a Range value against a body of size bytes. returns how many
+//ranges are satisfiable (0 means none are), or -1 if the value is something
+//we don't understand or has more than max ranges
+int parse_ranges(char* spec, long size, struct byterange* ranges, int max);
+//does If-Range (if there is one) name the version of a response we have?
+int ifrange_matches(char* headers, int hdrlen, struct rangerequest* rr);
+//start the headers of a 206 for a cached 200 response: the status line, and
+//the response's headers less the ones that described the whole body (and
+//less Content-Type for a multipart answer). returns the length
+int partial_headers(char* out, char* headers, int hdrlen, int multipart);
+//answer a Range request out of a cached 200 response (the body in memory,
+//or in the disk tier if disk is set), with a 206 or a 416
+//returns 1 if it did, 0 if the whole object should be sent instead, or -1
+//on a write error
+int serve_ranges(int connfd, char* headers, int hdrlen, char* body,
+                 struct diskobject* disk, long bodylen,
+                 struct rangerequest* rr);
+//read the status line of the server's final response into buffer (MAXLINE
+//long), passing over any interim 1xx responses and their headers. returns
+//what rio_readlineb() did
+int read_status_line(rio_t* rio, char* buffer);
+//read back from the server to the client (in chunks, if chunked is set
+//and we don't know the length; and just the headers for a HEAD). returns
+//1 if the server connection can be reused, 0 if not, 2 if it already has
+//been (it went back to the pool while the client was still reading), or
+//-1 if the server sent nothing at all (and nothing was sent to the
+//client, so the request can be retried)
+int serve_to_client(int connfd, rio_t* server_connection, 
+        char* hostname, int port, char* path, int cachestatus,
+        char* cachereq, int encode, int chunked, int head);
+//write a piece of a body to the client as one chunk, through the spool
+//returns 0, or -1 on a write error
+int spool_chunk(struct spool* spool, int connfd, char* buf, int len);
 
 
 
 //feature functions
+//the cache name of one slice of an object
+void slice_name(char* out, char* objname, long index);
+//find a slice of an object in the cache (either tier). returns a copy the
+//caller frees, or NULL
+struct cachenode* find_slice(char* objname, long index, char* header);
+//cache one slice of an object, under its headers
+void store_slice(char* objname, long index, char* header, char* headers,
+                 int hdrlen, char* body, int len);
+//get one slice of an object from the origin (total is the whole length, or
+//-1 if we don't know it yet). returns it as a cache object, or NULL if the
+//origin wouldn't give us just that range
+struct cachenode* fetch_slice(struct sliceorigin* o, long index, long total);
+//answer a request (whole, or a single range) out of an object's slices,
+//fetching whichever ones aren't cached (and setting *fetched if any were).
+//returns 1 if it did, 0 if the object isn't sliced (and nothing was sent),
+//or -1 on an error part way
+int serve_sliced(int connfd, char* objname, char* header,
+                 struct sliceorigin* o, struct rangerequest* rr,
+                 int* fetched);
+
 //take over the connection and print the feature console
 void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE]);
+//what the request stages are called on the console
+char* stage_names[NSTAGES] = {"parse", "lookup", "dns", "connect", "ttfb",
+                              "transfer"};
+//...and the places the locks are taken
+char* lock_names[NLOCKSITES] = {"cache_lookup", "cache_touch", "cache_insert",
+                                "cache_clear", "cache_policy",
+                                "cache_snapshot", "cache_info",
+                                "features_set"};
 //change the host, request, and port based on feature settings
 int handle_features(char* hostname, char* path, int* port);
 
 //List cache functions
 //add an object to the cache
 void add_cache_object(struct cachenode* obj);
+//should an object be let into the cache? (call with the cache write-locked)
+int admit_cache_object(struct cachenode* obj);
+//gzip an object's body if it's text that's worth it
+void compress_cache_object(struct cachenode* obj);
+
+//compression jobs, for workpool_run()
+struct gzipjob
+{
+    void* in;
+    int inlen;
+    void* out;
+    int outlen; //what gzip_buffer() returned
+};
+void gzip_job(void* arg);
 //find an object in the cache based on header, and update LRU
 //return NULL if not found
 struct cachenode* get_cache_object(char* objname, char* header);
+//link an object in at the head of the list / take it out of the list
+void link_node(struct cachenode* obj);
+void unlink_node(struct cachenode* obj);
+//switch eviction policies (takes the cache lock)
+void set_eviction_policy(int which);
+//count a cacheable request of some size for the active policy's stats
+void count_cache_request(int hit, long bytes);
 //clear the cache
 void clear_cache();
 //cache unlock handler: if a thread dies, unlock the cache
 void unlock_cache_handler(void* ptr);
+//write the whole cache to a snapshot file, returns the number of objects
+//written or -1 on error
+int save_cache_snapshot(const char* path);
+//warm the cache from a snapshot file, returns the number of objects loaded
+//or -1 on error
+int load_cache_snapshot(const char* path);
 
 //new cachenode
 struct cachenode* newNode();
@@ -99,11 +374,35 @@ void free_node(struct cachenode* n);
 //global cache variable
 struct listcache thecache;
 
+//the eviction policies, selectable from the configurator (LRU first)
+#define NPOLICIES 3
+extern struct evict_policy policies[NPOLICIES];
+struct policy_stats policystats[NPOLICIES];
+
+//snapshot file given with -s (NULL for none), and the shutdown flag set by
+//SIGINT/SIGTERM so main() can write the snapshot on the way out
+char* snapshot_path = NULL;
+volatile sig_atomic_t shutting_down = 0;
+void shutdown_handler(int sig);
+//connection threads are started with these blocked, so they always land
+//on main
+sigset_t shutdown_signals;
+//with -c, connections are run as coroutines on this many threads
+int coroutine_workers = 0;
+
 
 /*****
  * Features structure
  *  Holds information about the features enabled/disabled
- *  Locked/unlocked by features_mutex
+ *  The settings in force are a snapshot that's never changed once it's
+ *  published, so a request just loads the pointer and reads it, with no
+ *  lock. The configurator makes a changed copy and swaps the pointer, with
+ *  features_mutex held so two changes can't lose one another. A reader may
+ *  still be looking at the snapshot that's been replaced, and nothing
+ *  tracks readers, so snapshots are never freed; instead every one that's
+ *  been published is kept, and a change that comes back to a combination
+ *  of settings seen before publishes that one again. There are only so
+ *  many combinations, so there are only so many snapshots.
  *****/
 pthread_mutex_t features_mutex;
 struct features_t
@@ -114,8 +413,61 @@ struct features_t
     int rickroll;
     //caching: disable caching for debugging or for dynamic browsing
     int cache;
+    //admission: only let new objects push out less popular ones (TinyLFU)
+    int admission;
+    //compress: store compressible text bodies gzip'd in the cache
+    int compress;
+    //encode: compress plain text responses for clients that accept it
+    int encode;
+    //h2origin: multiplex requests to origins that speak HTTP/2
+    int h2origin;
+};
+//the settings in force
+struct features_t* ft_config;
+//every snapshot that's been published (under features_mutex)
+struct features_version
+{
+    struct features_t features;
+    struct features_version* next;
 };
-struct features_t ft_config;;
+struct features_version* ft_versions;
+
+//the settings in force, to be read and not written
+struct features_t* features_get(void)
+{
+    return __atomic_load_n(&ft_config, __ATOMIC_ACQUIRE);
+}
+
+//make some settings the ones in force (call with features_mutex held)
+void publish_features(struct features_t* want)
+{
+    struct features_version* v;
+    for(v = ft_versions; v; v = v->next)
+    {
+        if(memcmp(&v->features, want, sizeof(struct features_t)) == 0)
+            break;
+    }
+    if(!v)
+    {
+        v = malloc(sizeof(struct features_version));
+        memcpy(&v->features, want, sizeof(struct features_t));
+        v->next = ft_versions;
+        ft_versions = v;
+    }
+    __atomic_store_n(&ft_config, &v->features, __ATOMIC_RELEASE);
+}
+
+//change one setting (at offset into struct features_t) from the
+//configurator
+void set_feature(size_t offset, int value)
+{
+    long long taken = metrics_lock(&features_mutex, LOCK_FEATURE_SET);
+    struct features_t next = *features_get();
+    *(int*)((char*)&next + offset) = value;
+    publish_features(&next);
+    metrics_unlock(&features_mutex, LOCK_FEATURE_SET, taken);
+}
+
 
 
 int open_clientfd_r(char *hostname, int port) 
@@ -132,8 +484,10 @@ int open_clientfd_r(char *hostname, int port)
     char buffer[MAXLINE];
 	int errno;
 	
+    long long start = metrics_now();
     if (gethostbyname_r(hostname,&ret,buffer,MAXLINE,&hp,&errno) != 0)
 		return errno; 
+    metrics_time(STAGE_DNS, metrics_now() - start);
     bzero((char *) &serveraddr, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET;
     if(!hp)
@@ -143,8 +497,13 @@ int open_clientfd_r(char *hostname, int port)
     serveraddr.sin_port = htons(port);
 	
     /* Establish a connection with the server */
-    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
+    start = metrics_now();
+    if (coro_connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
 		return -1;
+    long long took = metrics_now() - start;
+    metrics_add(METRIC_CONNECTS, 1);
+    metrics_add(METRIC_CONNECT_USEC, took);
+    metrics_time(STAGE_CONNECT, took);
     return clientfd;
 }
 
@@ -153,15 +512,55 @@ int open_clientfd_r(char *hostname, int port)
 
 int main (int argc, char *argv []){
 	signal(SIGPIPE, SIG_IGN);
+    //(random() is only what multipart boundaries fall back on if
+    //getrandom() can't be used, but even then it mustn't be the same
+    //every run)
+    srandom(time(NULL) ^ getpid());
 	
 	int listenfd, connfd, port;
     socklen_t clientlen;
 	struct sockaddr_in clientaddr;
-	if(argc != 2){
-		fprintf(stderr,"Usage %s <port>\n",argv[0]);
+    char* diskdir = NULL; //-d: directory for the on-disk cache tier
+    int useuring = 0;     //-u: accept through io_uring
+    int limit = 0;        //-l: connections handled at once
+    int h2origin = 0;     //-2: start with the h2origin feature on
+    int opt;
+    while((opt = getopt(argc, argv, "d:s:uc:l:2")) != -1)
+    {
+        switch(opt)
+        {
+        case 'd':
+            diskdir = optarg;
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'u':
+            useuring = 1;
+            break;
+        case 'c':
+            coroutine_workers = atoi(optarg);
+            if(coroutine_workers <= 0)
+                coroutine_workers = COROUTINE_WORKERS;
+            break;
+        case 'l':
+            limit = atoi(optarg);
+            break;
+        case '2':
+            h2origin = 1;
+            break;
+        default:
+            optind = argc; //bail out to the usage message
+            break;
+        }
+    }
+	if(optind != argc-1){
+		fprintf(stderr,"Usage %s [-d cachedir] [-s snapshot] [-u] [-c workers] "
+                        "[-l limit] [-2] <port>\n",
+                argv[0]);
 		exit(1);
 	}
-	port = atoi(argv[1]);
+	port = atoi(argv[optind]);
 	printf("Proxy Started!\n==========================\n");
     printf("\tRunning on port %d\n\tRunning in %s\n"
             "\tBrowse to http://proxy-configurator/ "
@@ -179,9 +578,16 @@ int main (int argc, char *argv []){
 
     //init features
     //don't lock because it doesn't matter here (no threads)
-    ft_config.nope = 0;
-    ft_config.rickroll = 0;
-    ft_config.cache = 1;
+    struct features_t initial;
+    memset(&initial, 0, sizeof(initial));
+    initial.nope = 0;
+    initial.rickroll = 0;
+    initial.cache = 1;
+    initial.admission = 1;
+    initial.compress = 0;
+    initial.encode = 0;
+    initial.h2origin = h2origin;
+    publish_features(&initial);
 
 
     //initialize mutexes
@@ -190,52 +596,243 @@ int main (int argc, char *argv []){
 
     //initialize cache
     thecache.totalsize = 0;
+    thecache.rejected = 0;
+    thecache.policy = &policies[0];
     thecache.head = NULL;
     thecache.tail = NULL;
 
-	while(1) {
+    //the disk tier is optional, and comes up with whatever the last run left
+    if(diskdir && disk_cache_init(diskdir, MAX_OBJECT_SIZE) < 0)
+    {
+        fprintf(stderr, "Running without the disk cache\n");
+    }
+
+    //warm start, and save the cache again on the way down. the handler is
+    //installed without SA_RESTART so that it knocks main out of accept()
+    if(snapshot_path)
+    {
+        int loaded = load_cache_snapshot(snapshot_path);
+        if(loaded >= 0)
+            printf("\tLoaded %d objects from %s\n", loaded, snapshot_path);
+    }
+    struct sigaction action;
+    action.sa_handler = shutdown_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+
+    //past the limit, connections wait their turn or are turned away
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+    if(overload_init(limit, start_connection, refuse_connection) < 0)
+        fprintf(stderr, "Only shedding load as connections come and go\n");
+    pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, NULL);
+    printf("\tHandling up to %d connections at once\n",
+           limit > 0 ? limit : OVERLOAD_ACTIVE);
+
+    if(coroutine_workers > 0)
+    {
+        printf("\tRunning connections as coroutines on %d threads%s\n",
+               coroutine_workers,
+               useuring ? ", with their socket I/O through io_uring" : "");
+        pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+        if(coro_start(coroutine_workers, useuring) < 0)
+        {
+            fprintf(stderr, "Couldn't start the coroutine workers\n");
+            coroutine_workers = 0;
+        }
+        //and the compression that would hold them up goes to a pool
+        else if(workpool_start() < 0)
+        {
+            fprintf(stderr, "Compressing on the coroutine workers\n");
+        }
+        pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, NULL);
+    }
+
+    //the io_uring front end runs until shutdown, unless it can't start
+    if(useuring)
+    {
+        printf("\tAccepting through io_uring\n");
+        if(uring_serve(listenfd, &shutting_down, dispatch_connection) < 0)
+            fprintf(stderr, "io_uring isn't available, using accept()\n");
+    }
+
+	while(!shutting_down) {
 
-		pthread_t tid;
 		clientlen = sizeof(clientaddr);
 		connfd = accept(listenfd , (SA *)&clientaddr, &clientlen);
+        if(connfd < 0)
+            continue;
+        dispatch_connection(connfd, NULL, 0);
+    }
 
+    printf("Shutting down\n");
+    upstream_clear();
+    if(snapshot_path)
+    {
+        int saved = save_cache_snapshot(snapshot_path);
+        if(saved >= 0)
+            printf("\tSaved %d objects to %s\n", saved, snapshot_path);
+    }
+	return 0;
+}
+
+void shutdown_handler(int sig)
+{
+    (void)sig;
+    shutting_down = 1;
+}
+void dispatch_connection(int connfd, char* data, int len)
+{
+    //a client that goes quiet in the middle of sending its request (or
+    //before it's started) is given up on rather than holding its turn
+    struct timeval wait = {CLIENT_READ_TIMEOUT, 0};
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
 #ifdef SEQUENTIAL
-        handle_connection(connfd);
+    handle_read_connection(connfd, data, len, NULL);
 #else
-        int* fd_place = malloc(sizeof(int));
-        *fd_place = connfd;
-        pthread_create(&tid,
-                       NULL,
-                       new_connection_thread,
-                       (void*)fd_place);
+    struct newconn* conn = malloc(sizeof(struct newconn) + len);
+    if(!conn)
+    {
+        close(connfd);
+        return;
+    }
+    conn->fd = connfd;
+    conn->longlived = 0;
+    conn->len = len;
+    if(len > 0)
+        memcpy(conn->data, data, len);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    conn->addr = 0;
+    if(getpeername(connfd, (SA*)&addr, &addrlen) == 0
+       && addr.sin_family == AF_INET)
+        conn->addr = ntohl(addr.sin_addr.s_addr);
+    overload_arrive(conn, conn->addr);
 #endif
+}
+
+int start_connection(void* arg)
+{
+    if(coroutine_workers > 0
+       && coro_spawn(new_connection_coroutine, connection_done, arg) == 0)
+        return 0;
+    //(this can be a connection thread handing its turn on, so put its
+    //mask back as it was rather than unblocking)
+    pthread_t tid;
+    sigset_t mask;
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &mask);
+    int rc = pthread_create(&tid, NULL, new_connection_thread, arg);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    if(rc != 0)
+    {
+        fprintf(stderr, "Couldn't start a thread: %s\n", strerror(rc));
+        return -1;
     }
-	return 1; //never gets here
+    return 0;
+}
+
+void refuse_connection(void* arg, int status)
+{
+    struct newconn* conn = arg;
+    char response[MAXLINE];
+    int n = sprintf(response, "HTTP/1.1 %d %s\r\n"
+                              "Retry-After: 1\r\n"
+                              "Content-Length: 0\r\n"
+                              "Connection: close\r\n\r\n",
+                    status, status == OVERLOAD_TOO_MANY ? "Too Many Requests"
+                                                        : "Service Unavailable");
+    //without waiting on anything: this is called with admission control
+    //locked. what's come in of the request is read and thrown away first,
+    //since closing with it unread would reset the connection, and could
+    //lose the answer
+    ssize_t sent = send(conn->fd, response, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)sent;
+    shutdown(conn->fd, SHUT_WR);
+    while(recv(conn->fd, response, MAXLINE, MSG_DONTWAIT) > 0)
+        ;
+    close(conn->fd);
+    free(conn);
 }
+
 void* new_connection_thread(void* arg)
 {
     pthread_detach(pthread_self());
-	int connfd = *(int*)arg;
-    free(arg);
-    handle_connection(connfd);
+    struct newconn* conn = arg;
+    //the handler can end with pthread_exit() when a socket fails
+    pthread_cleanup_push(connection_done, arg);
+    handle_read_connection(conn->fd, conn->data, conn->len, conn);
+    pthread_cleanup_pop(1);
     return NULL;
 }
 
+void new_connection_coroutine(void* arg)
+{
+    struct newconn* conn = arg;
+    handle_read_connection(conn->fd, conn->data, conn->len, conn);
+}
+
+void connection_done(void* arg)
+{
+    struct newconn* conn = arg;
+    if(conn->longlived)
+        overload_leave_long(conn->addr);
+    else
+        overload_leave(conn->addr);
+    free(conn);
+}
+
+int connection_goes_long(struct newconn* conn)
+{
+    if(!conn || conn->longlived)
+        return 0;
+    if(overload_hold_long(conn->addr) < 0)
+        return -1;
+    conn->longlived = 1;
+    return 0;
+}
+
 void handle_connection(int connfd){
+    handle_read_connection(connfd, NULL, 0, NULL);
+}
+
+void handle_read_connection(int connfd, char* data, int len,
+                            struct newconn* conn){
+    long long started = metrics_now();
     char buffer[MAXLINE];
     memset(buffer, '\0', MAXLINE*sizeof(char));
     rio_t proxy_client;
     t_Rio_readinitb(&proxy_client, connfd);
+    //start the buffer off with what was read for us
+    if(len > 0)
+    {
+        memcpy(proxy_client.rio_buf, data, len);
+        proxy_client.rio_cnt = len;
+    }
 
     int server_fd;
     rio_t server_connection;
 
-    //get the first line of the request into the buffer
-    t_Rio_readlineb(&proxy_client, buffer, MAXLINE);
-    if(strncmp(buffer, "GET http:", 9) == 0)
+    //get the first line of the request into the buffer (if the client
+    //sends one in time)
+    if(rio_readlineb(&proxy_client, buffer, MAXLINE) <= 0)
+    {
+        close(connfd);
+        return;
+    }
+    char method[16] = "";
+    sscanf(buffer, "%15s", method);
+    int urlstart = strlen(method) + 1;
+    if(strncmp(buffer + urlstart, "http:", 5) == 0
+       && strcmp(method, "CONNECT") != 0)
     {
-        //we've got a get request
-        //debug_printf("Executing a GET request\n");
+        //we've got a request for a URL
+        //debug_printf("Executing a %s request\n", method);
+        int get = (strcmp(method, "GET") == 0);
+        int head = (strcmp(method, "HEAD") == 0);
 
         //parse the URL (hostname, path, and port) from the first line
         char hostname[MAXLINE];
@@ -247,7 +844,9 @@ void handle_connection(int connfd){
         //  then call the feature handler and end the function
         if((strcmp(hostname, "proxy-configurator") == 0))
         {
-            //manage the features
+            //manage the features (on a thread of its own, since /info
+            //writes to the client with the cache locked)
+            coro_detach();
             feature_console(connfd, &proxy_client, path);
             //and done
             return;
@@ -257,66 +856,341 @@ void handle_connection(int connfd){
         int cachestatus = handle_features(hostname, path, &port);
 
         char* requestheader = copy_request(&proxy_client);
+        if(!requestheader)
+        {
+            close(connfd);
+            return;
+        }
+
+        //a HEAD can be answered from what we cached for the GET, but
+        //nothing other than a GET is ever cached
+        int lookup = cachestatus && (get || head);
+        metrics_add(METRIC_REQUESTS, 1);
+        if(!lookup)
+            metrics_add(METRIC_BYPASSES, 1);
+        if(!get)
+        {
+            cachestatus = 0;
+        }
+
+        //the body (if there is one) goes straight through to the server.
+        //we tell the client to go ahead ourselves, since we don't start
+        //reading the server's answer until the body has been sent
+        char value[MAXLINE];
+        int hasbody =
+            find_header(requestheader, strlen(requestheader),
+                        "Content-Length", value, MAXLINE) ? (atol(value) > 0)
+            : find_header(requestheader, strlen(requestheader),
+                          "Transfer-Encoding", value, MAXLINE);
+        if(find_header(requestheader, strlen(requestheader), "Expect",
+                       value, MAXLINE))
+        {
+            remove_header(requestheader, "Expect");
+            if(hasbody && strcasecmp(value, "100-continue") == 0)
+            {
+                char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                t_Rio_writen(connfd, cont, strlen(cont));
+            }
+        }
+
+        //ranges are cut out of the whole object, so they aren't part of
+        //the cache key
+        struct rangerequest rr;
+        rr.range[0] = rr.ifrange[0] = '\0';
+        find_header(requestheader, strlen(requestheader), "Range",
+                    rr.range, MAXLINE);
+        find_header(requestheader, strlen(requestheader), "If-Range",
+                    rr.ifrange, MAXLINE);
+        remove_header(requestheader, "Range");
+        remove_header(requestheader, "If-Range");
+
+        struct features_t* features = features_get();
+        int encode = features->encode;
+        int h2origin = features->h2origin;
+        metrics_time(STAGE_PARSE, metrics_now() - started);
 
        
         //search the cache
-        if(cachestatus)
+        if(lookup)
         {
             char name[strlen(hostname)+strlen(path)+1];
             sprintf(name, "%s%s", hostname, path);
 
+            //every lookup, hit or miss, counts towards popularity
+            sketch_increment(name);
+
+            long long looking = metrics_now();
             struct cachenode* obj = get_cache_object(name, requestheader);
             if(obj)
             {
+                metrics_time(STAGE_LOOKUP, metrics_now() - looking);
                 debug_printf("Serving object %s from the cache! (Size %u)\n",
                         path, (unsigned)obj->size);
+                metrics_add(METRIC_HITS, 1);
+                if(!head)
+                    metrics_add(METRIC_CACHE_BYTES, obj->size - obj->hdrlen);
 
                 
-                t_Rio_writen(connfd, obj->data, obj->size);
+                if(head)
+                    rio_writen(connfd, obj->data, obj->hdrlen);
+                else
+                    serve_cached_object(connfd, obj, requestheader, &rr);
                 free_node(obj);
-
+                free(requestheader);
+                close(connfd);
+                return;
+            }
+            //not in memory, so try the disk tier
+            struct diskobject dobj;
+            int ondisk = disk_cache_open(name, requestheader, &dobj);
+            metrics_time(STAGE_LOOKUP, metrics_now() - looking);
+            if(ondisk)
+            {
+                count_cache_request(0, dobj.size);
+                debug_printf("Serving object %s from the disk cache! "
+                             "(Size %d)\n", path, dobj.size);
+                metrics_add(METRIC_HITS, 1);
+                if(!head)
+                    metrics_add(METRIC_CACHE_BYTES, dobj.size - dobj.hdrlen);
+                if(head)
+                {
+                    char* data = disk_cache_map(&dobj);
+                    if(data)
+                        rio_writen(connfd, data, dobj.hdrlen);
+                }
+                else
+                {
+                    serve_disk_object(connfd, &dobj, requestheader, &rr);
+                }
+                disk_cache_close(&dobj);
+                free(requestheader);
                 close(connfd);
                 return;
             }
+
+            //too big to be cached whole, it might be cached in slices. a
+            //range request can also fill in the slice it needs
+            struct sliceorigin origin;
+            origin.hostname = hostname;
+            origin.port = port;
+            origin.path = path;
+            origin.header = requestheader;
+            origin.fd = -1;
+            origin.h2 = h2origin;
+            int sliced = 0;
+            int fetched = 0;
+            if(head)
+            {
+                //any slice has the headers
+                struct cachenode* slice = find_slice(name, 0, requestheader);
+                if(slice)
+                {
+                    rio_writen(connfd, slice->data, slice->hdrlen);
+                    free_node(slice);
+                    sliced = 1;
+                }
+            }
             else
             {
-                debug_printf("Could not find %s in the cache\n", path);
+                sliced = serve_sliced(connfd, name, requestheader, &origin,
+                                      &rr, &fetched);
+            }
+            if(origin.fd >= 0)
+            {
+                if(origin.rio.rio_cnt == 0)
+                    upstream_put(hostname, port, origin.fd);
+                else
+                    close(origin.fd);
+            }
+            if(sliced)
+            {
+                debug_printf("Served %s from slices\n", path);
+                //(it's only a hit if the origin wasn't needed for any of
+                //it, and a failure is neither)
+                if(sliced > 0)
+                    metrics_add(fetched ? METRIC_MISSES : METRIC_HITS, 1);
+                free(requestheader);
+                close(connfd);
+                return;
             }
+            debug_printf("Could not find %s in the cache\n", path);
+            metrics_add(METRIC_MISSES, 1);
         }
 
-        //open the connection to the remote server
-		//pthread_rwlock_rdlock(&cachelock);
-		if((server_fd = open_clientfd_r(hostname, port)) < 0)
+        //HTTP/1.1 clients can take a chunked response
+        int chunked = (strstr(buffer, "HTTP/1.1") != NULL);
+
+        //use an idle connection to the server if we have one. the server
+        //might have closed it since, which we find out when the request
+        //gets no response at all, and then we try again on a new one. that
+        //can't be done with a body we've already passed on, or for methods
+        //that aren't safe to send twice, so those get a new connection
+        int pooled = !hasbody && (get || head || !strcmp(method, "OPTIONS")
+                                  || !strcmp(method, "PUT")
+                                  || !strcmp(method, "DELETE"));
+        int reusable = -1;
+        int fresh = 0;
+        while(reusable < 0)
         {
-            char errorbuf[] = "HTTP 404 NOTFOUND\r\n\r\n404 Not Found\r\n";
-            t_Rio_writen(connfd, errorbuf, strlen(errorbuf));
-            close(connfd);
-            return;
-        }
-		//pthread_rwlock_rdlock(&cachelock);
-        t_Rio_readinitb(&server_connection, server_fd);
+            //a stream over an HTTP/2 connection to the origin is tried
+            //first, and only once: if it fails it counts as a pooled
+            //connection failing, or a fresh one if we couldn't retry
+            server_fd = -1;
+            if(h2origin)
+            {
+                h2origin = 0;
+                server_fd = h2upstream_get(hostname, port, open_clientfd_r);
+                if(server_fd >= 0 && !pooled)
+                    fresh = 1;
+            }
+            if(server_fd < 0 && pooled)
+                server_fd = upstream_get(hostname, port);
+            if(server_fd < 0)
+            {
+                if(fresh)
+                {
+                    //a new connection didn't get a response either
+                    char errorbuf[] = "HTTP/1.0 502 Bad Gateway\r\n\r\n";
+                    t_Rio_writen(connfd, errorbuf, strlen(errorbuf));
+                    free(requestheader);
+                    close(connfd);
+                    return;
+                }
+                pooled = 0;
+                fresh = 1;
 
-        //now, make the GET request to the server
-        make_GET_request(path,requestheader, server_fd);
+                //open the connection to the remote server
+                if((server_fd = open_clientfd_r(hostname, port)) < 0)
+                {
+                    char errorbuf[] = "HTTP 404 NOTFOUND\r\n\r\n"
+                                      "404 Not Found\r\n";
+                    t_Rio_writen(connfd, errorbuf, strlen(errorbuf));
+                    free(requestheader);
+                    close(connfd);
+                    return;
+                }
+                upstream_opened();
+            }
+            t_Rio_readinitb(&server_connection, server_fd);
 
-        
-        //now read from the server back to the client
-        serve_to_client(connfd, &server_connection, hostname, 
-            path, cachestatus, requestheader);
+            //now, make the request to the server, and read from the
+            //server back to the client
+            if(make_request(method, hostname, port, path, requestheader,
+                            server_fd, encode && !head, &rr) == 0
+               && (!hasbody
+                   || send_request_body(&proxy_client, server_fd,
+                                        requestheader) == 0))
+            {
+                reusable = serve_to_client(connfd, &server_connection,
+                                           hostname, port, path,
+                                           cachestatus, requestheader,
+                                           encode && !head, chunked, head);
+            }
+            if(reusable < 0)
+            {
+                close(server_fd);
+                server_fd = -1;
+                pooled = 0;
+            }
+        }
 
-        //clean up
-        close(server_fd);
+        //clean up: keep the connection if nothing is left unread on it
+        //(unless it's been kept already)
+        if(reusable == 2)
+        {
+            debug_printf("%s went back to the pool early\n", hostname);
+        }
+        else if(reusable && server_connection.rio_cnt == 0)
+        {
+            upstream_put(hostname, port, server_fd);
+        }
+        else
+        {
+            close(server_fd);
+        }
         //debug_printf("Closed connection to %s%s\n", hostname, path);
     }
+    else if(strncmp(buffer, "CONNECT ", 8) == 0)
+    {
+        //a tunnel, most likely for HTTPS. it can last a long time, and
+        //it waits in poll() rather than coro_wait(), so it gets a thread
+        //(and doesn't hold up the connections waiting for a turn, unless
+        //there are already so many tunnels that it has to)
+        coro_detach();
+        connection_goes_long(conn);
+        handle_tunnel(connfd, &proxy_client, buffer);
+    }
+    else if(strcmp(buffer, "PRI * HTTP/2.0\r\n") == 0)
+    {
+        //an HTTP/2 client (with prior knowledge). each of its streams is
+        //handled like a connection of its own, with a turn of its own
+        //(and, like a tunnel, the connection gets a thread and gives up
+        //its turn)
+        coro_detach();
+        connection_goes_long(conn);
+        struct h2admit admit = { overload_take, overload_leave,
+                                 conn ? conn->addr : 0 };
+        h2_serve(connfd, &proxy_client, handle_connection,
+                 conn ? &admit : NULL);
+    }
     else
     {
-        //if we don't have a GET request with http, throw an error
+        //if we don't have a request for an http URL, throw an error
         char errorbuf[] = "HTTP 500 ERROR\r\n\r\n";
         t_Rio_writen(connfd, errorbuf, strlen(errorbuf));
     }
     close(connfd);
 }
 
+void handle_tunnel(int connfd, rio_t* proxy_client, char* requestline)
+{
+    //CONNECT host:port HTTP/1.1
+    char hostname[MAXLINE];
+    int port = 443;
+    if(sscanf(requestline + 8, "%[^: ]:%d", hostname, &port) < 1)
+    {
+        char errorbuf[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        t_Rio_writen(connfd, errorbuf, strlen(errorbuf));
+        return;
+    }
+    //the headers don't matter to us, but they have to come
+    char* headers = copy_request(proxy_client);
+    if(!headers)
+        return;
+    free(headers);
+
+    int server_fd = open_clientfd_r(hostname, port);
+    if(server_fd < 0)
+    {
+        char errorbuf[] = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
+        t_Rio_writen(connfd, errorbuf, strlen(errorbuf));
+        return;
+    }
+    char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if(rio_writen(connfd, established, strlen(established)) < 0)
+    {
+        close(server_fd);
+        return;
+    }
+    //the client may not have waited for our answer before starting, in
+    //which case some of what it sent is already in our buffer
+    if(proxy_client->rio_cnt > 0
+       && rio_writen(server_fd, proxy_client->rio_bufptr,
+                     proxy_client->rio_cnt) < 0)
+    {
+        close(server_fd);
+        return;
+    }
+    proxy_client->rio_cnt = 0;
+
+    debug_printf("Tunnelling to %s:%d\n", hostname, port);
+    long relayed = relay_tunnel(connfd, server_fd);
+    debug_printf("Tunnel to %s:%d closed after %ld bytes\n", hostname, port,
+                 relayed);
+    (void)relayed;
+    close(server_fd);
+}
+
 //parse a URL and set the hostname and path into the given buffers
 void parse_url(char buffer[MAXLINE], char* hostname, char* path, int *port)
 {
@@ -325,16 +1199,20 @@ void parse_url(char buffer[MAXLINE], char* hostname, char* path, int *port)
     memset(hostname, '\0', MAXLINE*sizeof(char));
     memset(path, '\0', MAXLINE*sizeof(char));
 
-    int i = 11; //first character after "GET http://"
+    //first character after "<METHOD> http://"
+    char* scheme = strstr(buffer, "http:");
+    int i = scheme ? (scheme - buffer) + 5 : 0;
     while(buffer[i] == '/')
     {
-        i++; //this accounts for GET/POST and https
+        i++;
     }
+    int j = 0;
     while(buffer[i] &&
             (buffer[i] != '/') &&
-            (buffer[i] != ':'))
+            (buffer[i] != ':') &&
+            (buffer[i] != ' '))
     {
-        hostname[i-11] = buffer[i];
+        hostname[j++] = buffer[i];
         i++;
     }
     if(buffer[i] == ':')
@@ -346,7 +1224,7 @@ void parse_url(char buffer[MAXLINE], char* hostname, char* path, int *port)
         sscanf(&buffer[i], "%s", path);
     }
 
-    hostname[i-11] = '\0';
+    hostname[j] = '\0';
 }
 
 //read the request from the 
@@ -360,7 +1238,7 @@ char* copy_request(rio_t* proxy_client)
     int bufferpos = 0;
     ssize_t n;
     char buffer[MAXLINE];
-    while((n=t_Rio_readlineb(proxy_client, buffer, MAXLINE)) && 
+    while((n=rio_readlineb(proxy_client, buffer, MAXLINE)) > 0 && 
             strncmp(buffer, "\r", 1))
     {
         //don't send proxy-connection or cache-control headers
@@ -375,6 +1253,11 @@ char* copy_request(rio_t* proxy_client)
             bufferpos+=sprintf(&tempbuffer[bufferpos], "%s", buffer);
         }
     }
+    if(n < 0)
+    {
+        free(tempbuffer);
+        return NULL;
+    }
     tempbuffer[bufferpos] = '\0';
     char* requestheaders = calloc(bufferpos+1, sizeof(char));
     memcpy(requestheaders, tempbuffer, bufferpos+1);
@@ -382,97 +1265,713 @@ char* copy_request(rio_t* proxy_client)
     return requestheaders;
 }
 
-void write_request(int server_fd, char* buffer)
+int copy_request_headers(char* out, char* buffer, int negotiate)
 {
-    t_Rio_writen(server_fd, buffer, strlen(buffer));
-   	t_Rio_writen(server_fd, "\r\n", 2);
+    int pos = 0;
+    char* line = buffer;
+    while(*line)
+    {
+        int len = strcspn(line, "\n");
+        if(line[len] == '\n')
+            len++;
+        //the connection to the server is ours to manage, and when we're
+        //negotiating we write our own Accept-Encoding
+        if(strncasecmp(line, "Connection:", 11) != 0
+           && strncasecmp(line, "Keep-Alive:", 11) != 0
+           && !(negotiate && strncasecmp(line, "Accept-Encoding:", 16) == 0))
+        {
+            memcpy(out + pos, line, len);
+            pos += len;
+        }
+        line += len;
+    }
+    if(negotiate)
+    {
+        //we might compress for the client, so make sure that whatever the
+        //origin sends is something we can work with
+        pos += sprintf(out + pos, "Accept-Encoding: %s%sidentity\r\n",
+                       accepts_encoding(buffer, "br") ? "br, " : "",
+                       accepts_encoding(buffer, "gzip") ? "gzip, " : "");
+    }
+    out[pos] = '\0';
+    return pos;
 }
-void make_GET_request(char* path,
+int make_request(char* method,
+                    char* hostname,
+                    int port,
+                    char* path,
                     char* buffer,
-                    int server_fd)
+                    int server_fd,
+                    int negotiate,
+                    struct rangerequest* rr)
 {
-    //make the GET request
-    t_Rio_writen(server_fd, "GET ", strlen("GET "));
-    t_Rio_writen(server_fd, path, strlen(path));
-    t_Rio_writen(server_fd, " ", strlen(" "));
-    t_Rio_writen(server_fd, "HTTP/1.0", strlen("HTTP/1.0"));
-    t_Rio_writen(server_fd, "\r\n", strlen("\r\n"));
-
-    verbose_printf("->\t%s%s HTTP/1.0 \r\n", "GET ", path);
+    //build the whole request so it goes out in one write
+    char* request = malloc(strlen(path) + strlen(hostname) + strlen(buffer)
+                           + 5*MAXLINE);
+    int pos = sprintf(request, "%s %s HTTP/1.1\r\n", method, path);
+    pos += copy_request_headers(request + pos, buffer, negotiate);
+    char host[MAXLINE];
+    if(!find_header(buffer, strlen(buffer), "Host", host, MAXLINE))
+    {
+        //HTTP/1.1 needs a Host header, which 1.0 clients might not send
+        pos += sprintf(request + pos, "Host: %s:%d\r\n", hostname, port);
+    }
+    if(rr && rr->range[0])
+    {
+        //a miss, so the server might as well only send what was asked for
+        pos += sprintf(request + pos, "Range: %s\r\n", rr->range);
+        if(rr->ifrange[0])
+            pos += sprintf(request + pos, "If-Range: %s\r\n", rr->ifrange);
+    }
+    pos += sprintf(request + pos, "Connection: keep-alive\r\n\r\n");
 
-    write_request(server_fd, buffer);
+    verbose_printf("->\t%s %s HTTP/1.1 \r\n", method, path);
 
+    int ret = (rio_writen(server_fd, request, pos) == pos) ? 0 : -1;
+    free(request);
+    return ret;
 }
 
-void serve_to_client(int connfd, rio_t* server_connection, 
-        char* hostname, char* path, int cachestatus, char* cachereq)
+int send_request_body(rio_t* proxy_client, int server_fd, char* requestheader)
 {
-    int shouldcache = 0; //smart caching: do the headers say we should cache?
-
-    //we'll build up this cache object
-    struct cachenode* cacheobj = newNode();
-    cacheobj->objname = calloc(strlen(hostname)+strlen(path)+1, sizeof(char));
-    sprintf(cacheobj->objname, "%s%s", hostname, path);
-	cacheobj->header = cachereq;
-    
-
-  
-    char tempbuffer[MAX_OBJECT_SIZE];
-    int bufferpos=0;
+    char value[MAXLINE];
+    int framing = BODY_LENGTH;
+    long length = 0;
+    if(find_header(requestheader, strlen(requestheader), "Transfer-Encoding",
+                   value, MAXLINE) && strcasestr(value, "chunked"))
+        framing = BODY_CHUNKED;
+    else if(find_header(requestheader, strlen(requestheader),
+                        "Content-Length", value, MAXLINE))
+        length = atol(value);
 
+    //a piece at a time, so a big upload never sits in memory. a chunked
+    //body is passed on chunked, since its headers said so
+    struct bodyreader body;
+    body_reader_init(&body, proxy_client, framing, length);
     char buffer[MAXLINE];
-    memset(buffer, '\0', MAXLINE);
+    int n;
+    while((n = body_read(&body, buffer, MAXLINE)) > 0)
+    {
+        if((framing == BODY_CHUNKED) ? chunk_write(server_fd, buffer, n) < 0
+                                     : rio_writen(server_fd, buffer, n) != n)
+            return -1;
+    }
+    if(n < 0)
+        return -1;
+    if(framing == BODY_CHUNKED && chunk_finish(server_fd) < 0)
+        return -1;
+    return 0;
+}
 
-    int n = 0; //number of bytes
-    while(((n=t_Rio_readlineb(server_connection, buffer, MAXLINE)) != 0) && 
-            buffer[0] != '\r')
+int find_header(char* headers, int len, char* name, char* value, int maxlen)
+{
+    int namelen = strlen(name);
+    char* line = headers;
+    char* end = headers + len;
+    while(line < end)
     {
-        //verbose_printf("<-\t%s", buffer);
-        if(rio_writen(connfd, buffer, strlen(buffer)) < 0)
+        char* eol = memchr(line, '\n', end - line);
+        if(!eol)
+            eol = end;
+        if((eol - line) > namelen && line[namelen] == ':'
+           && strncasecmp(line, name, namelen) == 0)
         {
-            printf("Write error from %s%s\n", hostname, path);
-            break;
+            char* v = line + namelen + 1;
+            while(v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            int n = eol - v;
+            while(n > 0 && (v[n-1] == '\r' || v[n-1] == ' '))
+                n--;
+            if(n > maxlen-1)
+                n = maxlen-1;
+            memcpy(value, v, n);
+            value[n] = '\0';
+            return 1;
         }
-        if((bufferpos + strlen(buffer)) >= MAX_OBJECT_SIZE)
-        {
-            //null out the object to signify that it's too big
+        line = eol + 1;
+    }
+    return 0;
+}
 
-			debug_printf("OMG HEADER SOOOO BIG \n");
-        }
-		n=sprintf(tempbuffer+bufferpos, "%s", buffer);
-		if(n > 0)
-		{
-			bufferpos+=n;
-		}
-		else
-		{
-			printf("\n\nError!\n\n");
-		}
+int accepts_encoding(char* requestheader, char* coding)
+{
+    char accept[MAXLINE];
+    if(!requestheader
+       || !find_header(requestheader, strlen(requestheader),
+                       "Accept-Encoding", accept, MAXLINE))
+        return 0;
 
-        //see if the header says anything about caching
-        //this will do nothing if there's no match
-        if(shouldcache >= 0)
-        {
-            sscanf(buffer, "Cache-Control: max-age=%d", &shouldcache);
-        }
+    //a comma-separated list of codings, each maybe with a ;q= weight
+    char* saveptr;
+    char* token = strtok_r(accept, ",", &saveptr);
+    while(token)
+    {
+        while(*token == ' ')
+            token++;
+        int len = strcspn(token, " ;");
+        double q = 1;
+        char* weight = strstr(token, "q=");
+        if(weight)
+            q = atof(weight + 2);
+        if(((int)strlen(coding) == len && strncasecmp(token, coding, len) == 0)
+           || (len == 1 && token[0] == '*'))
+            return q > 0;
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    return 0;
+}
 
-        //if the headers say explicitly that we shouldn't cache, then absolutely
-        //don't cache.
+int compressible_response(char* headers, int hdrlen)
+{
+    char value[MAXLINE];
+    if(hdrlen < 12 || strncmp(headers, "HTTP/1.", 7) != 0
+       || strncmp(headers + 8, " 200", 4) != 0)
+        return 0;
+    if(find_header(headers, hdrlen, "Content-Encoding", value, MAXLINE)
+       || find_header(headers, hdrlen, "Transfer-Encoding", value, MAXLINE)
+       || !find_header(headers, hdrlen, "Content-Type", value, MAXLINE))
+        return 0;
+    return compressible_type(value);
+}
+
+int encode_headers(char* headers, int hdrlen, int encoding, int bodylen,
+                   char* out)
+{
+    int pos = 0;
+    char* line = headers;
+    char* end = headers + hdrlen;
+    while(line < end)
+    {
+        char* eol = memchr(line, '\n', end - line);
+        int len = eol ? (eol - line + 1) : (end - line);
+        if(line[0] == '\r' || line[0] == '\n')
+            break; //the blank line
+        if(strncasecmp(line, "Content-Length:", 15) != 0
+           && strncasecmp(line, "Content-Encoding:", 17) != 0)
+        {
+            memcpy(out + pos, line, len);
+            pos += len;
+        }
+        line += len;
+    }
+    pos += sprintf(out + pos, "Content-Encoding: %s\r\n",
+                   encoding_name(encoding));
+    if(bodylen >= 0)
+        pos += sprintf(out + pos, "Content-Length: %d\r\n", bodylen);
+    pos += sprintf(out + pos, "Vary: Accept-Encoding\r\n\r\n");
+    return pos;
+}
+
+//write a cached response's header block, rewritten to describe a body sent
+//with a different content-coding and length
+int write_encoded_headers(int connfd, char* headers, int hdrlen,
+                          int encoding, int bodylen)
+{
+    char* out = malloc(hdrlen + MAXLINE);
+    int len = encode_headers(headers, hdrlen, encoding, bodylen, out);
+    int ret = (rio_writen(connfd, out, len) == len) ? 0 : -1;
+    free(out);
+    return ret;
+}
+
+int client_encoding(char* headers, int hdrlen, char* requestheader)
+{
+    if(!compressible_response(headers, hdrlen))
+        return ENCODING_IDENTITY;
+    if(accepts_encoding(requestheader, "br"))
+        return ENCODING_BR;
+    if(accepts_encoding(requestheader, "gzip"))
+        return ENCODING_GZIP;
+    return ENCODING_IDENTITY;
+}
+
+int serve_cached_object(int connfd, struct cachenode* obj, char* requestheader,
+                        struct rangerequest* rr)
+{
+    char* body = (char*)obj->data + obj->hdrlen;
+    int bodylen = obj->size - obj->hdrlen;
+    if(obj->encoding == ENCODING_IDENTITY && obj->hdrlen > 0)
+    {
+        //(ranges of a body we stored compressed would have to be inflated
+        //first, so those clients just get the whole thing)
+        int ret = serve_ranges(connfd, obj->data, obj->hdrlen, body, NULL,
+                               bodylen, rr);
+        if(ret != 0)
+            return (ret < 0) ? -1 : 0;
+    }
+    //(a body the proxy compressed for a client was compressed once, on its
+    //way into the cache, and is never compressed again here)
+    if(obj->encoding == ENCODING_IDENTITY)
+    {
+        return (rio_writen(connfd, obj->data, obj->size) == obj->size) ? 0 : -1;
+    }
+
+    if(accepts_encoding(requestheader, encoding_name(obj->encoding)))
+    {
+        //the client can take it the way we have it
+        if(write_encoded_headers(connfd, obj->data, obj->hdrlen,
+                                 obj->encoding, bodylen) < 0)
+            return -1;
+        return (rio_writen(connfd, body, bodylen) == bodylen) ? 0 : -1;
+    }
+
+    //the stored headers are still the origin's, which describe the body
+    //before we compressed it
+    if(rio_writen(connfd, obj->data, obj->hdrlen) != obj->hdrlen)
+        return -1;
+    return decode_to_fd(connfd, obj->encoding, body, bodylen);
+}
+
+int serve_disk_object(int connfd, struct diskobject* obj, char* requestheader,
+                      struct rangerequest* rr)
+{
+    if(obj->encoding == ENCODING_IDENTITY && !rr->range[0])
+    {
+        return (disk_cache_send(connfd, obj, 0, obj->size) < 0) ? -1 : 0;
+    }
+
+    //anything that might need rewriting gets mapped and handled just like
+    //an object in memory
+    char* data = disk_cache_map(obj);
+    if(!data)
+        return -1;
+    struct cachenode view;
+    view.data = data;
+    view.size = obj->size;
+    view.hdrlen = obj->hdrlen;
+    view.encoding = obj->encoding;
+    if(obj->encoding == ENCODING_IDENTITY && obj->hdrlen > 0)
+    {
+        //the parts themselves still go with sendfile()
+        int ret = serve_ranges(connfd, data, obj->hdrlen, NULL, obj,
+                               obj->size - obj->hdrlen, rr);
+        if(ret != 0)
+            return (ret < 0) ? -1 : 0;
+    }
+    return serve_cached_object(connfd, &view, requestheader, NULL);
+}
+
+int remove_header(char* headers, char* name)
+{
+    int namelen = strlen(name);
+    int found = 0;
+    char* line = headers;
+    while(*line)
+    {
+        int len = strcspn(line, "\n");
+        if(line[len] == '\n')
+            len++;
+        if(strncasecmp(line, name, namelen) == 0 && line[namelen] == ':')
+        {
+            memmove(line, line + len, strlen(line + len) + 1);
+            found = 1;
+        }
+        else
+        {
+            line += len;
+        }
+    }
+    return found;
+}
+
+int parse_ranges(char* spec, long size, struct byterange* ranges, int max)
+{
+    if(strncasecmp(spec, "bytes=", 6) != 0)
+        return -1;
+    char copy[MAXLINE];
+    strncpy(copy, spec + 6, MAXLINE-1);
+    copy[MAXLINE-1] = '\0';
+
+    int n = 0;
+    int given = 0;
+    char* saveptr;
+    char* token = strtok_r(copy, ",", &saveptr);
+    while(token)
+    {
+        while(*token == ' ')
+            token++;
+        char* dash = strchr(token, '-');
+        if(!dash || ++given > max)
+            return -1;
+        char* end;
+        long first, last;
+        if(dash == token)
+        {
+            //"-N": the last N bytes
+            long suffix = strtol(dash + 1, &end, 10);
+            if(end == dash + 1 || suffix < 0)
+                return -1;
+            first = (suffix > size) ? 0 : size - suffix;
+            last = size - 1;
+            if(suffix == 0)
+                first = size; //unsatisfiable
+        }
+        else
+        {
+            first = strtol(token, &end, 10);
+            if(end != dash || first < 0)
+                return -1;
+            if(dash[1] == '\0' || dash[1] == ' ')
+            {
+                last = size - 1; //"N-": from N to the end
+            }
+            else
+            {
+                last = strtol(dash + 1, &end, 10);
+                if(last < first)
+                    return -1;
+                if(last >= size)
+                    last = size - 1;
+            }
+        }
+        //ranges that start past the end are left out
+        if(first < size)
+        {
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    return given ? n : -1;
+}
+
+//send part of a cached body, from memory or from the disk tier
+static int send_body_part(int connfd, char* body, struct diskobject* disk,
+                          int hdrlen, long from, long len)
+{
+    if(disk)
+        return (disk_cache_send(connfd, disk, hdrlen + from, len) == len)
+               ? 0 : -1;
+    return (rio_writen(connfd, body + from, len) == len) ? 0 : -1;
+}
+
+int ifrange_matches(char* headers, int hdrlen, struct rangerequest* rr)
+{
+    char value[MAXLINE];
+    if(!rr->ifrange[0])
+        return 1;
+    return (find_header(headers, hdrlen, "ETag", value, MAXLINE)
+            && strcmp(value, rr->ifrange) == 0)
+        || (find_header(headers, hdrlen, "Last-Modified", value, MAXLINE)
+            && strcmp(value, rr->ifrange) == 0);
+}
+
+int partial_headers(char* out, char* headers, int hdrlen, int multipart)
+{
+    int pos = sprintf(out, "HTTP/1.1 206 Partial Content\r\n");
+    char* line = memchr(headers, '\n', hdrlen);
+    char* end = headers + hdrlen;
+    line = line ? line + 1 : end;
+    while(line < end)
+    {
+        char* eol = memchr(line, '\n', end - line);
+        int len = eol ? (eol - line + 1) : (end - line);
+        if(line[0] == '\r' || line[0] == '\n')
+            break; //the blank line
+        if(strncasecmp(line, "Content-Length:", 15) != 0
+           && strncasecmp(line, "Content-Range:", 14) != 0
+           && !(multipart && strncasecmp(line, "Content-Type:", 13) == 0))
+        {
+            memcpy(out + pos, line, len);
+            pos += len;
+        }
+        line += len;
+    }
+    return pos;
+}
+
+int serve_ranges(int connfd, char* headers, int hdrlen, char* body,
+                 struct diskobject* disk, long bodylen,
+                 struct rangerequest* rr)
+{
+    if(!rr || !rr->range[0] || hdrlen < 12
+       || strncmp(headers + 8, " 200", 4) != 0
+       || !ifrange_matches(headers, hdrlen, rr))
+        return 0;
+
+    struct byterange ranges[MAX_RANGES];
+    int n = parse_ranges(rr->range, bodylen, ranges, MAX_RANGES);
+    if(n < 0)
+        return 0; //not something we understand, so send the whole thing
+
+    char* out = malloc(hdrlen + MAXLINE);
+    int pos;
+    if(n == 0)
+    {
+        pos = sprintf(out, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                           "Content-Range: bytes */%ld\r\n"
+                           "Content-Length: 0\r\n"
+                           "Connection: close\r\n\r\n", bodylen);
+        int ret = (rio_writen(connfd, out, pos) == pos) ? 1 : -1;
+        free(out);
+        return ret;
+    }
+
+    char contenttype[MAXLINE] = "";
+    find_header(headers, hdrlen, "Content-Type", contenttype, MAXLINE);
+    pos = partial_headers(out, headers, hdrlen, n > 1);
+
+    int i;
+    int ret = 1;
+    if(n == 1)
+    {
+        long len = ranges[0].last - ranges[0].first + 1;
+        pos += sprintf(out + pos, "Content-Range: bytes %ld-%ld/%ld\r\n"
+                                  "Content-Length: %ld\r\n\r\n",
+                       ranges[0].first, ranges[0].last, bodylen, len);
+        if(rio_writen(connfd, out, pos) != pos
+           || send_body_part(connfd, body, disk, hdrlen,
+                             ranges[0].first, len) < 0)
+            ret = -1;
+        free(out);
+        return ret;
+    }
+
+    //several ranges go as multipart/byteranges. the part headers are
+    //worked out first so the whole length can go in Content-Length. the
+    //boundary is random for each response, so a body can't be made to
+    //have it in
+    unsigned long long unique[2];
+    if(getrandom(unique, sizeof(unique), GRND_NONBLOCK) != sizeof(unique))
+    {
+        unique[0] = ((unsigned long long)random() << 32) ^ metrics_now();
+        unique[1] = ((unsigned long long)random() << 32) ^ (uintptr_t)body;
+    }
+    char boundary[48];
+    sprintf(boundary, "PROXY%016llx%016llx", unique[0], unique[1]);
+    char* parts[MAX_RANGES];
+    int partlens[MAX_RANGES];
+    long total = 0;
+    for(i = 0; i < n; i++)
+    {
+        parts[i] = malloc(strlen(contenttype) + 128);
+        partlens[i] = sprintf(parts[i], "\r\n--%s\r\n%s%s%s"
+                                        "Content-Range: bytes %ld-%ld/%ld"
+                                        "\r\n\r\n",
+                              boundary,
+                              contenttype[0] ? "Content-Type: " : "",
+                              contenttype, contenttype[0] ? "\r\n" : "",
+                              ranges[i].first, ranges[i].last, bodylen);
+        total += partlens[i] + ranges[i].last - ranges[i].first + 1;
+    }
+    char closing[64];
+    int closinglen = sprintf(closing, "\r\n--%s--\r\n", boundary);
+    total += closinglen;
+    pos += sprintf(out + pos, "Content-Type: multipart/byteranges; "
+                              "boundary=%s\r\n"
+                              "Content-Length: %ld\r\n\r\n",
+                   boundary, total);
+    if(rio_writen(connfd, out, pos) != pos)
+        ret = -1;
+    for(i = 0; i < n; i++)
+    {
+        if(ret > 0
+           && (rio_writen(connfd, parts[i], partlens[i]) != partlens[i]
+               || send_body_part(connfd, body, disk, hdrlen, ranges[i].first,
+                                 ranges[i].last - ranges[i].first + 1) < 0))
+            ret = -1;
+        free(parts[i]);
+    }
+    if(ret > 0 && rio_writen(connfd, closing, closinglen) != closinglen)
+        ret = -1;
+    free(out);
+    return ret;
+}
+
+int read_status_line(rio_t* rio, char* buffer)
+{
+    int n;
+    while((n = rio_readlineb(rio, buffer, MAXLINE)) > 0)
+    {
+        //(101 is the last thing said in HTTP/1, so it counts as final)
+        int status = 0;
+        if(sscanf(buffer, "HTTP/1.%*d %d", &status) != 1
+           || status < 100 || status >= 200 || status == 101)
+            return n;
+        //100 Continue, 103 Early Hints and the like come ahead of the real
+        //answer, and we don't pass them on
+        debug_printf("Skipping an interim %d response\n", status);
+        while((n = rio_readlineb(rio, buffer, MAXLINE)) > 0
+              && buffer[0] != '\r' && buffer[0] != '\n')
+            ;
+        if(n <= 0)
+            return n;
+    }
+    return n;
+}
+
+int serve_to_client(int connfd, rio_t* server_connection, 
+        char* hostname, int port, char* path, int cachestatus,
+        char* cachereq, int encode, int chunked, int head)
+{
+    int shouldcache = 0; //smart caching: do the headers say we should cache?
+    int keepalive = 0;   //will the server keep the connection open?
+    int framing = BODY_CLOSE;
+    long length = 0;
+
+  
+    //(kept off the stack, which is only a coroutine's)
+    char* tempbuffer = malloc(MAX_OBJECT_SIZE);
+    int bufferpos=0;
+
+    char buffer[MAXLINE];
+    memset(buffer, '\0', MAXLINE);
+
+    //the status line. if there isn't one, the server closed the connection
+    //without answering
+    long long sent = metrics_now();
+    int n = read_status_line(server_connection, buffer);
+    if(n <= 0)
+    {
+        free(tempbuffer);
+        return -1;
+    }
+    long long answered = metrics_now();
+    metrics_time(STAGE_TTFB, answered - sent);
+    int status = 0;
+    int minor = 0;
+    sscanf(buffer, "HTTP/1.%d %d", &minor, &status);
+    keepalive = (minor >= 1);
+    if(head || status == 204 || status == 304
+       || (status >= 100 && status < 200))
+    {
+        //no body, whatever the headers say
+        framing = BODY_LENGTH;
+    }
+
+    //we'll build up this cache object
+    struct cachenode* cacheobj = newNode();
+    cacheobj->objname = calloc(strlen(hostname)+strlen(path)+1, sizeof(char));
+    sprintf(cacheobj->objname, "%s%s", hostname, path);
+	cacheobj->header = cachereq;
+    cacheobj->stored = time(NULL);
+
+    do
+    {
+        //verbose_printf("<-\t%s", buffer);
+        //(the headers go to the client once we have all of them, in case
+        //they need rewriting)
+
+        //hop-by-hop headers describe our connection to the server, so
+        //they're used up here rather than passed along
+        if(strncasecmp(buffer, "Transfer-Encoding:", 18) == 0)
+        {
+            if(strcasestr(buffer, "chunked") && framing == BODY_CLOSE)
+                framing = BODY_CHUNKED;
+            continue;
+        }
+        if(strncasecmp(buffer, "Connection:", 11) == 0)
+        {
+            if(strcasestr(buffer, "close"))
+                keepalive = 0;
+            continue;
+        }
+        if(strncasecmp(buffer, "Keep-Alive:", 11) == 0)
+        {
+            continue;
+        }
+        if(strncasecmp(buffer, "Content-Length:", 15) == 0
+           && framing == BODY_CLOSE)
+        {
+            framing = BODY_LENGTH;
+            length = atol(buffer + 15);
+        }
+
+        if((bufferpos + strlen(buffer)) >= MAX_OBJECT_SIZE)
+        {
+            //null out the object to signify that it's too big
+
+			debug_printf("OMG HEADER SOOOO BIG \n");
+        }
+		n=sprintf(tempbuffer+bufferpos, "%s", buffer);
+		if(n > 0)
+		{
+			bufferpos+=n;
+		}
+		else
+		{
+			printf("\n\nError!\n\n");
+		}
+
+        //see if the header says anything about caching
+        //this will do nothing if there's no match
+        if(shouldcache >= 0)
+        {
+            sscanf(buffer, "Cache-Control: max-age=%d", &shouldcache);
+        }
+        //and remember the freshness lifetime for snapshots
+        sscanf(buffer, "Cache-Control: max-age=%d", &cacheobj->maxage);
+
+        //if the headers say explicitly that we shouldn't cache, then absolutely
+        //don't cache.
         if(strncmp(buffer, "Cache-Control: private", 22)
            || strncmp(buffer, "Cache-Control: no-cache", 23))
         {
             shouldcache = -1;
         }
+    } while(((n=rio_readlineb(server_connection, buffer, MAXLINE)) > 0) && 
+            buffer[0] != '\r');
+    if(n <= 0)
+    {
+        keepalive = 0;
     }
-    t_Rio_writen(connfd, "\r\n", strlen("\r\n"));
-    
-    if((bufferpos+2) >= MAX_OBJECT_SIZE)
+    if((bufferpos+32) >= MAX_OBJECT_SIZE)
     {
        debug_printf("OMG HEADER SOOOO BIG \n");
     }
     
-    tempbuffer[bufferpos++] = '\r';
-    tempbuffer[bufferpos++] = '\n';
+    //we close the client connection after this response, whatever the
+    //server does with ours
+    bufferpos += sprintf(tempbuffer+bufferpos, "Connection: close\r\n\r\n");
+
+    cacheobj->hdrlen = bufferpos;
+
+    //if the origin sent plain text and the client takes compressed, squeeze
+    //the body on the way through. the cache gets the compressed copy: it's
+    //smaller, and it's keyed on this client's headers, so the next client
+    //to find it asked the same way (and anyone who can't take it gets it
+    //decoded)
+    struct encoder* enc = NULL;
+    int encoding = ENCODING_IDENTITY;
+    if(encode)
+        encoding = client_encoding(tempbuffer, bufferpos, cachereq);
+    if(encoding != ENCODING_IDENTITY)
+        enc = encoder_new(encoding);
+
+    //the headers for the client. if we don't know how long the body will
+    //be, a 1.1 client gets it in chunks
+    char* clienthdr = malloc(bufferpos + MAXLINE);
+    int clienthdrlen;
+    if(enc)
+    {
+        debug_printf("Compressing %s%s with %s\n", hostname, path,
+                     encoding_name(encoding));
+        clienthdrlen = encode_headers(tempbuffer, bufferpos, encoding, -1,
+                                      clienthdr);
+    }
+    else
+    {
+        memcpy(clienthdr, tempbuffer, bufferpos);
+        clienthdrlen = bufferpos;
+    }
+    int chunkout = chunked && (enc || framing == BODY_CHUNKED);
+    if(chunkout)
+    {
+        clienthdrlen -= 2;
+        clienthdrlen += sprintf(clienthdr+clienthdrlen,
+                                "Transfer-Encoding: chunked\r\n\r\n");
+    }
+    n = (rio_writen(connfd, clienthdr, clienthdrlen) < 0) ? -1 : 0;
+    free(clienthdr);
+    if(n < 0)
+    {
+        printf("Write error from %s%s\n", hostname, path);
+        encoder_free(enc);
+        free_node(cacheobj);
+        free(tempbuffer);
+        return 0;
+    }
    
 	
 	
@@ -481,15 +1980,112 @@ void serve_to_client(int connfd, rio_t* server_connection,
     {
         shouldcache = 0;
     }
+
+    //a body too big to cache whole is cached in slices as it goes by
+    //(if we know its length, since every slice needs it)
+    char* slicebuf = NULL;
+    int slicepos = 0;
+    long sliceindex = 0;
+    if(status == 200 && framing == BODY_LENGTH
+       && cacheobj->hdrlen + length >= MAX_OBJECT_SIZE
+       && (cachestatus == 1 || (cachestatus == 2 && shouldcache)))
+    {
+        slicebuf = malloc(SLICE_SIZE);
+    }
+    //and what the encoder makes of a body that's cached whole is kept
+    char* packed = NULL;
+    int packedlen = 0;
+    if(enc && !slicebuf && (cachestatus == 1 || cachestatus == 2))
+    {
+        packed = malloc(MAX_OBJECT_SIZE);
+    }
     
-    while((n=t_Rio_readnb(server_connection, buffer, MAXLINE)) >0)
+    //relay the body as it comes, de-chunked. whatever the client can't
+    //take yet waits in the spool, and the origin is read ahead of the
+    //client until the spool is full
+    struct spool spool;
+    spool_init(&spool);
+    int server_fd = server_connection->rio_fd;
+    int released = 0; //the origin connection went back to the pool early
+    struct bodyreader body;
+    body_reader_init(&body, server_connection, framing, length);
+    int finished = 0;
+    for(;;)
     {
-        if(rio_writen(connfd, buffer, n) < 0)
+        int reading = !finished && !spool_full(&spool);
+        if(!reading && spool.len == 0)
+            break;
+        if(finished && !released && keepalive && body_complete(&body)
+           && server_connection->rio_cnt == 0)
+        {
+            //all read, and the client still has some way to go
+            upstream_put(hostname, port, server_fd);
+            released = 1;
+        }
+
+        //with the client behind, and nothing read from the origin yet,
+        //wait for whichever of them is ready first
+        if(spool.len > 0 && !(reading && server_connection->rio_cnt > 0))
+        {
+            int ready = spool_wait(&spool, connfd, reading ? server_fd : -1);
+            if(!ready
+               || ((ready & SPOOL_OUT) && spool_flush(&spool, connfd) < 0))
+            {
+                printf("Client stalled or gone for %s%s\n", hostname, path);
+                encoder_free(enc);
+                spool_free(&spool);
+                free(slicebuf);
+                free(packed);
+                free_node(cacheobj);
+                free(tempbuffer);
+                return released ? 2 : 0;
+            }
+            if(!(ready & SPOOL_IN))
+                continue;
+        }
+
+        n = body_read(&body, buffer, MAXLINE);
+        if(n < 0)
+        {
+            //the body was cut short, so it's no good to the cache
+            printf("Error reading from %s%s\n", hostname, path);
+            encoder_free(enc);
+            spool_free(&spool);
+            free(slicebuf);
+            free(packed);
+            free_node(cacheobj);
+            free(tempbuffer);
+            return 0;
+        }
+        char* out = buffer;
+        int outlen = n;
+        //the last round flushes the encoder
+        finished = (n == 0);
+        if(enc)
+            outlen = encoder_update(enc, buffer, n, finished, &out);
+        if(outlen < 0
+           || (chunkout ? spool_chunk(&spool, connfd, out, outlen)
+                        : spool_write(&spool, connfd, out, outlen)) < 0
+           || (finished && chunkout
+               && spool_write(&spool, connfd, "0\r\n\r\n", 5) < 0))
         {
 			printf("Error writing from %s%s\n", hostname, path);
             //error on write
+            encoder_free(enc);
+            spool_free(&spool);
+            free(slicebuf);
+            free(packed);
             free_node(cacheobj);
-			return;
+            free(tempbuffer);
+			return 0;
+        }
+        //(what the client gets, which is after any compression)
+        metrics_add(METRIC_ORIGIN_BYTES, outlen);
+        if(packed && outlen > 0)
+        {
+            if(packedlen + outlen < MAX_OBJECT_SIZE)
+                memcpy(packed + packedlen, out, outlen);
+            packedlen += outlen;
         }
 		//n=sprintf(tempbuffer+bufferpos, "%s", buffer);
         if(bufferpos+n < MAX_OBJECT_SIZE)
@@ -499,28 +2095,110 @@ void serve_to_client(int connfd, rio_t* server_connection,
         bufferpos += n;
         //verbose_printf("<-\t%s", buffer);
 
+        int used = 0;
+        while(slicebuf && used < n)
+        {
+            int take = SLICE_SIZE - slicepos;
+            if(take > n - used)
+                take = n - used;
+            memcpy(slicebuf + slicepos, buffer + used, take);
+            slicepos += take;
+            used += take;
+            if(slicepos == SLICE_SIZE)
+            {
+                store_slice(cacheobj->objname, sliceindex++, cachereq,
+                            tempbuffer, cacheobj->hdrlen, slicebuf,
+                            SLICE_SIZE);
+                slicepos = 0;
+            }
+        }
+
         memset(buffer, '\0', MAXLINE*sizeof(char));
     }
-    
-	if(bufferpos < MAX_OBJECT_SIZE)
+    encoder_free(enc);
+    spool_free(&spool);
+    keepalive = keepalive && body_complete(&body);
+    metrics_time(STAGE_TRANSFER, metrics_now() - answered);
+    if(slicebuf && slicepos > 0)
     {
-        char *data = calloc(sizeof(char),bufferpos);
-    	memcpy(data, tempbuffer, bufferpos);
-        cacheobj->data = data;
+        //the last slice is whatever's left
+        store_slice(cacheobj->objname, sliceindex, cachereq, tempbuffer,
+                    cacheobj->hdrlen, slicebuf, slicepos);
     }
+    free(slicebuf);
+    
 	cacheobj->size = bufferpos;
 	debug_printf("size = %d\n",(int)(cacheobj->size));
-	if(cacheobj->size >= MAX_OBJECT_SIZE)
+    if(cachestatus)
+    {
+        //we looked for this in the cache and missed
+        count_cache_request(0, bufferpos);
+    }
+    //(compressed, it may fit when the origin's copy wouldn't)
+    int storedsize = packed ? cacheobj->hdrlen + packedlen : bufferpos;
+	if(storedsize + (framing == BODY_CHUNKED ? 64 : 0) >= MAX_OBJECT_SIZE)
 	{
+        free(packed);
         free_node(cacheobj);
         cacheobj = NULL;
 	}
+    else if(status == 206)
+    {
+        //only part of the object, which can't stand in for all of it
+        debug_printf("Partial response: skipping the cache\n");
+        free(packed);
+        free_node(cacheobj);
+        free(tempbuffer);
+        return released ? 2 : keepalive;
+    }
 	
     if(cacheobj)
     {
-        cacheobj->size = bufferpos;
-        cacheobj->data = calloc(bufferpos, sizeof(char));
-        memcpy(cacheobj->data, tempbuffer, bufferpos);
+        if(packed)
+        {
+            //the origin's headers (saying how long the body is once it's
+            //decoded, if they didn't already), then the compressed body
+            int at = cacheobj->hdrlen - 2;
+            char* data = malloc(at + 64 + packedlen);
+            memcpy(data, tempbuffer, at);
+            if(framing == BODY_CHUNKED)
+                at += sprintf(data + at, "Content-Length: %d\r\n",
+                              bufferpos - cacheobj->hdrlen);
+            memcpy(data + at, "\r\n", 2);
+            cacheobj->hdrlen = at + 2;
+            memcpy(data + cacheobj->hdrlen, packed, packedlen);
+            free(packed);
+            cacheobj->data = data;
+            cacheobj->size = cacheobj->hdrlen + packedlen;
+            cacheobj->encoding = encoding;
+        }
+        else
+        {
+            if(framing == BODY_CHUNKED)
+            {
+                //we have the whole body now, so the cached copy can say how
+                //long it is
+                int bodylen = bufferpos - cacheobj->hdrlen;
+                char lenhdr[64];
+                int extra = sprintf(lenhdr, "Content-Length: %d\r\n",
+                                    bodylen);
+                int at = cacheobj->hdrlen - 2;
+                memmove(tempbuffer + at + extra, tempbuffer + at,
+                        bufferpos - at);
+                memcpy(tempbuffer + at, lenhdr, extra);
+                bufferpos += extra;
+                cacheobj->hdrlen += extra;
+            }
+            cacheobj->size = bufferpos;
+            cacheobj->data = calloc(bufferpos, sizeof(char));
+            memcpy(cacheobj->data, tempbuffer, bufferpos);
+
+            int compress = features_get()->compress;
+            if(cachestatus && compress)
+            {
+                compress_cache_object(cacheobj);
+            }
+        }
 
         if(cachestatus == 1) //1 = cache, 2 = smart cache, 0 = don't cache
         {
@@ -556,6 +2234,21 @@ void serve_to_client(int connfd, rio_t* server_connection,
     {
         debug_printf("Object was too big for cache, didn't cache it\n");
     }
+    free(tempbuffer);
+    return released ? 2 : keepalive;
+}
+
+int spool_chunk(struct spool* spool, int connfd, char* buf, int len)
+{
+    if(len <= 0)
+        return 0;
+    char head[32];
+    int n = sprintf(head, "%x\r\n", len);
+    if(spool_write(spool, connfd, head, n) < 0
+       || spool_write(spool, connfd, buf, len) < 0
+       || spool_write(spool, connfd, "\r\n", 2) < 0)
+        return -1;
+    return 0;
 }
 
 /***********
@@ -571,91 +2264,170 @@ void add_cache_object(struct cachenode* obj)
         printf("Discarded object: too big\n");
         return; //discard it
     }
+    int admission = features_get()->admission;
+
     debug_printf("Write locking the cache to add an object\n");
-    pthread_rwlock_wrlock(&cachelock);
+    long long taken = metrics_wrlock(&cachelock, LOCK_INSERT);
+
+    if(admission && !admit_cache_object(obj))
+    {
+        thecache.rejected++;
+        debug_printf("Admission filter turned away %s\n", obj->objname);
+        metrics_rwunlock(&cachelock, LOCK_INSERT, taken);
+        free_node(obj);
+        return;
+    }
 
     //now add the new entry to the front of the list
-    obj->prev = NULL;
-    obj->next = thecache.head;
-    if(obj->next)
-        obj->next->prev = obj;
-    thecache.head = obj;
-    if(thecache.tail == NULL)
-        thecache.tail = obj;
+    link_node(obj);
     thecache.totalsize += obj->size;
+    thecache.policy->inserted(obj);
 
+    //evicted objects are demoted to the disk tier once we've let go of the
+    //lock, so chain them up here (through their next pointers)
+    struct cachenode* evicted = NULL;
 
-    while(thecache.totalsize > MAX_CACHE_SIZE)
+    while(thecache.totalsize > max_cache_size)
     {
-        //while there's not enough space, knock out oldest entry
-        struct cachenode* end = thecache.tail;
+        //while there's not enough space, knock out whatever the eviction
+        //policy picks
+        struct cachenode* end = thecache.policy->victim();
         if(end == NULL)
         {
-            thecache.totalsize = 0;
-            thecache.head = NULL;
             break;
         }
-        struct cachenode* newend = end->prev;
+        unlink_node(end);
         thecache.totalsize = thecache.totalsize - end->size;
+        thecache.policy->evicted(end);
+        metrics_add(METRIC_EVICTIONS, 1);
         debug_printf("Freed %d bytes from the cache\n", end->size);
 
-        free_node(end);
-        if(newend)
-            newend->next = NULL;
-        thecache.tail = newend;
-        //if we've freed the whole cache, update the head pointer appropriately 
-        if(thecache.tail == NULL)
-        {
-            thecache.head = NULL;
-            thecache.totalsize = 0;
-        }
+        end->next = evicted;
+        evicted = end;
     }
 
     debug_printf("\tNew total cache size is %u\n", thecache.totalsize);
 
     debug_printf("Unlocking the cache from writing\n");
-    pthread_rwlock_unlock(&cachelock);
-}
+    metrics_rwunlock(&cachelock, LOCK_INSERT, taken);
 
+    while(evicted)
+    {
+        struct cachenode* next = evicted->next;
+        disk_cache_put(evicted->objname, evicted->header,
+                       evicted->data, evicted->size,
+                       evicted->hdrlen, evicted->encoding);
+        free_node(evicted);
+        evicted = next;
+    }
+}
 
-void update_node(struct cachenode *which)
+//TinyLFU admission: if there's room, anything goes. Otherwise only admit
+//the new object if it's been requested more often than the object the
+//eviction policy would throw out next
+int admit_cache_object(struct cachenode* obj)
 {
-    debug_printf("Locking the cache to update LRU\n");
-    pthread_rwlock_wrlock(&cachelock);
-    //find the object in the cache.  If it has since been removed by a
-    //concurrent process, give up.
-    struct cachenode* obj = thecache.head;
-    
-    while(obj && obj != which)
+    if(thecache.totalsize + obj->size <= max_cache_size)
+        return 1;
+
+    int candidate = sketch_estimate(obj->objname);
+    struct cachenode* victim = thecache.policy->peek();
+    if(victim && sketch_estimate(victim->objname) >= candidate)
     {
-        obj = obj->next;
+        debug_printf("%s (%d) loses to %s\n", obj->objname, candidate,
+                     victim->objname);
+        return 0;
     }
+    return 1;
+}
 
-    if(!obj)
+//store the body of a plain 200 text response gzip'd, if it's worth it
+void compress_cache_object(struct cachenode* obj)
+{
+    int bodylen = obj->size - obj->hdrlen;
+    if(obj->encoding != ENCODING_IDENTITY || obj->hdrlen <= 0 || bodylen < 256
+       || !compressible_response(obj->data, obj->hdrlen))
+        return;
+
+    struct gzipjob job = { (char*)obj->data + obj->hdrlen, bodylen, NULL, -1 };
+    workpool_run(gzip_job, &job, bodylen);
+    void* packed = job.out;
+    int packedlen = job.outlen;
+    if(packedlen < 0 || packedlen >= bodylen)
+    {
+        if(packedlen >= 0)
+            free(packed);
+        return;
+    }
+
+    char* data = malloc(obj->hdrlen + packedlen);
+    memcpy(data, obj->data, obj->hdrlen);
+    memcpy(data + obj->hdrlen, packed, packedlen);
+    free(packed);
+    free(obj->data);
+    debug_printf("Compressed %s from %d to %d bytes\n", obj->objname,
+                 bodylen, packedlen);
+    obj->data = data;
+    obj->size = obj->hdrlen + packedlen;
+    obj->encoding = ENCODING_GZIP;
+}
+
+void gzip_job(void* arg)
+{
+    struct gzipjob* job = arg;
+    job->outlen = gzip_buffer(job->in, job->inlen, &job->out);
+}
+
+//link an object in at the head of the list
+void link_node(struct cachenode* obj)
+{
+    obj->prev = NULL;
+    obj->next = thecache.head;
+    if(obj->next)
+        obj->next->prev = obj;
+    thecache.head = obj;
+    if(thecache.tail == NULL)
+        thecache.tail = obj;
+}
+
+//take an object out of the list, wherever it is
+void unlink_node(struct cachenode* obj)
+{
+    if(obj->prev)
+        obj->prev->next = obj->next;
+    else
+        thecache.head = obj->next;
+    if(obj->next)
+        obj->next->prev = obj->prev;
+    else
+        thecache.tail = obj->prev;
+    obj->prev = NULL;
+    obj->next = NULL;
+}
+
+void update_node(struct cachenode *which)
+{
+    debug_printf("Locking the cache to update LRU\n");
+    long long taken = metrics_wrlock(&cachelock, LOCK_TOUCH);
+    //find the object in the cache.  If it has since been removed by a
+    //concurrent process, give up.
+    struct cachenode* obj = thecache.head;
+    
+    while(obj && obj != which)
+    {
+        obj = obj->next;
+    }
+
+    if(!obj)
     {
         //we didn't find it, unlock the cache and give up.
         debug_printf("Unlocked the cache from LRU update (unsuccessful)\n");
-        pthread_rwlock_unlock(&cachelock);
+        metrics_rwunlock(&cachelock, LOCK_TOUCH, taken);
         return;
     }
 
-	//move it to the head of the list
-	struct cachenode* prev = obj->prev;
-	struct cachenode* next = obj->next;
-	if(prev)
-		prev->next = next;
-	if(next)
-		next->prev = prev;
-	obj->prev = NULL;
-	obj->next = thecache.head;
-	if(obj->next == obj)
-	{
-		obj->next = NULL;
-	}
-	if(obj->next)
-		obj->next->prev = obj;
-	thecache.head = obj;
-    pthread_rwlock_unlock(&cachelock);
+    thecache.policy->touched(obj);
+    metrics_rwunlock(&cachelock, LOCK_TOUCH, taken);
     debug_printf("Unlocked the cache from LRU update\n");
 }
 
@@ -664,7 +2436,7 @@ void update_node(struct cachenode *which)
 struct cachenode* get_cache_object(char* hostpath, char* header)
 {
     debug_printf("Read-locking the cache to search it\n");
-    pthread_rwlock_rdlock(&cachelock);
+    long long taken = metrics_rdlock(&cachelock, LOCK_LOOKUP);
     debug_printf("\tGot lock\n");
     struct cachenode* obj = thecache.head;
     while(obj)
@@ -683,64 +2455,979 @@ struct cachenode* get_cache_object(char* hostpath, char* header)
             ret->data = malloc(obj->size);
             memcpy(ret->data, obj->data, obj->size);
             ret->size = obj->size;
+            ret->hdrlen = obj->hdrlen;
+            ret->encoding = obj->encoding;
             ret->header = NULL; //we don't care about the header, and free(NULL)
                                 //                                 does nothing.
+            count_cache_request(1, obj->size);
+
+            //policies that only bump counters on a hit can do it right here
+            if(thecache.policy->touch_readlocked)
+            {
+                thecache.policy->touched(obj);
+                metrics_rwunlock(&cachelock, LOCK_LOOKUP, taken);
+                return ret;
+            }
             debug_printf("Unlocking the cache to re-lock for update\n");
-            pthread_rwlock_unlock(&cachelock);
+            metrics_rwunlock(&cachelock, LOCK_LOOKUP, taken);
 
 			update_node(obj);
             return ret;
         }
-        obj = obj->next;
+        obj = obj->next;
+    }
+    debug_printf("Unlocking the cache from search\n");
+    metrics_rwunlock(&cachelock, LOCK_LOOKUP, taken);
+    return NULL;
+}
+
+
+/***********
+ ** Large objects
+ ***********/
+
+void slice_name(char* out, char* objname, long index)
+{
+    sprintf(out, "%s#slice%ld", objname, index);
+}
+
+//the whole body's length, from a slice's headers
+static long slice_total(struct cachenode* slice)
+{
+    char value[MAXLINE];
+    if(!find_header(slice->data, slice->hdrlen, "Content-Length", value,
+                    MAXLINE))
+        return -1;
+    return atol(value);
+}
+
+struct cachenode* find_slice(char* objname, long index, char* header)
+{
+    char name[strlen(objname) + 32];
+    slice_name(name, objname, index);
+    sketch_increment(name);
+
+    struct cachenode* slice = get_cache_object(name, header);
+    if(slice)
+        return slice;
+
+    //the disk tier hands back a descriptor, but a slice is small enough to
+    //just read into memory
+    struct diskobject dobj;
+    if(!disk_cache_open(name, header, &dobj))
+        return NULL;
+    char* data = disk_cache_map(&dobj);
+    if(data)
+    {
+        slice = newNode();
+        slice->data = malloc(dobj.size);
+        memcpy(slice->data, data, dobj.size);
+        slice->size = dobj.size;
+        slice->hdrlen = dobj.hdrlen;
+        count_cache_request(0, dobj.size);
+    }
+    disk_cache_close(&dobj);
+    return slice;
+}
+
+void store_slice(char* objname, long index, char* header, char* headers,
+                 int hdrlen, char* body, int len)
+{
+    struct cachenode* slice = newNode();
+    slice->objname = malloc(strlen(objname) + 32);
+    slice_name(slice->objname, objname, index);
+    slice->header = strdup(header);
+    slice->stored = time(NULL);
+    slice->size = hdrlen + len;
+    slice->hdrlen = hdrlen;
+    slice->data = malloc(slice->size);
+    memcpy(slice->data, headers, hdrlen);
+    memcpy((char*)slice->data + hdrlen, body, len);
+
+    char value[MAXLINE];
+    if(find_header(headers, hdrlen, "Cache-Control", value, MAXLINE))
+        sscanf(value, "max-age=%d", &slice->maxage);
+
+    debug_printf("Added slice %ld of '%s' to the cache\n", index, objname);
+    add_cache_object(slice);
+}
+
+struct cachenode* fetch_slice(struct sliceorigin* o, long index, long total)
+{
+    char buffer[MAXLINE];
+    long first = index * SLICE_SIZE;
+    long last = first + SLICE_SIZE - 1;
+    if(total >= 0 && last >= total)
+        last = total - 1;
+
+    struct rangerequest rr;
+    sprintf(rr.range, "bytes=%ld-%ld", first, last);
+    rr.ifrange[0] = '\0';
+
+    //a pooled connection may have been closed under us, in which case we
+    //get nothing back and try again on a new one
+    int attempt;
+    int n = 0;
+    for(attempt = 0; attempt < 2 && n <= 0; attempt++)
+    {
+        if(o->fd < 0)
+        {
+            //an HTTP/2 stream ends with its response, so it is never
+            //kept in o->fd from one slice to the next
+            if(attempt == 0 && o->h2)
+                o->fd = h2upstream_get(o->hostname, o->port, open_clientfd_r);
+            if(attempt == 0 && o->fd < 0)
+                o->fd = upstream_get(o->hostname, o->port);
+            if(o->fd < 0)
+            {
+                attempt = 1; //a new connection only gets the one try
+                if((o->fd = open_clientfd_r(o->hostname, o->port)) < 0)
+                {
+                    o->fd = -1;
+                    return NULL;
+                }
+                upstream_opened();
+            }
+            t_Rio_readinitb(&o->rio, o->fd);
+        }
+        if(make_request("GET", o->hostname, o->port, o->path, o->header,
+                        o->fd, 0, &rr) == 0)
+            n = read_status_line(&o->rio, buffer);
+        if(n <= 0)
+        {
+            close(o->fd);
+            o->fd = -1;
+        }
+    }
+    if(n <= 0)
+        return NULL;
+
+    //only a 206 for just the bytes we asked for will do
+    int minor = 0;
+    int status = 0;
+    sscanf(buffer, "HTTP/1.%d %d", &minor, &status);
+    int keepalive = (minor >= 1);
+    int framing = BODY_CLOSE;
+    long length = 0;
+    long rfirst = -1, rlast = -1, rtotal = -1;
+
+    //the slice's headers are the origin's, dressed up as a 200 for the
+    //whole body (kept off the stack, which is only a coroutine's)
+    char* headers = malloc(MAX_OBJECT_SIZE);
+    int hdrlen = sprintf(headers, "HTTP/1.1 200 OK\r\n");
+    while((n = rio_readlineb(&o->rio, buffer, MAXLINE)) > 0
+          && buffer[0] != '\r' && buffer[0] != '\n')
+    {
+        if(strncasecmp(buffer, "Content-Range:", 14) == 0)
+        {
+            sscanf(buffer + 14, " bytes %ld-%ld/%ld", &rfirst, &rlast,
+                   &rtotal);
+            continue;
+        }
+        if(strncasecmp(buffer, "Content-Length:", 15) == 0)
+        {
+            if(framing == BODY_CLOSE)
+            {
+                framing = BODY_LENGTH;
+                length = atol(buffer + 15);
+            }
+            continue;
+        }
+        if(strncasecmp(buffer, "Transfer-Encoding:", 18) == 0)
+        {
+            if(strcasestr(buffer, "chunked"))
+                framing = BODY_CHUNKED;
+            continue;
+        }
+        if(strncasecmp(buffer, "Connection:", 11) == 0)
+        {
+            if(strcasestr(buffer, "close"))
+                keepalive = 0;
+            continue;
+        }
+        if(strncasecmp(buffer, "Keep-Alive:", 11) == 0)
+            continue;
+        if(hdrlen + n + 64 < MAX_OBJECT_SIZE)
+        {
+            memcpy(headers + hdrlen, buffer, n);
+            hdrlen += n;
+        }
+    }
+    if(n <= 0 || status != 206 || rfirst != first || rlast < first
+       || rlast > last || rtotal <= rlast || (total >= 0 && rtotal != total))
+    {
+        debug_printf("No usable slice %ld of %s%s\n", index, o->hostname,
+                     o->path);
+        free(headers);
+        close(o->fd);
+        o->fd = -1;
+        return NULL;
+    }
+    hdrlen += sprintf(headers + hdrlen, "Content-Length: %ld\r\n"
+                                        "Connection: close\r\n\r\n",
+                      rtotal);
+
+    struct cachenode* slice = newNode();
+    int len = rlast - rfirst + 1;
+    slice->data = malloc(hdrlen + len);
+    memcpy(slice->data, headers, hdrlen);
+    free(headers);
+    slice->hdrlen = hdrlen;
+    slice->size = hdrlen + len;
+
+    struct bodyreader body;
+    body_reader_init(&body, &o->rio, framing, length);
+    char* p = (char*)slice->data + hdrlen;
+    int got = 0;
+    while(got < len && (n = body_read(&body, p + got, len - got)) > 0)
+        got += n;
+    //(and then there should be nothing more)
+    if(got != len || body_read(&body, buffer, MAXLINE) != 0)
+    {
+        free_node(slice);
+        close(o->fd);
+        o->fd = -1;
+        return NULL;
+    }
+    if(!keepalive || !body_complete(&body))
+    {
+        close(o->fd);
+        o->fd = -1;
+    }
+    return slice;
+}
+
+int serve_sliced(int connfd, char* objname, char* header,
+                 struct sliceorigin* o, struct rangerequest* rr,
+                 int* anyfetched)
+{
+    struct byterange ranges[MAX_RANGES];
+    int ranged = 0;
+    long index = 0;
+    if(rr->range[0])
+    {
+        //only single ranges are put together from slices; ranges from the
+        //end need the length before we know which slice to look in
+        if(parse_ranges(rr->range, LONG_MAX, ranges, MAX_RANGES) != 1
+           || strncmp(rr->range + 6, "-", 1) == 0)
+            return 0;
+        ranged = 1;
+        index = ranges[0].first / SLICE_SIZE;
+    }
+
+    //any slice of the object has the headers and the whole length. if we
+    //don't have the one we need, a range request can go and get it
+    struct cachenode* slice = find_slice(objname, index, header);
+    int fetched = 0;
+    if(!slice && ranged)
+    {
+        slice = fetch_slice(o, index, -1);
+        fetched = 1;
+        *anyfetched = 1;
+    }
+    if(!slice)
+        return 0;
+
+    long total = slice_total(slice);
+    if(total < 0)
+    {
+        free_node(slice);
+        return 0;
+    }
+    struct cachenode* known = slice; //slice number index, which we have
+    int knownfetched = fetched;
+    char* headers = malloc(slice->hdrlen + MAXLINE);
+    int hdrlen = slice->hdrlen;
+    memcpy(headers, slice->data, hdrlen);
+    long first = 0;
+    long last = total - 1;
+    int n = 1;
+    if(ranged && ifrange_matches(headers, hdrlen, rr))
+    {
+        n = parse_ranges(rr->range, total, ranges, MAX_RANGES);
+        if(n == 1)
+        {
+            first = ranges[0].first;
+            last = ranges[0].last;
+        }
+    }
+    else
+    {
+        ranged = 0;
+    }
+
+    //the response headers, for the whole body or for the range
+    char* out = malloc(hdrlen + MAXLINE);
+    int pos;
+    if(n == 0)
+    {
+        pos = sprintf(out, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                           "Content-Range: bytes */%ld\r\n"
+                           "Content-Length: 0\r\n"
+                           "Connection: close\r\n\r\n", total);
+    }
+    else if(ranged)
+    {
+        pos = partial_headers(out, headers, hdrlen, 0);
+        pos += sprintf(out + pos, "Content-Range: bytes %ld-%ld/%ld\r\n"
+                                  "Content-Length: %ld\r\n\r\n",
+                       first, last, total, last - first + 1);
+    }
+    else
+    {
+        memcpy(out, headers, hdrlen);
+        pos = hdrlen;
+    }
+    int ret = (rio_writen(connfd, out, pos) == pos) ? 1 : -1;
+    free(out);
+
+    //and the body, a slice at a time
+    long i;
+    for(i = first / SLICE_SIZE; n > 0 && ret > 0 && i <= last / SLICE_SIZE;
+        i++)
+    {
+        if(i == index)
+        {
+            slice = known;
+            fetched = knownfetched;
+            knownfetched = 0;
+        }
+        else
+        {
+            slice = find_slice(objname, i, header);
+            fetched = 0;
+            if(!slice)
+            {
+                slice = fetch_slice(o, i, total);
+                fetched = 1;
+                *anyfetched = 1;
+            }
+            if(!slice)
+            {
+                //the headers are gone already, so all we can do is cut the
+                //client off
+                ret = -1;
+                break;
+            }
+        }
+        long start = i * SLICE_SIZE;
+        long from = (first > start) ? first - start : 0;
+        long to = (last < start + SLICE_SIZE - 1) ? last - start
+                                                  : SLICE_SIZE - 1;
+        char* body = (char*)slice->data + slice->hdrlen;
+        if(to >= slice->size - slice->hdrlen
+           || rio_writen(connfd, body + from, to - from + 1) != to - from + 1)
+            ret = -1;
+        else
+            metrics_add(fetched ? METRIC_ORIGIN_BYTES : METRIC_CACHE_BYTES,
+                        to - from + 1);
+        if(fetched)
+        {
+            count_cache_request(0, slice->size);
+            store_slice(objname, i, header, slice->data, slice->hdrlen, body,
+                        slice->size - slice->hdrlen);
+        }
+        if(slice != known)
+            free_node(slice);
+    }
+    if(knownfetched)
+    {
+        //we went and got it, but it turned out not to be needed
+        store_slice(objname, index, header, known->data, known->hdrlen,
+                    (char*)known->data + known->hdrlen,
+                    known->size - known->hdrlen);
+    }
+    free_node(known);
+    free(headers);
+    return ret;
+}
+
+//clear the cache
+void clear_cache()
+{
+    debug_printf("Locking the cache for clear\n");
+    long long taken = metrics_wrlock(&cachelock, LOCK_CLEAR);
+    struct cachenode* n = thecache.head;
+    while(n)
+    {
+        struct cachenode* next = n->next;
+        free_node(n);
+        n = next;
+    }
+    thecache.head = NULL;
+    thecache.tail = NULL;
+    thecache.totalsize = 0;
+    thecache.policy->reset();
+    debug_printf("Unlocking the cache from clear\n");
+    metrics_rwunlock(&cachelock, LOCK_CLEAR, taken);
+
+    disk_cache_clear();
+}
+
+//new cachenode
+struct cachenode* newNode()
+{
+    struct cachenode* n = malloc(sizeof(struct cachenode));
+    n->objname=NULL;
+    n->size = 0;
+    n->hdrlen = 0;
+    n->encoding = ENCODING_IDENTITY;
+    n->header = NULL;
+    n->data = NULL;
+    n->stored = 0;
+    n->maxage = 0;
+    n->freq = 0;
+    n->priority = 0;
+    n->seq = 0;
+    n->heapindex = -1;
+    n->queue = 0;
+    n->qprev = NULL;
+    n->qnext = NULL;
+    return n;
+}
+//free node
+void free_node(struct cachenode* n)
+{
+    free(n->header);
+    free(n->objname);
+    free(n->data);
+    free(n);
+}
+
+//handler function to unlock the cache if a thread dies
+void unlock_cache_handler(void* ptr)
+{
+    pthread_rwlock_unlock((pthread_rwlock_t*)ptr);
+}
+
+/***********
+ ** Eviction policies
+ ***********/
+
+//LRU: hits move to the head, evict from the tail
+void lru_reset() {}
+void lru_inserted(struct cachenode* obj) { (void)obj; }
+void lru_touched(struct cachenode* obj)
+{
+    unlink_node(obj);
+    link_node(obj);
+}
+struct cachenode* lru_peek()
+{
+    return thecache.tail;
+}
+void lru_evicted(struct cachenode* obj) { (void)obj; }
+
+//GDSF (greedy dual size frequency): priority = L + frequency/size, evict
+//the lowest priority, and L creeps up to the priority of each victim so
+//that objects which stop being hit eventually age out. the objects are
+//kept in a min-heap on priority (ties going to the older object), so the
+//next victim is always at the top
+double gdsf_clock = 0;
+unsigned long gdsf_seq = 0;
+struct cachenode** gdsf_heap = NULL;
+int gdsf_count = 0;
+int gdsf_room = 0;
+
+int gdsf_before(struct cachenode* a, struct cachenode* b)
+{
+    if(a->priority != b->priority)
+        return a->priority < b->priority;
+    return a->seq < b->seq;
+}
+void gdsf_place(struct cachenode* obj, int i)
+{
+    gdsf_heap[i] = obj;
+    obj->heapindex = i;
+}
+//move the object at i up or down the heap to where it belongs now
+void gdsf_sift(int i)
+{
+    struct cachenode* obj = gdsf_heap[i];
+    while(i > 0 && gdsf_before(obj, gdsf_heap[(i - 1) / 2]))
+    {
+        gdsf_place(gdsf_heap[(i - 1) / 2], i);
+        i = (i - 1) / 2;
+    }
+    while(2 * i + 1 < gdsf_count)
+    {
+        int child = 2 * i + 1;
+        if(child + 1 < gdsf_count
+           && gdsf_before(gdsf_heap[child + 1], gdsf_heap[child]))
+            child++;
+        if(!gdsf_before(gdsf_heap[child], obj))
+            break;
+        gdsf_place(gdsf_heap[child], i);
+        i = child;
+    }
+    gdsf_place(obj, i);
+}
+void gdsf_push(struct cachenode* obj)
+{
+    if(gdsf_count == gdsf_room)
+    {
+        gdsf_room = gdsf_room ? gdsf_room * 2 : 1024;
+        gdsf_heap = realloc(gdsf_heap, gdsf_room * sizeof(struct cachenode*));
+    }
+    obj->seq = gdsf_seq++;
+    gdsf_place(obj, gdsf_count++);
+    gdsf_sift(obj->heapindex);
+}
+
+void gdsf_prioritize(struct cachenode* obj)
+{
+    obj->priority = gdsf_clock + (double)obj->freq / (obj->size ? obj->size : 1);
+}
+void gdsf_reset()
+{
+    gdsf_clock = 0;
+    gdsf_count = 0;
+    struct cachenode* obj;
+    //from the tail, so the older objects come first
+    for(obj = thecache.tail; obj; obj = obj->prev)
+    {
+        obj->freq = 1;
+        gdsf_prioritize(obj);
+        gdsf_push(obj);
+    }
+}
+void gdsf_inserted(struct cachenode* obj)
+{
+    obj->freq = 1;
+    gdsf_prioritize(obj);
+    gdsf_push(obj);
+}
+void gdsf_touched(struct cachenode* obj)
+{
+    obj->freq++;
+    gdsf_prioritize(obj);
+    gdsf_sift(obj->heapindex);
+}
+struct cachenode* gdsf_peek()
+{
+    return gdsf_count > 0 ? gdsf_heap[0] : NULL;
+}
+void gdsf_evicted(struct cachenode* obj)
+{
+    gdsf_clock = obj->priority;
+    int i = obj->heapindex;
+    obj->heapindex = -1;
+    if(--gdsf_count == i)
+        return;
+    gdsf_place(gdsf_heap[gdsf_count], i);
+    gdsf_sift(i);
+}
+
+//S3-FIFO: new objects go into a small FIFO (10% of the cache). Objects hit
+//while in it graduate to the main FIFO, the rest are evicted quickly and
+//remembered in a ghost queue, so that if they come back they go straight
+//into main. Main is a FIFO with reinsertion: an object that was hit gets
+//another trip round instead of being evicted. Hits only bump a counter.
+//each queue is a list of its own (through qprev/qnext, newest at the
+//head), and the ghost queue is a ring of hashes with a hashed set of them
+//alongside to look them up in
+#define S3_SMALL_SIZE (max_cache_size/10)
+#define S3_GHOST_ENTRIES 4096
+#define S3_GHOST_SLOTS (2*S3_GHOST_ENTRIES) /* a power of 2 */
+#define S3_MAX_FREQ 3
+#define S3_SMALL 0
+#define S3_MAIN 1
+
+struct s3_queue
+{
+    struct cachenode* head;
+    struct cachenode* tail;
+};
+struct s3_queue s3_queues[2];
+int s3_smallsize = 0;
+uint64_t s3_ghost[S3_GHOST_ENTRIES];
+int s3_ghostpos = 0;
+//the hashes in the ring, each with how many times it's there (0 is free)
+struct s3_ghostslot
+{
+    uint64_t hash;
+    int count;
+};
+struct s3_ghostslot s3_ghostset[S3_GHOST_SLOTS];
+
+//what's remembered of an object (never 0, which is an empty place)
+uint64_t s3_ghosthash(struct cachenode* obj)
+{
+    uint64_t hash = objname_hash(obj->objname);
+    return hash ? hash : 1;
+}
+//the set's slot for a hash: where it is, or the free one it would go in
+int s3_ghostslot(uint64_t hash)
+{
+    int i = hash & (S3_GHOST_SLOTS - 1);
+    while(s3_ghostset[i].count && s3_ghostset[i].hash != hash)
+        i = (i + 1) & (S3_GHOST_SLOTS - 1);
+    return i;
+}
+int s3_ghosted(uint64_t hash)
+{
+    return s3_ghostset[s3_ghostslot(hash)].count > 0;
+}
+void s3_ghost_forget(uint64_t hash)
+{
+    int i = s3_ghostslot(hash);
+    if(!s3_ghostset[i].count || --s3_ghostset[i].count)
+        return;
+    //linear probing: move up whatever later in the run would otherwise
+    //not be found any more past the hole
+    int j = i;
+    while(1)
+    {
+        j = (j + 1) & (S3_GHOST_SLOTS - 1);
+        if(!s3_ghostset[j].count)
+            break;
+        int home = s3_ghostset[j].hash & (S3_GHOST_SLOTS - 1);
+        if(((j - home) & (S3_GHOST_SLOTS - 1))
+           >= ((j - i) & (S3_GHOST_SLOTS - 1)))
+        {
+            s3_ghostset[i] = s3_ghostset[j];
+            s3_ghostset[j].count = 0;
+            i = j;
+        }
+    }
+}
+void s3_ghost_add(uint64_t hash)
+{
+    //(the entry it pushes out of the ring leaves the set too)
+    if(s3_ghost[s3_ghostpos])
+        s3_ghost_forget(s3_ghost[s3_ghostpos]);
+    s3_ghost[s3_ghostpos] = hash;
+    s3_ghostpos = (s3_ghostpos + 1) % S3_GHOST_ENTRIES;
+    int i = s3_ghostslot(hash);
+    s3_ghostset[i].hash = hash;
+    s3_ghostset[i].count++;
+}
+
+//link an object in at the head of its queue
+void s3_link(struct cachenode* obj)
+{
+    struct s3_queue* q = &s3_queues[obj->queue];
+    obj->qprev = NULL;
+    obj->qnext = q->head;
+    if(q->head)
+        q->head->qprev = obj;
+    q->head = obj;
+    if(!q->tail)
+        q->tail = obj;
+}
+void s3_unlink(struct cachenode* obj)
+{
+    struct s3_queue* q = &s3_queues[obj->queue];
+    if(obj->qprev)
+        obj->qprev->qnext = obj->qnext;
+    else
+        q->head = obj->qnext;
+    if(obj->qnext)
+        obj->qnext->qprev = obj->qprev;
+    else
+        q->tail = obj->qprev;
+    obj->qprev = NULL;
+    obj->qnext = NULL;
+}
+//oldest object in one of the queues
+struct cachenode* s3_oldest(int queue)
+{
+    return s3_queues[queue].tail;
+}
+void s3_reset()
+{
+    //everything already cached has earned its place in main
+    memset(s3_queues, 0, sizeof(s3_queues));
+    struct cachenode* obj;
+    for(obj = thecache.tail; obj; obj = obj->prev)
+    {
+        obj->queue = S3_MAIN;
+        obj->freq = 0;
+        s3_link(obj);
+    }
+    s3_smallsize = 0;
+    memset(s3_ghost, 0, sizeof(s3_ghost));
+    memset(s3_ghostset, 0, sizeof(s3_ghostset));
+    s3_ghostpos = 0;
+}
+void s3_inserted(struct cachenode* obj)
+{
+    obj->freq = 0;
+    if(s3_ghosted(s3_ghosthash(obj)))
+    {
+        obj->queue = S3_MAIN;
+    }
+    else
+    {
+        obj->queue = S3_SMALL;
+        s3_smallsize += obj->size;
+    }
+    s3_link(obj);
+}
+void s3_touched(struct cachenode* obj)
+{
+    int freq = __atomic_load_n(&obj->freq, __ATOMIC_RELAXED);
+    while(freq < S3_MAX_FREQ
+          && !__atomic_compare_exchange_n(&obj->freq, &freq, freq+1, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+struct cachenode* s3_peek()
+{
+    struct cachenode* small = s3_oldest(S3_SMALL);
+    struct cachenode* main = s3_oldest(S3_MAIN);
+    if(small && (s3_smallsize > S3_SMALL_SIZE || !main))
+        return small;
+    return main;
+}
+struct cachenode* s3_victim()
+{
+    while(1)
+    {
+        struct cachenode* small = s3_oldest(S3_SMALL);
+        struct cachenode* main = s3_oldest(S3_MAIN);
+        if(small && (s3_smallsize > S3_SMALL_SIZE || !main))
+        {
+            if(small->freq == 0)
+                return small;
+            //hit while on probation: move it over to main
+            s3_unlink(small);
+            small->queue = S3_MAIN;
+            small->freq = 0;
+            s3_smallsize -= small->size;
+            s3_link(small);
+            unlink_node(small);
+            link_node(small);
+            continue;
+        }
+        if(!main)
+            return NULL;
+        if(main->freq == 0)
+            return main;
+        //hit since it was last considered: go round again
+        main->freq--;
+        s3_unlink(main);
+        s3_link(main);
+        unlink_node(main);
+        link_node(main);
+    }
+}
+void s3_evicted(struct cachenode* obj)
+{
+    s3_unlink(obj);
+    if(obj->queue == S3_SMALL)
+    {
+        s3_smallsize -= obj->size;
+        s3_ghost_add(s3_ghosthash(obj));
     }
-    debug_printf("Unlocking the cache from search\n");
-    pthread_rwlock_unlock(&cachelock);
-    return NULL;
 }
 
+struct evict_policy policies[NPOLICIES] = {
+    { "LRU", "/set/policy/lru", 0,
+      lru_reset, lru_inserted, lru_touched, lru_peek, lru_peek, lru_evicted },
+    { "GDSF", "/set/policy/gdsf", 0,
+      gdsf_reset, gdsf_inserted, gdsf_touched, gdsf_peek, gdsf_peek,
+      gdsf_evicted },
+    { "S3-FIFO", "/set/policy/s3fifo", 1,
+      s3_reset, s3_inserted, s3_touched, s3_peek, s3_victim, s3_evicted },
+};
 
-//clear the cache
-void clear_cache()
+void set_eviction_policy(int which)
 {
-    debug_printf("Locking the cache for clear\n");
-    pthread_rwlock_wrlock(&cachelock);
-    struct cachenode* n = thecache.head;
-    while(n)
+    debug_printf("Locking the cache to switch eviction policy\n");
+    long long taken = metrics_wrlock(&cachelock, LOCK_POLICY);
+    thecache.policy = &policies[which];
+    thecache.policy->reset();
+    metrics_rwunlock(&cachelock, LOCK_POLICY, taken);
+}
+
+void count_cache_request(int hit, long bytes)
+{
+    //the policy pointer only changes under the write lock, but this gets
+    //called from outside the lock too, so just take whatever it is now
+    struct evict_policy* policy = __atomic_load_n(&thecache.policy,
+                                                  __ATOMIC_RELAXED);
+    struct policy_stats* st = &policystats[policy - policies];
+    __atomic_add_fetch(&st->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->bytes, bytes, __ATOMIC_RELAXED);
+    if(hit)
     {
-        struct cachenode* next = n->next;
-        free_node(n);
-        n = next;
+        __atomic_add_fetch(&st->hits, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->hitbytes, bytes, __ATOMIC_RELAXED);
     }
-    thecache.head = NULL;
-    thecache.tail = NULL;
-    thecache.totalsize = 0;
-    debug_printf("Unlocking the cache from clear\n");
-    pthread_rwlock_unlock(&cachelock);
 }
 
-//new cachenode
-struct cachenode* newNode()
+/***********
+ ** Cache snapshots
+ **  A snapshot is a header followed by one record per object, oldest first:
+ **      struct snaprecord | objname | header | data
+ **  so that re-adding them in order rebuilds the same LRU list.
+ ***********/
+#define SNAPSHOT_MAGIC "PXSNAP02"
+
+struct snapheader
 {
-    struct cachenode* n = malloc(sizeof(struct cachenode));
-    n->objname=NULL;
-    n->size = 0;
-    n->header = NULL;
-    n->data = NULL;
-    return n;
-}
-//free node
-void free_node(struct cachenode* n)
+    char magic[8];
+    uint32_t count;
+};
+
+struct snaprecord
 {
-    free(n->header);
-    free(n->objname);
-    free(n->data);
-    free(n);
+    uint32_t namelen;
+    uint32_t headerlen;
+    uint32_t datalen;
+    uint32_t hdrlen;
+    uint32_t encoding;
+    int32_t maxage;
+    int64_t stored;
+};
+
+int save_cache_snapshot(const char* path)
+{
+    //write to a temporary file and rename it over the old snapshot, so a
+    //crash halfway through never leaves a torn snapshot behind. the
+    //temporary file is one of our own, since two snapshots can be taken at
+    //once (the configurator's and the one on the way down)
+    char temppath[MAXLINE];
+    snprintf(temppath, MAXLINE, "%s.XXXXXX", path);
+    int fd = mkstemp(temppath);
+    FILE* f = (fd < 0) ? NULL : fdopen(fd, "w");
+    if(!f)
+    {
+        printf("Couldn't write snapshot %s: %s\n", temppath, strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+            unlink(temppath);
+        }
+        return -1;
+    }
+    fchmod(fd, 0644);
+
+    struct snapheader sh;
+    memcpy(sh.magic, SNAPSHOT_MAGIC, sizeof(sh.magic));
+    sh.count = 0;
+    fwrite(&sh, sizeof(sh), 1, f);
+
+    debug_printf("Read-locking the cache to snapshot it\n");
+    long long taken = metrics_rdlock(&cachelock, LOCK_SNAPSHOT);
+    struct cachenode* node = thecache.tail;
+    while(node)
+    {
+        char* header = node->header ? node->header : "";
+        struct snaprecord rec;
+        rec.namelen = strlen(node->objname);
+        rec.headerlen = strlen(header);
+        rec.datalen = node->size;
+        rec.hdrlen = node->hdrlen;
+        rec.encoding = node->encoding;
+        rec.maxage = node->maxage;
+        rec.stored = node->stored;
+        fwrite(&rec, sizeof(rec), 1, f);
+        fwrite(node->objname, 1, rec.namelen, f);
+        fwrite(header, 1, rec.headerlen, f);
+        fwrite(node->data, 1, rec.datalen, f);
+        sh.count++;
+        node = node->prev;
+    }
+    metrics_rwunlock(&cachelock, LOCK_SNAPSHOT, taken);
+    debug_printf("Unlocked the cache from snapshot\n");
+
+    //now that we know how many there are, fill in the count
+    fseek(f, 0, SEEK_SET);
+    fwrite(&sh, sizeof(sh), 1, f);
+    if(ferror(f) | fclose(f))
+    {
+        printf("Couldn't write snapshot %s\n", temppath);
+        unlink(temppath);
+        return -1;
+    }
+    if(rename(temppath, path) < 0)
+    {
+        printf("Couldn't replace snapshot %s: %s\n", path, strerror(errno));
+        unlink(temppath);
+        return -1;
+    }
+    return sh.count;
 }
 
-//handler function to unlock the cache if a thread dies
-void unlock_cache_handler(void* ptr)
+int load_cache_snapshot(const char* path)
 {
-    pthread_rwlock_unlock((pthread_rwlock_t*)ptr);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        //no snapshot yet is fine, it's a cold start
+        return -1;
+    }
+    struct stat sb;
+    if(fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(struct snapheader))
+    {
+        close(fd);
+        return -1;
+    }
+    size_t len = sb.st_size;
+    char* base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return -1;
+
+    struct snapheader* sh = (struct snapheader*)base;
+    if(memcmp(sh->magic, SNAPSHOT_MAGIC, sizeof(sh->magic)) != 0)
+    {
+        printf("%s is not a cache snapshot\n", path);
+        munmap(base, len);
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    int loaded = 0;
+    size_t pos = sizeof(struct snapheader);
+    uint32_t i;
+    for(i = 0; i < sh->count; i++)
+    {
+        struct snaprecord rec;
+        if(pos + sizeof(rec) > len)
+            break;
+        memcpy(&rec, base + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if(pos + rec.namelen + rec.headerlen + rec.datalen > len)
+            break; //truncated
+        char* name = base + pos;
+        char* header = name + rec.namelen;
+        char* data = header + rec.headerlen;
+        pos += rec.namelen + rec.headerlen + rec.datalen;
+
+        //a record that doesn't make sense (from a corrupt snapshot, or an
+        //encoding this build doesn't have) is skipped, as the disk tier
+        //skips its bad records
+        if(rec.hdrlen > rec.datalen
+           || (rec.encoding != ENCODING_IDENTITY
+               && rec.encoding != ENCODING_GZIP
+               && rec.encoding != ENCODING_BR))
+        {
+            printf("Skipping a bad record in the cache snapshot\n");
+            continue;
+        }
+
+        //don't bring back anything that went stale while we were down
+        if(rec.maxage > 0 && rec.stored + rec.maxage < now)
+            continue;
+
+        struct cachenode* obj = newNode();
+        obj->objname = strndup(name, rec.namelen);
+        obj->header = strndup(header, rec.headerlen);
+        obj->data = malloc(rec.datalen);
+        memcpy(obj->data, data, rec.datalen);
+        obj->size = rec.datalen;
+        obj->hdrlen = rec.hdrlen;
+        obj->encoding = rec.encoding;
+        obj->maxage = rec.maxage;
+        obj->stored = rec.stored;
+        add_cache_object(obj);
+        loaded++;
+    }
+    munmap(base, len);
+    return loaded;
 }
 
 /*************
@@ -750,13 +3437,9 @@ void unlock_cache_handler(void* ptr)
 //returns whether or not caching is enabled
 int handle_features(char* hostname, char* path, int* port)
 {
-    struct features_t features;
-
-    pthread_mutex_lock(&features_mutex);
-    memcpy(&features, &ft_config, sizeof(struct features_t));
-    pthread_mutex_unlock(&features_mutex);
+    struct features_t* features = features_get();
 
-    if(features.nope)
+    if(features->nope)
     {
         printf("Lol, nope.\n");
         sprintf(hostname, "farm6.staticflickr.com");
@@ -764,7 +3447,7 @@ int handle_features(char* hostname, char* path, int* port)
         path[n]='\0'; //null-terminate ALL THE THINGS
         *port=80;
     }
-    if(features.rickroll)
+    if(features->rickroll)
     {
         //redirect any youtube link to rickroll
         if( ((strcmp(hostname, "youtube.com") == 0)
@@ -775,7 +3458,7 @@ int handle_features(char* hostname, char* path, int* port)
             path[n]='\0'; //null-terminate ALL THE THINGS
         }
     }
-    return features.cache;
+    return features->cache;
 }
 void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
 {
@@ -791,9 +3474,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
     {
         printf("Setting nope mode\n");
         //set nope
-        pthread_mutex_lock(&features_mutex);
-        ft_config.nope = 1;
-        pthread_mutex_unlock(&features_mutex);
+        set_feature(offsetof(struct features_t, nope), 1);
 
         //and return to the status page
         char header[] = "HTTP/1.0 302 Found\r\n"
@@ -804,9 +3485,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
     {
         printf("Unsetting nope mode\n");
         //clear nope
-        pthread_mutex_lock(&features_mutex);
-        ft_config.nope = 0;
-        pthread_mutex_unlock(&features_mutex);
+        set_feature(offsetof(struct features_t, nope), 0);
 
         //and return to the status page
         char header[] = "HTTP/1.0 302 Found\r\n"
@@ -817,9 +3496,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
     {
         printf("Setting rickroll mode\n");
         //set rickroll
-        pthread_mutex_lock(&features_mutex);
-        ft_config.rickroll = 1;
-        pthread_mutex_unlock(&features_mutex);
+        set_feature(offsetof(struct features_t, rickroll), 1);
 
         //and return to the status page
         char header[] = "HTTP/1.0 302 Found\r\n"
@@ -830,9 +3507,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
     {
         printf("Unsetting rickroll mode\n");
         //clear rickroll
-        pthread_mutex_lock(&features_mutex);
-        ft_config.rickroll = 0;
-        pthread_mutex_unlock(&features_mutex);
+        set_feature(offsetof(struct features_t, rickroll), 0);
 
         //and return to the status page
         char header[] = "HTTP/1.0 302 Found\r\n"
@@ -843,9 +3518,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
     {
         printf("Setting dumb cache\n");
         //set cache
-        pthread_mutex_lock(&features_mutex);
-        ft_config.cache = 1;
-        pthread_mutex_unlock(&features_mutex);
+        set_feature(offsetof(struct features_t, cache), 1);
 
         //and return to the status page
         char header[] = "HTTP/1.0 302 Found\r\n"
@@ -856,9 +3529,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
     {
         printf("Setting smart cache\n");
         //set cache
-        pthread_mutex_lock(&features_mutex);
-        ft_config.cache = 2;
-        pthread_mutex_unlock(&features_mutex);
+        set_feature(offsetof(struct features_t, cache), 2);
 
         //and return to the status page
         char header[] = "HTTP/1.0 302 Found\r\n"
@@ -869,9 +3540,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
     {
         printf("Setting cache off\n");
         //clear cache mode
-        pthread_mutex_lock(&features_mutex);
-        ft_config.cache = 0;
-        pthread_mutex_unlock(&features_mutex);
+        set_feature(offsetof(struct features_t, cache), 0);
 
         clear_cache();
 
@@ -880,6 +3549,120 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
                           "Location: /\r\n\r\n";
         t_Rio_writen(connfd, header, strlen(header));
     }
+    else if(strncmp(path, "/set/admission/on", 17)==0)
+    {
+        printf("Setting admission filter on\n");
+        set_feature(offsetof(struct features_t, admission), 1);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/admission/off", 18)==0)
+    {
+        printf("Setting admission filter off\n");
+        set_feature(offsetof(struct features_t, admission), 0);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/compress/on", 16)==0)
+    {
+        printf("Setting compressed storage on\n");
+        set_feature(offsetof(struct features_t, compress), 1);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/compress/off", 17)==0)
+    {
+        printf("Setting compressed storage off\n");
+        set_feature(offsetof(struct features_t, compress), 0);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/encode/on", 14)==0)
+    {
+        printf("Setting client compression on\n");
+        set_feature(offsetof(struct features_t, encode), 1);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/encode/off", 15)==0)
+    {
+        printf("Setting client compression off\n");
+        set_feature(offsetof(struct features_t, encode), 0);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/h2origin/on", 16)==0)
+    {
+        printf("Setting HTTP/2 to origins on\n");
+        set_feature(offsetof(struct features_t, h2origin), 1);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/h2origin/off", 17)==0)
+    {
+        printf("Setting HTTP/2 to origins off\n");
+        set_feature(offsetof(struct features_t, h2origin), 0);
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/set/policy/", 12)==0)
+    {
+        int i;
+        for(i = 0; i < NPOLICIES; i++)
+        {
+            if(strcmp(path, policies[i].setpath) == 0)
+            {
+                printf("Setting %s eviction\n", policies[i].name);
+                set_eviction_policy(i);
+            }
+        }
+
+        //and return to the diagnostics page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /info\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
+    else if(strncmp(path, "/snapshot", 9)==0)
+    {
+        printf("Saving cache snapshot\n");
+        if(snapshot_path)
+        {
+            save_cache_snapshot(snapshot_path);
+        }
+        else
+        {
+            printf("No snapshot file (start the proxy with -s)\n");
+        }
+
+        //and return to the status page
+        char header[] = "HTTP/1.0 302 Found\r\n"
+                          "Location: /info\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+    }
     else if(strncmp(path, "/clearcache", 11)==0)
     {
         printf("Clearing cache\n");
@@ -891,6 +3674,142 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
                           "Location: /info\r\n\r\n";
         t_Rio_writen(connfd, header, strlen(header));
     }
+    else if(strncmp(path, "/metrics", 8)==0)
+    {
+        //for Prometheus to scrape. none of this takes the cache lock
+        char header[] = "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+        t_Rio_writen(connfd, header, strlen(header));
+
+        unsigned long m[NMETRICS];
+        metrics_read(m);
+        int active, waiting, longlived;
+        unsigned long queued, shed, limited, failed;
+        overload_stats(&active, &waiting, &longlived, &queued, &shed, &limited,
+                       &failed);
+        char data[MAXLINE*2];
+        int n = sprintf(data,
+            "# HELP proxy_requests_total Requests for http URLs.\n"
+            "# TYPE proxy_requests_total counter\n"
+            "proxy_requests_total %lu\n"
+            "# HELP proxy_cache_requests_total Requests by what the cache "
+            "did for them.\n"
+            "# TYPE proxy_cache_requests_total counter\n"
+            "proxy_cache_requests_total{result=\"hit\"} %lu\n"
+            "proxy_cache_requests_total{result=\"miss\"} %lu\n"
+            "proxy_cache_requests_total{result=\"bypass\"} %lu\n"
+            "# HELP proxy_body_bytes_total Response body bytes sent to "
+            "clients, by where they came from.\n"
+            "# TYPE proxy_body_bytes_total counter\n"
+            "proxy_body_bytes_total{source=\"cache\"} %lu\n"
+            "proxy_body_bytes_total{source=\"origin\"} %lu\n"
+            "# HELP proxy_upstream_connect_seconds Time taken to connect "
+            "to origins.\n"
+            "# TYPE proxy_upstream_connect_seconds summary\n"
+            "proxy_upstream_connect_seconds_sum %.6f\n"
+            "proxy_upstream_connect_seconds_count %lu\n"
+            "# HELP proxy_cache_evictions_total Objects evicted from the "
+            "memory cache.\n"
+            "# TYPE proxy_cache_evictions_total counter\n"
+            "proxy_cache_evictions_total %lu\n"
+            "# HELP proxy_cache_bytes Bytes in the memory cache.\n"
+            "# TYPE proxy_cache_bytes gauge\n"
+            "proxy_cache_bytes %d\n"
+            "# HELP proxy_active_connections Connections being handled.\n"
+            "# TYPE proxy_active_connections gauge\n"
+            "proxy_active_connections %d\n"
+            "# HELP proxy_long_lived_connections Tunnels and HTTP/2 sessions "
+            "being handled (not counted as active).\n"
+            "# TYPE proxy_long_lived_connections gauge\n"
+            "proxy_long_lived_connections %d\n"
+            "# HELP proxy_waiting_connections Connections waiting for "
+            "their turn.\n"
+            "# TYPE proxy_waiting_connections gauge\n"
+            "proxy_waiting_connections %d\n"
+            "# HELP proxy_refused_connections_total Connections turned "
+            "away, by why.\n"
+            "# TYPE proxy_refused_connections_total counter\n"
+            "proxy_refused_connections_total{reason=\"busy\"} %lu\n"
+            "proxy_refused_connections_total{reason=\"client_limit\"} %lu\n"
+            "proxy_refused_connections_total{reason=\"no_thread\"} %lu\n",
+            m[METRIC_REQUESTS], m[METRIC_HITS], m[METRIC_MISSES],
+            m[METRIC_BYPASSES], m[METRIC_CACHE_BYTES], m[METRIC_ORIGIN_BYTES],
+            m[METRIC_CONNECT_USEC] / 1e6, m[METRIC_CONNECTS],
+            m[METRIC_EVICTIONS],
+            __atomic_load_n(&thecache.totalsize, __ATOMIC_RELAXED),
+            active, longlived, waiting, shed, limited, failed);
+        t_Rio_writen(connfd, data, n);
+
+        int h2open;
+        unsigned long h2opened, h2sent;
+        h2upstream_stats(&h2open, &h2opened, &h2sent);
+        n = sprintf(data,
+            "# HELP proxy_h2_origin_requests_total Requests sent to origins "
+            "as HTTP/2 streams.\n"
+            "# TYPE proxy_h2_origin_requests_total counter\n"
+            "proxy_h2_origin_requests_total %lu\n"
+            "# HELP proxy_h2_origin_connections_total HTTP/2 connections "
+            "opened to origins.\n"
+            "# TYPE proxy_h2_origin_connections_total counter\n"
+            "proxy_h2_origin_connections_total %lu\n",
+            h2sent, h2opened);
+        t_Rio_writen(connfd, data, n);
+
+        n = sprintf(data,
+            "# HELP proxy_stage_seconds Time taken by each stage of a "
+            "request.\n"
+            "# TYPE proxy_stage_seconds summary\n");
+        t_Rio_writen(connfd, data, n);
+        double q[3] = {0.5, 0.99, 0.999};
+        long long v[3];
+        int i, j;
+        for(i = 0; i < NSTAGES; i++)
+        {
+            unsigned long count = metrics_quantiles(i, 3, q, v);
+            n = 0;
+            for(j = 0; j < 3; j++)
+                n += sprintf(data + n, "proxy_stage_seconds{stage=\"%s\","
+                                       "quantile=\"%g\"} %.6f\n",
+                             stage_names[i], q[j], v[j] / 1e6);
+            n += sprintf(data + n, "proxy_stage_seconds_count{stage=\"%s\"} "
+                                   "%lu\n", stage_names[i], count);
+            t_Rio_writen(connfd, data, n);
+        }
+
+        struct lockstats ls[NLOCKSITES];
+        for(i = 0; i < NLOCKSITES; i++)
+            metrics_locks(i, &ls[i]);
+        n = sprintf(data,
+            "# HELP proxy_lock_acquisitions_total Times each lock site took "
+            "its lock, by whether it had to wait.\n"
+            "# TYPE proxy_lock_acquisitions_total counter\n");
+        for(i = 0; i < NLOCKSITES; i++)
+            n += sprintf(data + n,
+                "proxy_lock_acquisitions_total{site=\"%s\",contended=\"no\"} "
+                "%lu\n"
+                "proxy_lock_acquisitions_total{site=\"%s\",contended=\"yes\"} "
+                "%lu\n",
+                lock_names[i], ls[i].taken - ls[i].contended,
+                lock_names[i], ls[i].contended);
+        t_Rio_writen(connfd, data, n);
+        n = sprintf(data,
+            "# HELP proxy_lock_wait_seconds_total Time spent waiting for "
+            "locks.\n"
+            "# TYPE proxy_lock_wait_seconds_total counter\n");
+        for(i = 0; i < NLOCKSITES; i++)
+            n += sprintf(data + n,
+                "proxy_lock_wait_seconds_total{site=\"%s\"} %.6f\n",
+                lock_names[i], ls[i].waitusec / 1e6);
+        t_Rio_writen(connfd, data, n);
+        n = sprintf(data,
+            "# HELP proxy_lock_hold_seconds_total Time locks were held.\n"
+            "# TYPE proxy_lock_hold_seconds_total counter\n");
+        for(i = 0; i < NLOCKSITES; i++)
+            n += sprintf(data + n,
+                "proxy_lock_hold_seconds_total{site=\"%s\"} %.6f\n",
+                lock_names[i], ls[i].holdusec / 1e6);
+        t_Rio_writen(connfd, data, n);
+    }
     else if(strncmp(path, "/info", 5)==0)
     {
         char header[] = "HTTP/1.0 200 OK\r\n"
@@ -905,9 +3824,9 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
         int n = 0;
         
         //let's read the cache
-        pthread_rwlock_rdlock(&cachelock);
+        long long taken = metrics_rdlock(&cachelock, LOCK_INFO);
         double percentfull = ((double)thecache.totalsize*100.0);
-        percentfull /= (double)MAX_CACHE_SIZE;
+        percentfull /= (double)max_cache_size;
 
         n = sprintf(data,
                       "<div "
@@ -916,12 +3835,183 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
                       "style='width:%dpx;background-color:red;height:30px;'>"
                       "</div></div>"
                       "Total cache size is <b>%u bytes (%.2f%%)</b>"
+                      "<br />Admission filter turned away <b>%d objects</b>"
                       "<style>"
                       "table{table-layout: fixed;}"
                       "td{width: 45%%;}"
                       "</style>", 
-                      2*(int)percentfull, thecache.totalsize, percentfull);
+                      2*(int)percentfull, thecache.totalsize, percentfull,
+                      thecache.rejected);
+        t_Rio_writen(connfd, data, n);
+
+        if(disk_cache_enabled())
+        {
+            int diskobjects, disksegments;
+            long diskbytes;
+            disk_cache_stats(&diskobjects, &diskbytes, &disksegments);
+            n = sprintf(data,
+                          "<br />Disk cache holds <b>%d objects</b> "
+                          "in <b>%ld bytes</b> (%d segments)",
+                          diskobjects, diskbytes, disksegments);
+            t_Rio_writen(connfd, data, n);
+        }
+
+        int idle;
+        unsigned long opened, reused;
+        upstream_stats(&idle, &opened, &reused);
+        n = sprintf(data,
+                      "<br />Opened <b>%lu server connections</b>, "
+                      "reused <b>%lu</b> (%d idle)",
+                      opened, reused, idle);
+        t_Rio_writen(connfd, data, n);
+
+        unsigned long tunnels;
+        unsigned long long tunnelbytes;
+        relay_stats(&tunnels, &tunnelbytes);
+        n = sprintf(data,
+                      "<br />Relayed <b>%llu bytes</b> through "
+                      "<b>%lu tunnels</b>",
+                      tunnelbytes, tunnels);
+        t_Rio_writen(connfd, data, n);
+
+        unsigned long h2conns, h2streams;
+        h2_stats(&h2conns, &h2streams);
+        n = sprintf(data,
+                      "<br />Served <b>%lu HTTP/2 streams</b> over "
+                      "<b>%lu connections</b>",
+                      h2streams, h2conns);
+        t_Rio_writen(connfd, data, n);
+
+        int h2open;
+        unsigned long h2opened, h2sent;
+        h2upstream_stats(&h2open, &h2opened, &h2sent);
+        n = sprintf(data,
+                      "<br />Sent <b>%lu requests</b> over <b>%lu HTTP/2 "
+                      "origin connections</b> (%d open)",
+                      h2sent, h2opened, h2open);
+        t_Rio_writen(connfd, data, n);
+
+        unsigned long uaccepted, ucompletions, uenters;
+        uring_stats(&uaccepted, &ucompletions, &uenters);
+        if(ucompletions > 0)
+        {
+            n = sprintf(data,
+                          "<br />Accepted <b>%lu connections</b> through "
+                          "io_uring, with <b>%lu completions</b> (the "
+                          "coroutines' reads and writes included) in "
+                          "<b>%lu system calls</b>",
+                          uaccepted, ucompletions, uenters);
+            t_Rio_writen(connfd, data, n);
+        }
+
+        unsigned long cspawned, cswitches, cdetached;
+        coro_stats(&cspawned, &cswitches, &cdetached);
+        if(cspawned > 0)
+        {
+            n = sprintf(data,
+                          "<br />Ran <b>%lu connections</b> as coroutines, "
+                          "with <b>%lu switches</b> (%lu moved to threads)",
+                          cspawned, cswitches, cdetached);
+            t_Rio_writen(connfd, data, n);
+        }
+
+        unsigned long spaused, sstalled;
+        spool_stats(&spaused, &sstalled);
+        n = sprintf(data,
+                      "<br />Held off reading origins <b>%lu times</b> for "
+                      "slow clients, and gave up on <b>%lu</b> that stalled",
+                      spaused, sstalled);
+        t_Rio_writen(connfd, data, n);
+
+        int oactive, owaiting, olong;
+        unsigned long oqueued, oshed, olimited, ofailed;
+        overload_stats(&oactive, &owaiting, &olong, &oqueued, &oshed,
+                       &olimited, &ofailed);
+        n = sprintf(data,
+                      "<br />Handling <b>%d connections</b> (and <b>%d</b> "
+                      "tunnels and HTTP/2 sessions) with <b>%d</b> "
+                      "waiting; <b>%lu</b> have had to wait, <b>%lu</b> "
+                      "were turned away busy, <b>%lu</b> over their "
+                      "client's limit, and <b>%lu</b> couldn't be started",
+                      oactive, olong, owaiting, oqueued, oshed, olimited,
+                      ofailed);
+        t_Rio_writen(connfd, data, n);
+
+        unsigned long wtasks, wstolen, winlined;
+        workpool_stats(&wtasks, &wstolen, &winlined);
+        if(wtasks + winlined > 0)
+        {
+            n = sprintf(data,
+                          "<br />Handed <b>%lu compression jobs</b> to the "
+                          "work pool (%lu stolen), ran <b>%lu</b> in place",
+                          wtasks, wstolen, winlined);
+            t_Rio_writen(connfd, data, n);
+        }
+
+        //how each eviction policy has done while it was in charge
+        n = sprintf(data, "<br /><br /><table>"
+                          "<tr><th>Eviction Policy</th><th>Requests</th>"
+                          "<th>Hit Ratio</th><th>Byte Hit Ratio</th></tr>");
         t_Rio_writen(connfd, data, n);
+        int i;
+        for(i = 0; i < NPOLICIES; i++)
+        {
+            struct policy_stats* st = &policystats[i];
+            double hitratio = st->requests ?
+                100.0 * st->hits / st->requests : 0;
+            double bytehitratio = st->bytes ?
+                100.0 * st->hitbytes / st->bytes : 0;
+            n = sprintf(data, "<tr><td><a href='%s'>%s</a>%s</td>"
+                              "<td>%lu</td><td>%.2f%%</td><td>%.2f%%</td>"
+                              "</tr>",
+                              policies[i].setpath, policies[i].name,
+                              (thecache.policy == &policies[i]) ?
+                                " (active)" : "",
+                              st->requests, hitratio, bytehitratio);
+            t_Rio_writen(connfd, data, n);
+        }
+        t_Rio_writen(connfd, "</table>", strlen("</table>"));
+
+        //and where the time goes, stage by stage
+        n = sprintf(data, "<br /><table>"
+                          "<tr><th>Stage</th><th>Count</th><th>p50</th>"
+                          "<th>p99</th><th>p99.9</th></tr>");
+        t_Rio_writen(connfd, data, n);
+        double q[3] = {0.5, 0.99, 0.999};
+        long long v[3];
+        for(i = 0; i < NSTAGES; i++)
+        {
+            unsigned long count = metrics_quantiles(i, 3, q, v);
+            n = sprintf(data, "<tr><td>%s</td><td>%lu</td><td>%.3f ms</td>"
+                              "<td>%.3f ms</td><td>%.3f ms</td></tr>",
+                        stage_names[i], count, v[0] / 1e3, v[1] / 1e3,
+                        v[2] / 1e3);
+            t_Rio_writen(connfd, data, n);
+        }
+        t_Rio_writen(connfd, "</table>", strlen("</table>"));
+
+        //and where the locks are waited on and held (this page's own
+        //hold is counted once it's done)
+        n = sprintf(data, "<br /><table>"
+                          "<tr><th>Lock</th><th>Taken</th><th>Contended</th>"
+                          "<th>Mean Wait</th><th>Max Wait</th>"
+                          "<th>Mean Hold</th><th>Max Hold</th></tr>");
+        t_Rio_writen(connfd, data, n);
+        for(i = 0; i < NLOCKSITES; i++)
+        {
+            struct lockstats ls;
+            metrics_locks(i, &ls);
+            n = sprintf(data, "<tr><td>%s</td><td>%lu</td><td>%lu</td>"
+                              "<td>%.3f ms</td><td>%.3f ms</td>"
+                              "<td>%.3f ms</td><td>%.3f ms</td></tr>",
+                        lock_names[i], ls.taken, ls.contended,
+                        ls.contended ? ls.waitusec / 1e3 / ls.contended : 0,
+                        ls.maxwait / 1e3,
+                        ls.taken ? ls.holdusec / 1e3 / ls.taken : 0,
+                        ls.maxhold / 1e3);
+            t_Rio_writen(connfd, data, n);
+        }
+        t_Rio_writen(connfd, "</table>", strlen("</table>"));
 
         char options[] = "<style>"
                          "body{"
@@ -960,9 +4050,15 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
                          "  </a></td>"
                          "</tr>"
                          "<tr>"
-                         "  <td colspan='2'><center><a href='/clearcache'>"
+                         "  <td><a href='/clearcache'>"
                          "      Clear the Cache"
-                         "  </a></center></td>"
+                         "  </a></td>"
+                         "  <td><a href='/snapshot'>"
+                         "      Save a Snapshot"
+                         "  </a></td>"
+                         "  <td><a href='/metrics'>"
+                         "      Metrics"
+                         "  </a></td>"
                          "</tr>"
                          "</table>"
                          "<br /><br />"
@@ -979,9 +4075,14 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
         while(node)
         {
             n=sprintf(data, "<tr>"
-                            "<td>%u bytes</td><td>%s</td>"
+                            "<td>%u bytes%s%s%s</td><td>%s</td>"
                             "</tr>", 
-                                node->size, node->objname);
+                                node->size,
+                                node->encoding ? " (" : "",
+                                node->encoding ?
+                                  encoding_name(node->encoding) : "",
+                                node->encoding ? ")" : "",
+                                node->objname);
             t_Rio_writen(connfd, data, n);
             node = node->next;
         }
@@ -992,7 +4093,7 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
         //handler
         pthread_cleanup_pop(0);
 
-        pthread_rwlock_unlock(&cachelock);
+        metrics_rwunlock(&cachelock, LOCK_INFO, taken);
     }
     //other conditions here
     else
@@ -1011,20 +4112,30 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
         char dynamiccontent[MAXLINE];
         memset(dynamiccontent, '\0', MAXLINE*sizeof(char));
         
-        pthread_mutex_lock(&features_mutex);
+        struct features_t* features = features_get();
 
         snprintf(dynamiccontent, MAXLINE, 
                                 "<table style='border-left: 1px black solid' >"
                                 "<tr><td>Caching Mode:</td><td>%s</td></tr>"
+                                "<tr><td>Admission Filter:</td><td>%s</td></tr>"
+                                "<tr><td>Eviction Policy:</td><td>%s</td></tr>"
+                                "<tr><td>Compressed Storage:</td><td>%s</td></tr>"
+                                "<tr><td>Client Compression:</td><td>%s</td></tr>"
+                                "<tr><td>HTTP/2 to Origins:</td><td>%s</td></tr>"
                                 "<tr><td>NOPE Mode:</td><td>%s</td></tr>"
                                 "<tr><td>Rickroll:</td><td>%s</td></tr>"
                                 "</table>",
-                                (ft_config.cache)?
-                                  ((ft_config.cache == 2)?"smart":"dumb"):"off",
-                                (ft_config.nope)?"on":"off",
-                                (ft_config.rickroll)?"on":"off");
+                                (features->cache)?
+                                  ((features->cache == 2)?"smart":"dumb"):"off",
+                                (features->admission)?"on":"off",
+                                __atomic_load_n(&thecache.policy,
+                                                __ATOMIC_RELAXED)->name,
+                                (features->compress)?"on":"off",
+                                (features->encode)?"on":"off",
+                                (features->h2origin)?"on":"off",
+                                (features->nope)?"on":"off",
+                                (features->rickroll)?"on":"off");
 
-        pthread_mutex_unlock(&features_mutex);
         t_Rio_writen(connfd, dynamiccontent, strlen(dynamiccontent));
 
         char options[] = "<style>"
@@ -1064,6 +4175,38 @@ void feature_console(int connfd, rio_t* proxy_client, char path[MAXLINE])
                          "  </a></td>"
                          "</tr>"
                          "<tr>"
+                         "  <td><a href='/set/admission/on'>"
+                         "      Engage Admission Filter"
+                         "  </a></td>"
+                         "  <td><a href='/set/admission/off'>"
+                         "      Disengage Admission Filter"
+                         "  </a></td>"
+                         "</tr>"
+                         "<tr>"
+                         "  <td><a href='/set/compress/on'>"
+                         "      Engage Compressed Storage"
+                         "  </a></td>"
+                         "  <td><a href='/set/compress/off'>"
+                         "      Disengage Compressed Storage"
+                         "  </a></td>"
+                         "</tr>"
+                         "<tr>"
+                         "  <td><a href='/set/encode/on'>"
+                         "      Engage Client Compression"
+                         "  </a></td>"
+                         "  <td><a href='/set/encode/off'>"
+                         "      Disengage Client Compression"
+                         "  </a></td>"
+                         "</tr>"
+                         "<tr>"
+                         "  <td><a href='/set/h2origin/on'>"
+                         "      Engage HTTP/2 to Origins"
+                         "  </a></td>"
+                         "  <td><a href='/set/h2origin/off'>"
+                         "      Disengage HTTP/2 to Origins"
+                         "  </a></td>"
+                         "</tr>"
+                         "<tr>"
                          "<td style='background-color:black' colspan='2'>"
                          "</tr>"
                          "<tr>"
@@ -0,0 +1,164 @@
+/**************
+ ** Tunnel relay for CONNECT, see relay.h
+ **/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "relay.h"
+
+static unsigned long tunnels;
+static unsigned long long relayed;
+
+//one direction of a tunnel
+struct flow
+{
+    int from;
+    int to;
+    int pipe[2];
+    int inpipe; //bytes sitting in the pipe
+    int eof;    //the sending side is done
+    int done;   //...and everything it sent has been passed on
+};
+
+static int flow_init(struct flow* f, int from, int to)
+{
+    f->from = from;
+    f->to = to;
+    f->inpipe = 0;
+    f->eof = 0;
+    f->done = 0;
+    if(pipe2(f->pipe, O_NONBLOCK) < 0)
+        return -1;
+    //a pipe is 64K by default, but ask anyway in case that ever changes
+    fcntl(f->pipe[1], F_SETPIPE_SZ, TUNNEL_BUFFER);
+    return 0;
+}
+
+static void flow_close(struct flow* f)
+{
+    close(f->pipe[0]);
+    close(f->pipe[1]);
+}
+
+//move what we can through one direction. returns bytes passed on, or -1
+//if the tunnel is broken
+static long flow_pump(struct flow* f, short fromevents, short toevents)
+{
+    long moved = 0;
+    if(!f->eof && (fromevents & (POLLIN | POLLHUP | POLLERR))
+       && f->inpipe < TUNNEL_BUFFER)
+    {
+        ssize_t n = splice(f->from, NULL, f->pipe[1], NULL,
+                           TUNNEL_BUFFER - f->inpipe,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0)
+            f->inpipe += n;
+        else if(n == 0)
+            f->eof = 1;
+        else if(errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    //try to pass on what's in the pipe straight away, rather than waiting
+    //a round of poll() to hear the other side is writable
+    if(f->inpipe > 0 && !(toevents & (POLLERR | POLLNVAL)))
+    {
+        ssize_t n = splice(f->pipe[0], NULL, f->to, NULL, f->inpipe,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0)
+        {
+            f->inpipe -= n;
+            moved = n;
+        }
+        else if(n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if(f->eof && f->inpipe == 0 && !f->done)
+    {
+        //pass the half-close along, so the other side sees the end
+        shutdown(f->to, SHUT_WR);
+        f->done = 1;
+    }
+    return moved;
+}
+
+long relay_tunnel(int clientfd, int serverfd)
+{
+    struct flow up, down;
+    if(flow_init(&up, clientfd, serverfd) < 0)
+        return -1;
+    if(flow_init(&down, serverfd, clientfd) < 0)
+    {
+        flow_close(&up);
+        return -1;
+    }
+    int clientflags = fcntl(clientfd, F_GETFL);
+    int serverflags = fcntl(serverfd, F_GETFL);
+    fcntl(clientfd, F_SETFL, clientflags | O_NONBLOCK);
+    fcntl(serverfd, F_SETFL, serverflags | O_NONBLOCK);
+    __atomic_add_fetch(&tunnels, 1, __ATOMIC_RELAXED);
+
+    long total = 0;
+    int hungup[2] = {0, 0};
+    while(!(up.done && down.done))
+    {
+        struct pollfd fds[2];
+        fds[0].fd = clientfd;
+        fds[1].fd = serverfd;
+        fds[0].events = fds[1].events = 0;
+        //read while there's room in the pipe, write while there's
+        //something in it
+        if(!up.eof && up.inpipe < TUNNEL_BUFFER)
+            fds[0].events |= POLLIN;
+        if(!down.eof && down.inpipe < TUNNEL_BUFFER)
+            fds[1].events |= POLLIN;
+        if(up.inpipe > 0)
+            fds[1].events |= POLLOUT;
+        if(down.inpipe > 0)
+            fds[0].events |= POLLOUT;
+        //a side that has hung up reports POLLHUP at once, every time, so
+        //it's only polled while there's room to read what it left behind
+        //(and while the pipe from it drains, we just wait on the other)
+        if(hungup[0] && !(fds[0].events & POLLIN))
+            fds[0].fd = -1;
+        if(hungup[1] && !(fds[1].events & POLLIN))
+            fds[1].fd = -1;
+        if(fds[0].fd < 0 && fds[1].fd < 0)
+            break;
+
+        int ready = poll(fds, 2, TUNNEL_IDLE_TIMEOUT * 1000);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready <= 0)
+            break; //idle for too long, or poll() failed
+
+        hungup[0] |= (fds[0].revents & POLLHUP) != 0;
+        hungup[1] |= (fds[1].revents & POLLHUP) != 0;
+        long a = flow_pump(&up, fds[0].revents, fds[1].revents);
+        long b = flow_pump(&down, fds[1].revents, fds[0].revents);
+        if(a < 0 || b < 0)
+            break;
+        total += a + b;
+        //a side that has hung up altogether can't take any more either
+        if(((fds[0].revents & POLLHUP) && up.done)
+           || ((fds[1].revents & POLLHUP) && down.done))
+            break;
+    }
+    __atomic_add_fetch(&relayed, total, __ATOMIC_RELAXED);
+
+    fcntl(clientfd, F_SETFL, clientflags);
+    fcntl(serverfd, F_SETFL, serverflags);
+    flow_close(&up);
+    flow_close(&down);
+    return total;
+}
+
+void relay_stats(unsigned long* ntunnels, unsigned long long* bytes)
+{
+    *ntunnels = __atomic_load_n(&tunnels, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&relayed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,25 @@
+/*****
+ ** Tunnel relay for CONNECT
+ **
+ ** Once a tunnel is set up, bytes are moved between the client and the
+ ** server in both directions by one thread, with poll() and splice()
+ ** through a pipe per direction, so they never get copied into user space.
+ ** Each pipe holds at most TUNNEL_BUFFER bytes; while it's full we stop
+ ** reading from that side, which leaves the backpressure to TCP. A tunnel
+ ** with no traffic in either direction for TUNNEL_IDLE_TIMEOUT seconds is
+ ** closed.
+ **/
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#define TUNNEL_BUFFER       65536 /* bytes in flight, per direction */
+#define TUNNEL_IDLE_TIMEOUT 300   /* seconds */
+
+//relay between two connected sockets until both sides are done (or one
+//breaks). returns the number of bytes relayed, or -1 if it couldn't start
+long relay_tunnel(int clientfd, int serverfd);
+
+//numbers for the diagnostics page
+void relay_stats(unsigned long* tunnels, unsigned long long* bytes);
+
+#endif /* __RELAY_H__ */
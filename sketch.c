@@ -0,0 +1,97 @@
+/**************
+ ** Count-min frequency sketch with aging, see sketch.h
+ **/
+#include <stdint.h>
+
+#include "sketch.h"
+
+#define SKETCH_MAX 15
+
+static uint8_t counters[SKETCH_DEPTH][SKETCH_WIDTH];
+static unsigned long increments;
+
+//each row gets its own hash of the name by mixing a different seed in
+static const uint64_t seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL,
+    0x94d049bb133111ebULL, 0xd6e8feb86659fd93ULL
+};
+
+uint64_t objname_hash(char* objname)
+{
+    uint64_t h = 14695981039346656037ULL;
+    char* p;
+    for(p = objname; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return h;
+}
+
+static unsigned row_index(uint64_t h, int row)
+{
+    h ^= seeds[row];
+    h ^= h >> 31;
+    h *= 0x7fb5d329728ea185ULL;
+    h ^= h >> 27;
+    return h % SKETCH_WIDTH;
+}
+
+//halve every counter
+static void sketch_age()
+{
+    int i, j;
+    for(i = 0; i < SKETCH_DEPTH; i++)
+    {
+        for(j = 0; j < SKETCH_WIDTH; j++)
+        {
+            uint8_t c = __atomic_load_n(&counters[i][j], __ATOMIC_RELAXED);
+            __atomic_store_n(&counters[i][j], c >> 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void sketch_increment(char* objname)
+{
+    uint64_t h = objname_hash(objname);
+    int i;
+    for(i = 0; i < SKETCH_DEPTH; i++)
+    {
+        uint8_t* c = &counters[i][row_index(h, i)];
+        uint8_t old = __atomic_load_n(c, __ATOMIC_RELAXED);
+        while(old < SKETCH_MAX
+              && !__atomic_compare_exchange_n(c, &old, old+1, 0,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED))
+            ;
+    }
+
+    //whoever takes the count past the sample size does the aging
+    if(__atomic_add_fetch(&increments, 1, __ATOMIC_RELAXED)
+       % SKETCH_SAMPLE == 0)
+    {
+        sketch_age();
+    }
+}
+
+int sketch_estimate(char* objname)
+{
+    uint64_t h = objname_hash(objname);
+    int i;
+    int est = SKETCH_MAX;
+    for(i = 0; i < SKETCH_DEPTH; i++)
+    {
+        int c = __atomic_load_n(&counters[i][row_index(h, i)],
+                                __ATOMIC_RELAXED);
+        if(c < est)
+            est = c;
+    }
+    return est;
+}
+
+void sketch_clear()
+{
+    int i, j;
+    for(i = 0; i < SKETCH_DEPTH; i++)
+    {
+        for(j = 0; j < SKETCH_WIDTH; j++)
+            __atomic_store_n(&counters[i][j], 0, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,31 @@
+/*****
+ ** Frequency sketch for cache admission (TinyLFU)
+ **
+ ** A count-min sketch estimates how often each object has been requested
+ ** recently. Counters saturate at 15 and are all halved every
+ ** SKETCH_SAMPLE increments, so old popularity ages out.
+ **
+ ** The sketch is shared by every connection thread and is updated without
+ ** a lock: counters are bumped with atomic compare-and-swap, and a race with
+ ** the periodic halving can only lose an increment, which is fine for an
+ ** estimate.
+ **/
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include <stdint.h>
+
+#define SKETCH_DEPTH  4
+#define SKETCH_WIDTH  4096                  /* counters per row */
+#define SKETCH_SAMPLE (8 * SKETCH_WIDTH)    /* increments between agings */
+
+//record one request for an object
+void sketch_increment(char* objname);
+//estimated recent request count for an object (0-15)
+int sketch_estimate(char* objname);
+//forget everything
+void sketch_clear();
+//the hash the sketch rows are derived from (64-bit FNV-1a of the name)
+uint64_t objname_hash(char* objname);
+
+#endif /* __SKETCH_H__ */
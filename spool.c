@@ -0,0 +1,132 @@
+/**************
+ ** Bounded buffering between the origin and a client, see spool.h
+ **/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "coro.h"
+#include "spool.h"
+
+static unsigned long paused;
+static unsigned long stalled;
+
+void spool_init(struct spool* s)
+{
+    s->buf = NULL;
+    s->cap = 0;
+    s->start = 0;
+    s->len = 0;
+    s->paused = 0;
+}
+
+void spool_free(struct spool* s)
+{
+    free(s->buf);
+    s->buf = NULL;
+}
+
+//send without blocking. returns the bytes sent (maybe 0), or -1
+static int send_some(int fd, char* data, int len)
+{
+    ssize_t n;
+    while((n = send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0
+          && errno == EINTR)
+        ;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    return n;
+}
+
+int spool_flush(struct spool* s, int fd)
+{
+    if(s->len == 0)
+        return 0;
+    int n = send_some(fd, s->buf + s->start, s->len);
+    if(n < 0)
+        return -1;
+    s->start += n;
+    s->len -= n;
+    if(s->len == 0)
+        s->start = 0;
+    return 0;
+}
+
+int spool_write(struct spool* s, int fd, void* data, int len)
+{
+    if(spool_flush(s, fd) < 0)
+        return -1;
+    if(s->len == 0)
+    {
+        int n = send_some(fd, data, len);
+        if(n < 0)
+            return -1;
+        data = (char*)data + n;
+        len -= n;
+    }
+    if(len == 0)
+        return 0;
+
+    //keep the rest. the reader stops at the high water mark, so this only
+    //ever goes past it by the last piece read
+    if(s->start + s->len + len > s->cap)
+    {
+        memmove(s->buf, s->buf + s->start, s->len);
+        s->start = 0;
+        if(s->len + len > s->cap)
+        {
+            int cap = SPOOL_HIGH_WATER;
+            while(cap < s->len + len)
+                cap *= 2;
+            char* bigger = realloc(s->buf, cap);
+            if(!bigger)
+                return -1;
+            s->buf = bigger;
+            s->cap = cap;
+        }
+    }
+    memcpy(s->buf + s->start + s->len, data, len);
+    s->len += len;
+    return 0;
+}
+
+int spool_full(struct spool* s)
+{
+    if(!s->paused && s->len >= SPOOL_HIGH_WATER)
+    {
+        s->paused = 1;
+        __atomic_add_fetch(&paused, 1, __ATOMIC_RELAXED);
+    }
+    else if(s->paused && s->len <= SPOOL_LOW_WATER)
+    {
+        s->paused = 0;
+    }
+    return s->paused;
+}
+
+int spool_wait(struct spool* s, int fd, int infd)
+{
+    struct pollfd fds[2];
+    fds[0].fd = (s->len > 0) ? fd : -1;
+    fds[0].events = POLLOUT;
+    fds[0].revents = 0;
+    fds[1].fd = infd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if(coro_poll(fds, 2, SPOOL_STALL_TIMEOUT * 1000) <= 0)
+    {
+        __atomic_add_fetch(&stalled, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    //(an error or hangup counts as ready, so the next call finds out)
+    return (fds[0].revents ? SPOOL_OUT : 0) | (fds[1].revents ? SPOOL_IN : 0);
+}
+
+void spool_stats(unsigned long* npaused, unsigned long* nstalled)
+{
+    *npaused = __atomic_load_n(&paused, __ATOMIC_RELAXED);
+    *nstalled = __atomic_load_n(&stalled, __ATOMIC_RELAXED);
+}
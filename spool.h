@@ -0,0 +1,57 @@
+/*****
+ ** Bounded buffering between the origin and a client
+ **
+ ** A response body used to go to the client a piece at a time, each write
+ ** blocking until the client took it, so a slow client held the origin
+ ** connection for as long as it took to read, and the origin sat idle in
+ ** between. A spool holds what the client hasn't taken yet, so the origin
+ ** can be read ahead of it, but only so far: once SPOOL_HIGH_WATER bytes are
+ ** waiting, reading from the origin stops until the client has brought it
+ ** down to SPOOL_LOW_WATER (so it doesn't start and stop on every write).
+ ** A response that fits is read to its end straight away, and the origin
+ ** connection goes back to the pool while the client is still reading.
+ **
+ ** Writes go straight to the socket when nothing is waiting, so with a
+ ** client that keeps up nothing is copied. A client that takes nothing at
+ ** all for SPOOL_STALL_TIMEOUT seconds is given up on.
+ **/
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#define SPOOL_HIGH_WATER    131072 /* bytes waiting before the origin waits */
+#define SPOOL_LOW_WATER     32768  /* ...until they're down to this */
+#define SPOOL_STALL_TIMEOUT 60     /* seconds */
+
+//what spool_wait() found ready
+#define SPOOL_OUT 1 /* the client can take more */
+#define SPOOL_IN  2 /* there's more to read */
+
+struct spool
+{
+    char* buf;
+    int cap;
+    int start; //the unsent bytes are buf[start..start+len)
+    int len;
+    int paused; //over the high water mark, and not yet back to the low
+};
+
+void spool_init(struct spool* s);
+void spool_free(struct spool* s);
+
+//send data to fd, or as much as it'll take without blocking, and keep the
+//rest (after anything already waiting). returns 0, or -1 on a write error
+int spool_write(struct spool* s, int fd, void* data, int len);
+//send what's waiting, as far as fd will take it without blocking.
+//returns 0, or -1 on a write error
+int spool_flush(struct spool* s, int fd);
+//should reading stop for now?
+int spool_full(struct spool* s);
+//wait for fd to take more of what's waiting, or infd (unless it's -1) to
+//have something to read. returns SPOOL_OUT and/or SPOOL_IN, or 0 if
+//neither happened within SPOOL_STALL_TIMEOUT
+int spool_wait(struct spool* s, int fd, int infd);
+
+//numbers for the diagnostics page
+void spool_stats(unsigned long* paused, unsigned long* stalled);
+
+#endif /* __SPOOL_H__ */
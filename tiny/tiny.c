@@ -1,106 +1,263 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple, concurrent HTTP/1.1 Web server that uses the
+ *     GET method to serve static and dynamic content, and made-up
+ *     content of any size for load testing.
+ *
+ *     Connections are handled by a pool of NTHREADS threads (-t) that
+ *     take them from a bounded queue filled by the main thread, as in
+ *     the prethreaded echo server. A connection is kept open between
+ *     requests unless the client asks for it to be closed (or it's
+ *     HTTP/1.0 and doesn't ask for keep-alive), and is dropped after
+ *     IDLE_SECS seconds with no request, so idle clients can't hold
+ *     every thread.
+ *
+ *     /gen/<size>[k|m][/anything] answers with a body of that many
+ *     bytes, whatever follows the size (so /gen/4096/17 and /gen/4096/18
+ *     are two different URLs of the same size). -l ms, or -l min-max,
+ *     holds every answer back that many milliseconds (picked uniformly
+ *     between min and max) to stand in for a slow origin.
+ *
+ *     A connection that opens with the HTTP/2 preface is served as h2c
+ *     (prior knowledge) by the proxy's own HTTP/2 front end, which hands
+ *     each stream to doit() as a connection of its own, so tiny can stand
+ *     in for an origin that speaks HTTP/2 (make h2test).
  */
+#define _GNU_SOURCE  /* for strcasestr */
 #include "csapp.h"
+#include "h2.h"
+#include <netinet/tcp.h>
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+#define NTHREADS  64     /* worker threads, if not given */
+#define SBUFSIZE  1024   /* connections waiting for a thread */
+#define IDLE_SECS 5      /* how long a kept connection may sit idle */
+#define GENSIZE   65536  /* the chunk generated bodies are written in */
+
+/* $begin sbuft */
+typedef struct {
+    int *buf;          /* Buffer array */
+    int n;             /* Maximum number of slots */
+    int front;         /* buf[(front+1)%n] is first item */
+    int rear;          /* buf[rear%n] is last item */
+    sem_t mutex;       /* Protects accesses to buf */
+    sem_t slots;       /* Counts available slots */
+    sem_t items;       /* Counts available items */
+} sbuf_t;
+/* $end sbuft */
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void *thread(void *vargp);
+void h2stream(int fd);
+int doit(int fd, rio_t *rio);
+int read_requesthdrs(rio_t *rp, int keep);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+int parse_gen(char *uri, long *size);
+void delay(unsigned int *seed);
+int write_headers(int fd, char *status, char *filetype, long length,
+		  int keep);
+int serve_static(int fd, char *filename, int filesize, int keep);
+int serve_gen(int fd, long size, int keep);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg);
+int clienterror(int fd, char *cause, char *errnum,
+		char *shortmsg, char *longmsg, int keep);
+
+sbuf_t sbuf;             /* Shared buffer of connected descriptors */
+int verbose = 0;         /* -v: print each request's headers */
+int delay_min = 0;       /* -l: ms each answer is held back */
+int delay_max = 0;
+char genbuf[GENSIZE];    /* what generated bodies are made of */
 
-int main(int argc, char **argv) 
+int main(int argc, char **argv)
 {
-    int listenfd, connfd, port, clientlen;
+    int listenfd, connfd, port, i, opt, nthreads = NTHREADS;
+    socklen_t clientlen;
     struct sockaddr_in clientaddr;
+    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:l:v")) != -1) {
+	switch (opt) {
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'l':
+	    if (sscanf(optarg, "%d-%d", &delay_min, &delay_max) < 2)
+		delay_max = delay_min;
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    optind = argc; /* bail out to the usage message */
+	}
+    }
+    if (optind != argc - 1 || nthreads < 1 || delay_min < 0
+	|| delay_max < delay_min) {
+	fprintf(stderr, "usage: %s [-t threads] [-l ms[-ms]] [-v] <port>\n",
+		argv[0]);
 	exit(1);
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
+
+    /* A client that goes away mid-answer mustn't take the server too */
+    Signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < GENSIZE; i++)
+	genbuf[i] = "0123456789abcdefghijklmnopqrstuvwxyz\n"[i % 37];
 
     listenfd = Open_listenfd(port);
+    sbuf_init(&sbuf, SBUFSIZE);
+    for (i = 0; i < nthreads; i++)  /* Create worker threads */
+	Pthread_create(&tid, NULL, thread, NULL);
     while (1) {
 	clientlen = sizeof(clientaddr);
-	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-	doit(connfd);
-	Close(connfd);
+	connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+	if (connfd < 0)  /* e.g. out of descriptors: try again */
+	    continue;
+	sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
     }
 }
 /* $end tinymain */
 
+/*
+ * thread - take connections from the buffer and answer their requests
+ *          until they close, go idle, or one can't be kept open
+ */
+/* $begin thread */
+void *thread(void *vargp)
+{
+    struct timeval idle = { IDLE_SECS, 0 };
+    int one = 1;
+    rio_t rio;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1) {
+	int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
+	setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+	/* The headers and the body go in separate writes, and on a kept
+	   connection Nagle would hold the body back for the client's ACK */
+	setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	rio_readinitb(&rio, connfd);
+	while (doit(connfd, &rio))
+	    ;
+	Close(connfd);
+    }
+}
+/* $end thread */
+
+/*
+ * h2stream - answer the one request on an HTTP/2 stream
+ */
+void h2stream(int fd)
+{
+    rio_t rio;
+
+    rio_readinitb(&rio, fd);
+    doit(fd, &rio);
+    Close(fd);
+}
+
 /*
  * doit - handle one HTTP request/response transaction
+ *        return 1 if the connection can take another request
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rio)
 {
-    int is_static;
+    int is_static, keep, minor = 0;
+    long size;
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
-  
+    static __thread unsigned int seed;
+
+    if (!seed)
+	seed = (unsigned int)pthread_self();
+
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    if (strcasecmp(method, "GET")) { 
-       clienterror(fd, method, "501", "Not Implemented",
-                "Tiny does not implement this method");
-        return;
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+	return 0;  /* closed, or idle too long */
+    if (!strcmp(buf, "PRI * HTTP/2.0\r\n")) {
+	h2_serve(fd, rio, h2stream, NULL);
+	return 0;
     }
-    read_requesthdrs(&rio);
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3)
+	return 0;
+    sscanf(version, "HTTP/1.%d", &minor);
+    /* An absolute URI (which is how HTTP/2 streams arrive) comes down to
+       its path */
+    if (!strncasecmp(uri, "http://", 7)) {
+	char *path = strchr(uri + 7, '/');
+	if (!path)
+	    path = "/";
+	memmove(uri, path, strlen(path) + 1);
+    }
+    keep = read_requesthdrs(rio, minor >= 1);
+    if (keep < 0)
+	return 0;
+    if (strcasecmp(method, "GET")) {
+	clienterror(fd, method, "501", "Not Implemented",
+		    "Tiny does not implement this method", 0);
+	return 0;
+    }
+    delay(&seed);
+
+    /* Made-up content */
+    if (parse_gen(uri, &size))
+	return serve_gen(fd, size, keep) == 0 && keep;
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
-	return;
-    }
+    if (stat(filename, &sbuf) < 0)
+	return clienterror(fd, filename, "404", "Not found",
+			   "Tiny couldn't find this file", keep) == 0 && keep;
 
     if (is_static) { /* Serve static content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
-	    return;
-	}
-	serve_static(fd, filename, sbuf.st_size);
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
+	    return clienterror(fd, filename, "403", "Forbidden",
+			       "Tiny couldn't read the file", keep) == 0 && keep;
+	return serve_static(fd, filename, sbuf.st_size, keep) == 0 && keep;
     }
     else { /* Serve dynamic content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't run the CGI program");
-	    return;
-	}
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode))
+	    return clienterror(fd, filename, "403", "Forbidden",
+			       "Tiny couldn't run the CGI program", keep) == 0
+		   && keep;
+	/* The CGI program writes the rest, so the end of the answer is
+	   the end of the connection */
 	serve_dynamic(fd, filename, cgiargs);
+	return 0;
     }
 }
 /* $end doit */
 
 /*
  * read_requesthdrs - read and parse HTTP request headers
+ *                    return whether the connection is to be kept open
+ *                    (keep says what it is if no header says), or -1
+ *                    if the headers didn't all come
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(rio_t *rp, int keep)
 {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
-    }
-    return;
+    do {
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return -1;
+	if (verbose)
+	    printf("%s", buf);
+	if (!strncasecmp(buf, "Connection:", 11)) {
+	    if (strcasestr(buf + 11, "close"))
+		keep = 0;
+	    else if (strcasestr(buf + 11, "keep-alive"))
+		keep = 1;
+	}
+    } while (strcmp(buf, "\r\n"));
+    return keep;
 }
 /* $end read_requesthdrs */
 
@@ -109,7 +266,7 @@ void read_requesthdrs(rio_t *rp)
  *             return 0 if dynamic content, 1 if static
  */
 /* $begin parse_uri */
-int parse_uri(char *uri, char *filename, char *cgiargs) 
+int parse_uri(char *uri, char *filename, char *cgiargs)
 {
     char *ptr;
 
@@ -127,7 +284,7 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 	    strcpy(cgiargs, ptr+1);
 	    *ptr = '\0';
 	}
-	else 
+	else
 	    strcpy(cgiargs, "");
 	strcpy(filename, ".");
 	strcat(filename, uri);
@@ -137,34 +294,94 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * parse_gen - is the URI /gen/<size>[k|m][/anything]?
+ *             return 1 and the size if it is, 0 if not
+ */
+int parse_gen(char *uri, long *size)
+{
+    char *end;
+
+    if (strncmp(uri, "/gen/", 5))
+	return 0;
+    *size = strtol(uri + 5, &end, 10);
+    if (end == uri + 5 || *size < 0)
+	return 0;
+    if (*end == 'k' || *end == 'K')
+	*size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+	*size <<= 20, end++;
+    return *end == '\0' || *end == '/' || *end == '?';
+}
+
+/*
+ * delay - hold the answer back for as long as -l says
+ */
+void delay(unsigned int *seed)
+{
+    int ms = delay_min;
+    struct timespec ts;
+
+    if (delay_max > delay_min)
+	ms += rand_r(seed) % (delay_max - delay_min + 1);
+    if (ms == 0)
+	return;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	;
+}
+
+/*
+ * write_headers - the status line and the headers every answer has
+ *                 return 0, or -1 if the client has gone
+ */
+int write_headers(int fd, char *status, char *filetype, long length,
+		  int keep)
+{
+    char buf[MAXBUF];
+
+    snprintf(buf, MAXBUF, "HTTP/1.1 %s\r\n"
+	     "Server: Tiny Web Server\r\n"
+	     "Content-length: %ld\r\n"
+	     "Content-type: %s\r\n"
+	     "Connection: %s\r\n\r\n",
+	     status, length, filetype, keep ? "keep-alive" : "close");
+    return rio_writen(fd, buf, strlen(buf)) < 0 ? -1 : 0;
+}
+
+/*
+ * serve_static - copy a file back to the client
+ *                return 0, or -1 if it couldn't all be sent
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+int serve_static(int fd, char *filename, int filesize, int keep)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
- 
+    int srcfd, rc;
+    char *srcp, filetype[32];
+
     /* Send response headers to client */
     get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
+    if (write_headers(fd, "200 OK", filetype, filesize, keep) < 0)
+	return -1;
+    if (filesize == 0)
+	return 0;
 
     /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+    if ((srcfd = open(filename, O_RDONLY, 0)) < 0)
+	return -1;
+    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    close(srcfd);
+    if (srcp == MAP_FAILED)
+	return -1;
+    rc = rio_writen(fd, srcp, filesize) < 0 ? -1 : 0;
+    munmap(srcp, filesize);
+    return rc;
 }
 
 /*
  * get_filetype - derive file type from file name
  */
-void get_filetype(char *filename, char *filetype) 
+void get_filetype(char *filename, char *filetype)
 {
     if (strstr(filename, ".html"))
 	strcpy(filetype, "text/html");
@@ -174,56 +391,113 @@ void get_filetype(char *filename, char *filetype)
 	strcpy(filetype, "image/jpeg");
     else
 	strcpy(filetype, "text/plain");
-}  
+}
 /* $end serve_static */
 
+/*
+ * serve_gen - send size bytes of made-up content
+ *             return 0, or -1 if it couldn't all be sent
+ */
+int serve_gen(int fd, long size, int keep)
+{
+    long n;
+
+    if (write_headers(fd, "200 OK", "text/plain", size, keep) < 0)
+	return -1;
+    for (; size > 0; size -= n) {
+	n = size < GENSIZE ? size : GENSIZE;
+	if (rio_writen(fd, genbuf, n) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
 /*
  * serve_dynamic - run a CGI program on behalf of the client
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs) 
+void serve_dynamic(int fd, char *filename, char *cgiargs)
 {
     char buf[MAXLINE], *emptylist[] = { NULL };
+    pid_t pid;
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-  
-    if (Fork() == 0) { /* child */
+    sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return;
+
+    if ((pid = Fork()) == 0) { /* child */
 	/* Real server would set all CGI vars here */
-	setenv("QUERY_STRING", cgiargs, 1); 
+	setenv("QUERY_STRING", cgiargs, 1);
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */
 	Execve(filename, emptylist, environ); /* Run CGI program */
     }
-    Wait(NULL); /* Parent waits for and reaps child */
+    waitpid(pid, NULL, 0); /* Reap this child, not another thread's */
 }
 /* $end serve_dynamic */
 
 /*
  * clienterror - returns an error message to the client
+ *               return 0, or -1 if it couldn't be sent
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg) 
+int clienterror(int fd, char *cause, char *errnum,
+		char *shortmsg, char *longmsg, int keep)
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char status[64], body[MAXBUF];
 
     /* Build the HTTP response body */
     sprintf(body, "<html><title>Tiny Error</title>");
     sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
     sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
+    sprintf(body, "%s<p>%s: %.2048s\r\n", body, longmsg, cause);
     sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    snprintf(status, sizeof(status), "%s %s", errnum, shortmsg);
+    if (write_headers(fd, status, "text/html", strlen(body), keep) < 0)
+	return -1;
+    return rio_writen(fd, body, strlen(body)) < 0 ? -1 : 0;
 }
 /* $end clienterror */
+
+/*
+ * sbuf_init - Create an empty, bounded, shared FIFO buffer with n slots
+ */
+/* $begin sbuf */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;                       /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+}
+
+/*
+ * sbuf_insert - Insert item onto the rear of shared buffer sp
+ */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    P(&sp->slots);                          /* Wait for available slot */
+    P(&sp->mutex);                          /* Lock the buffer */
+    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+
+/*
+ * sbuf_remove - Remove and return the first item from buffer sp
+ */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+    P(&sp->items);                          /* Wait for available item */
+    P(&sp->mutex);                          /* Lock the buffer */
+    item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->slots);                          /* Announce available slot */
+    return item;
+}
+/* $end sbuf */
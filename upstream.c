@@ -0,0 +1,122 @@
+/**************
+ ** Keep-alive pool for origin connections, see upstream.h
+ **/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "csapp.h"
+#include "upstream.h"
+
+struct idleconn
+{
+    char* hostname; //NULL if the slot is free
+    int port;
+    int fd;
+    time_t parked;
+};
+
+static struct idleconn pool[UPSTREAM_POOL_SIZE];
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long opened;
+static unsigned long reused;
+
+static void drop_slot(struct idleconn* c)
+{
+    close(c->fd);
+    free(c->hostname);
+    c->hostname = NULL;
+}
+
+//an idle connection should have nothing to read. if it does, the origin
+//has either closed it or sent something we didn't ask for
+static int still_open(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_get(char* hostname, int port)
+{
+    int fd = -1;
+    time_t now = time(NULL);
+    int i;
+    pthread_mutex_lock(&poollock);
+    for(i = 0; i < UPSTREAM_POOL_SIZE && fd < 0; i++)
+    {
+        struct idleconn* c = &pool[i];
+        if(!c->hostname || c->port != port || strcmp(c->hostname, hostname))
+            continue;
+        if(now - c->parked > UPSTREAM_IDLE_TIMEOUT || !still_open(c->fd))
+        {
+            drop_slot(c);
+            continue;
+        }
+        fd = c->fd;
+        free(c->hostname);
+        c->hostname = NULL;
+        reused++;
+    }
+    pthread_mutex_unlock(&poollock);
+    return fd;
+}
+
+void upstream_put(char* hostname, int port, int fd)
+{
+    time_t now = time(NULL);
+    struct idleconn* slot = NULL;
+    int i;
+    pthread_mutex_lock(&poollock);
+    for(i = 0; i < UPSTREAM_POOL_SIZE; i++)
+    {
+        struct idleconn* c = &pool[i];
+        if(c->hostname && now - c->parked > UPSTREAM_IDLE_TIMEOUT)
+            drop_slot(c);
+        if(!c->hostname && !slot)
+            slot = c;
+    }
+    if(slot)
+    {
+        slot->hostname = strdup(hostname);
+        slot->port = port;
+        slot->fd = fd;
+        slot->parked = now;
+    }
+    pthread_mutex_unlock(&poollock);
+    if(!slot)
+        close(fd);
+}
+
+void upstream_clear()
+{
+    int i;
+    pthread_mutex_lock(&poollock);
+    for(i = 0; i < UPSTREAM_POOL_SIZE; i++)
+    {
+        if(pool[i].hostname)
+            drop_slot(&pool[i]);
+    }
+    pthread_mutex_unlock(&poollock);
+}
+
+void upstream_opened()
+{
+    __atomic_add_fetch(&opened, 1, __ATOMIC_RELAXED);
+}
+
+void upstream_stats(int* idle, unsigned long* nopened, unsigned long* nreused)
+{
+    int i;
+    *idle = 0;
+    pthread_mutex_lock(&poollock);
+    for(i = 0; i < UPSTREAM_POOL_SIZE; i++)
+    {
+        if(pool[i].hostname)
+            (*idle)++;
+    }
+    *nreused = reused;
+    pthread_mutex_unlock(&poollock);
+    *nopened = __atomic_load_n(&opened, __ATOMIC_RELAXED);
+}
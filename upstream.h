@@ -0,0 +1,29 @@
+/*****
+ ** Keep-alive pool for origin connections
+ **
+ ** After a response that leaves the origin connection reusable, the
+ ** connection is parked here, and the next request for the same host and
+ ** port picks it up instead of paying for a new TCP handshake. Parked
+ ** connections are dropped after UPSTREAM_IDLE_TIMEOUT seconds, or as soon
+ ** as we notice the origin has closed them.
+ **/
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPSTREAM_POOL_SIZE    32 /* idle connections kept, all origins */
+#define UPSTREAM_IDLE_TIMEOUT 30 /* seconds */
+
+//take an idle connection to hostname:port out of the pool
+//returns the descriptor, or -1 if there isn't a usable one
+int upstream_get(char* hostname, int port);
+//park a connection for reuse (it's closed if the pool is full)
+void upstream_put(char* hostname, int port, int fd);
+//close every idle connection
+void upstream_clear();
+
+//numbers for the diagnostics page
+void upstream_stats(int* idle, unsigned long* opened, unsigned long* reused);
+//count a fresh connection to an origin
+void upstream_opened();
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,439 @@
+/**************
+ ** io_uring front end, see uring.h
+ **
+ ** There's no liburing here, so this talks to the kernel directly: the
+ ** rings are mapped by hand and the queue indexes are read and written with
+ ** the acquire/release ordering the kernel's side of them expects.
+ **/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+static unsigned long accepted;
+static unsigned long completions;
+static unsigned long enters;
+
+struct ring
+{
+    int fd;
+    unsigned entries;
+    unsigned* sqhead;
+    unsigned* sqtail;
+    unsigned* sqmask;
+    unsigned* sqarray;
+    struct io_uring_sqe* sqes;
+    unsigned sqlocal; //our tail, published when we submit
+    unsigned* cqhead;
+    unsigned* cqtail;
+    unsigned* cqmask;
+    struct io_uring_cqe* cqes;
+    void* sqmap;
+    size_t sqmaplen;
+    void* cqmap; //the same as sqmap on kernels with a single mapping
+    size_t cqmaplen;
+};
+
+//a connection that's waiting for its headers
+struct slot
+{
+    int fd;  //-1 when the slot is free
+    int len; //bytes read into the slot so far
+};
+
+//what a completion is for: the kind goes in the top half of user_data, a
+//slot number in the bottom half
+#define U_ACCEPT  1
+#define U_READ    2
+#define U_TIMEOUT 3
+#define USERDATA(kind, slot) (((uint64_t)(kind) << 32) | (unsigned)(slot))
+
+//with a completion queue of cqentries, or the kernel's choice if that's 0
+static int ring_setup(struct ring* r, unsigned cqentries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if(cqentries)
+    {
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cqentries;
+    }
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(r->fd < 0)
+        return -1;
+
+    r->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single && r->cqmaplen > r->sqmaplen)
+        r->sqmaplen = r->cqmaplen;
+    r->sqmap = mmap(NULL, r->sqmaplen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sqmap == MAP_FAILED)
+    {
+        close(r->fd);
+        return -1;
+    }
+    r->cqmap = r->sqmap;
+    if(!single)
+    {
+        r->cqmap = mmap(NULL, r->cqmaplen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cqmap == MAP_FAILED)
+        {
+            munmap(r->sqmap, r->sqmaplen);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+    {
+        if(r->cqmap != r->sqmap)
+            munmap(r->cqmap, r->cqmaplen);
+        munmap(r->sqmap, r->sqmaplen);
+        close(r->fd);
+        return -1;
+    }
+
+    char* sq = r->sqmap;
+    char* cq = r->cqmap;
+    r->entries = p.sq_entries;
+    r->sqhead = (unsigned*)(sq + p.sq_off.head);
+    r->sqtail = (unsigned*)(sq + p.sq_off.tail);
+    r->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned*)(sq + p.sq_off.array);
+    r->sqlocal = *r->sqtail;
+    r->cqhead = (unsigned*)(cq + p.cq_off.head);
+    r->cqtail = (unsigned*)(cq + p.cq_off.tail);
+    r->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_free(struct ring* r)
+{
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if(r->cqmap != r->sqmap)
+        munmap(r->cqmap, r->cqmaplen);
+    munmap(r->sqmap, r->sqmaplen);
+    close(r->fd);
+}
+
+//hand everything queued so far to the kernel, and (if wait is set) sleep
+//until there's at least one completion. returns -1 with errno set if the
+//call failed, EINTR included
+static int ring_enter(struct ring* r, int wait)
+{
+    __atomic_store_n(r->sqtail, r->sqlocal, __ATOMIC_RELEASE);
+    unsigned queued = r->sqlocal - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+    if(queued == 0 && !wait)
+        return 0;
+    __atomic_add_fetch(&enters, 1, __ATOMIC_RELAXED);
+    return syscall(__NR_io_uring_enter, r->fd, queued, wait ? 1 : 0,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+//make sure there's room for n more entries, submitting early if the queue
+//is full. (entries that go in together, like a read and its timeout, have
+//to go in the same submission)
+static void ring_reserve(struct ring* r, unsigned n)
+{
+    while(r->sqlocal - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE)
+          > r->entries - n)
+    {
+        if(ring_enter(r, 0) < 0 && errno != EINTR)
+            return;
+    }
+}
+
+//the next submission queue entry, cleared. call ring_reserve first
+static struct io_uring_sqe* ring_sqe(struct ring* r)
+{
+    unsigned index = r->sqlocal & *r->sqmask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqarray[index] = index;
+    r->sqlocal++;
+    return sqe;
+}
+
+static void arm_accept(struct ring* r, int listenfd, int multishot)
+{
+    ring_reserve(r, 1);
+    struct io_uring_sqe* sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    if(multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = USERDATA(U_ACCEPT, 0);
+}
+
+//read more of a slot's request, giving up if it takes too long. with the
+//buffers registered the kernel doesn't have to map the pages each time
+static void arm_read(struct ring* r, struct slot* slots, char* buffers,
+                     int fixed, int i)
+{
+    static struct __kernel_timespec timeout = { URING_READ_TIMEOUT, 0 };
+    ring_reserve(r, 2);
+    struct io_uring_sqe* sqe = ring_sqe(r);
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = slots[i].fd;
+    sqe->addr = (uintptr_t)(buffers + (size_t)i * URING_BUFSIZE + slots[i].len);
+    sqe->len = URING_BUFSIZE - slots[i].len;
+    sqe->buf_index = 0;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = USERDATA(U_READ, i);
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)&timeout;
+    sqe->len = 1;
+    sqe->user_data = USERDATA(U_TIMEOUT, i);
+}
+
+//has the blank line at the end of the headers come in? only the bytes
+//from "from" on are new, but the line break may have started before them
+static int headers_done(char* data, int from, int len)
+{
+    int i;
+    for(i = (from > 2) ? from - 2 : 0; i < len; i++)
+    {
+        if(data[i] != '\n')
+            continue;
+        if(i + 1 < len && data[i + 1] == '\n')
+            return 1;
+        if(i + 2 < len && data[i + 1] == '\r' && data[i + 2] == '\n')
+            return 1;
+    }
+    return 0;
+}
+
+int uring_serve(int listenfd, volatile sig_atomic_t* stop,
+                void (*dispatch)(int connfd, char* data, int len))
+{
+    struct ring r;
+    if(ring_setup(&r, 0) < 0)
+        return -1;
+
+    size_t bufferlen = (size_t)URING_SLOTS * URING_BUFSIZE;
+    char* buffers = mmap(NULL, bufferlen, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffers == MAP_FAILED)
+    {
+        ring_free(&r);
+        return -1;
+    }
+    //registering pins the pages, which RLIMIT_MEMLOCK may not allow, and
+    //then plain receives into the same slots do just as well
+    struct iovec iov = { buffers, bufferlen };
+    int fixed = syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS,
+                        &iov, 1) == 0;
+
+    static struct slot slots[URING_SLOTS];
+    int freeslots[URING_SLOTS];
+    int nfree = 0;
+    int i;
+    for(i = URING_SLOTS - 1; i >= 0; i--)
+    {
+        slots[i].fd = -1;
+        freeslots[nfree++] = i;
+    }
+
+    int multishot = 1;
+    arm_accept(&r, listenfd, multishot);
+    while(!*stop)
+    {
+        if(ring_enter(&r, 1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        unsigned head = *r.cqhead;
+        unsigned tail = __atomic_load_n(r.cqtail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &r.cqes[head & *r.cqmask];
+            int kind = cqe->user_data >> 32;
+            int n = (int)(cqe->user_data & 0xffffffff);
+            int res = cqe->res;
+            __atomic_add_fetch(&completions, 1, __ATOMIC_RELAXED);
+
+            if(kind == U_ACCEPT)
+            {
+                if(!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    //a kernel that predates multishot accept says so once,
+                    //and then gets one accept at a time
+                    if(res == -EINVAL && multishot)
+                        multishot = 0;
+                    arm_accept(&r, listenfd, multishot);
+                }
+                if(res < 0)
+                    continue;
+                __atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED);
+                if(nfree == 0)
+                {
+                    dispatch(res, NULL, 0);
+                    continue;
+                }
+                int s = freeslots[--nfree];
+                slots[s].fd = res;
+                slots[s].len = 0;
+                arm_read(&r, slots, buffers, fixed, s);
+            }
+            else if(kind == U_READ)
+            {
+                struct slot* sl = &slots[n];
+                char* data = buffers + (size_t)n * URING_BUFSIZE;
+                if(res > 0)
+                {
+                    int from = sl->len;
+                    sl->len += res;
+                    if(sl->len < URING_BUFSIZE
+                       && !headers_done(data, from, sl->len))
+                    {
+                        arm_read(&r, slots, buffers, fixed, n);
+                        continue;
+                    }
+                    dispatch(sl->fd, data, sl->len);
+                }
+                else
+                {
+                    //closed, broken, or timed out before the headers were in
+                    close(sl->fd);
+                }
+                sl->fd = -1;
+                freeslots[nfree++] = n;
+            }
+            //(a timeout's own completion says nothing new)
+        }
+        __atomic_store_n(r.cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    //closing the ring cancels whatever is still in flight
+    ring_free(&r);
+    for(i = 0; i < URING_SLOTS; i++)
+    {
+        if(slots[i].fd >= 0)
+            close(slots[i].fd);
+    }
+    munmap(buffers, bufferlen);
+    return 0;
+}
+
+/*****
+ * A coroutine worker's ring
+ *****/
+struct uring
+{
+    struct ring r;
+    //the timeouts of the reads and writes that are queued, by the entry
+    //they're in. (the kernel reads them when they're submitted, which is
+    //before their entries can be used again)
+    struct __kernel_timespec* timeouts;
+};
+
+struct uring* uring_new(void)
+{
+    struct uring* u = malloc(sizeof(struct uring));
+    if(!u)
+        return NULL;
+    //(a kernel that can't be asked for the size gets its own)
+    if(ring_setup(&u->r, URING_COMPLETIONS) < 0 && ring_setup(&u->r, 0) < 0)
+    {
+        free(u);
+        return NULL;
+    }
+    u->timeouts = calloc(u->r.entries, sizeof(struct __kernel_timespec));
+    if(!u->timeouts)
+    {
+        ring_free(&u->r);
+        free(u);
+        return NULL;
+    }
+    return u;
+}
+
+void uring_free(struct uring* u)
+{
+    ring_free(&u->r);
+    free(u->timeouts);
+    free(u);
+}
+
+int uring_fd(struct uring* u)
+{
+    return u->r.fd;
+}
+
+void uring_queue(struct uring* u, int fd, void* buf, size_t n, int write,
+                 int timeout, void* tag)
+{
+    struct ring* r = &u->r;
+    ring_reserve(r, 2);
+    struct io_uring_sqe* sqe = ring_sqe(r);
+    sqe->opcode = write ? IORING_OP_SEND : IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = n > (1U << 30) ? (1U << 30) : n;
+    sqe->msg_flags = write ? MSG_NOSIGNAL : 0;
+    sqe->user_data = (uintptr_t)tag;
+    if(timeout < 0)
+        return;
+
+    sqe->flags = IOSQE_IO_LINK;
+    struct __kernel_timespec* ts = &u->timeouts[r->sqlocal & *r->sqmask];
+    ts->tv_sec = timeout / 1000;
+    ts->tv_nsec = (timeout % 1000) * 1000000L;
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = 0;
+}
+
+void uring_submit(struct uring* u)
+{
+    while(ring_enter(&u->r, 0) < 0 && errno == EINTR)
+        ;
+}
+
+void uring_reap(struct uring* u, void (*done)(void* tag, int res))
+{
+    struct ring* r = &u->r;
+    unsigned head = *r->cqhead;
+    unsigned tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++)
+    {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cqmask];
+        void* tag = (void*)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        //(the entry is given back before done, which may queue more)
+        __atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&completions, 1, __ATOMIC_RELAXED);
+        //(a timeout's own completion says nothing new)
+        if(tag)
+            done(tag, res);
+    }
+}
+
+void uring_stats(unsigned long* naccepted, unsigned long* ncompletions,
+                 unsigned long* nenters)
+{
+    *naccepted = __atomic_load_n(&accepted, __ATOMIC_RELAXED);
+    *ncompletions = __atomic_load_n(&completions, __ATOMIC_RELAXED);
+    *nenters = __atomic_load_n(&enters, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,74 @@
+/*****
+ ** io_uring front end
+ **
+ ** The usual accept loop gives each connection a thread straight away, and
+ ** that thread then sits in read() until the client gets round to sending
+ ** its request. With -u the listening socket is run from an io_uring
+ ** instead: one multishot accept hands over every new connection, and the
+ ** start of each request is read into a slot of a registered buffer, with
+ ** all of those reads (and their timeouts) submitted and reaped in batches
+ ** of one io_uring_enter() each. A connection only gets its thread once the
+ ** headers of its request are in, so idle and slow clients cost a buffer
+ ** slot rather than a thread and a stack.
+ **
+ ** With -c as well, the coroutine workers get a ring each for their
+ ** connections' socket I/O (see coro.h): a coroutine's reads and writes are
+ ** queued on its worker's ring rather than tried with recv()/send() and
+ ** then waited for with epoll, and the worker submits everything its
+ ** coroutines have queued in one io_uring_enter() each time round. (A
+ ** connection on a thread of its own keeps doing blocking reads and
+ ** writes: it has nothing else to do while it waits, so a ring would only
+ ** add a system call to each.)
+ **
+ ** A kernel without io_uring is found out at startup, and the proxy goes
+ ** back to the accept loop; one without multishot accept gets an accept
+ ** submitted for each connection instead.
+ **/
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <signal.h>
+#include <stddef.h>
+
+#define URING_ENTRIES      256  /* submission queue entries */
+#define URING_SLOTS        1024 /* connections waiting for their headers */
+#define URING_BUFSIZE      8192 /* bytes read up front (a rio_t's buffer) */
+#define URING_READ_TIMEOUT 30   /* seconds to get the headers in */
+#define URING_COMPLETIONS  16384 /* completion queue entries of a worker's
+                                    ring (two for each read or write) */
+
+//accept connections on listenfd until *stop is set. each one is passed to
+//dispatch with what has been read of it so far (up to the end of the
+//request headers, which may be nothing when all the slots are taken); the
+//data is only valid during the call, and dispatch has to close connfd.
+//returns 0, or -1 straight away if io_uring can't be used
+int uring_serve(int listenfd, volatile sig_atomic_t* stop,
+                void (*dispatch)(int connfd, char* data, int len));
+
+//a ring for a coroutine worker's socket I/O, which is only ever used from
+//that worker's thread. NULL if io_uring can't be used
+struct uring;
+struct uring* uring_new(void);
+void uring_free(struct uring* u);
+
+//its fd, which polls readable when there are completions to reap
+int uring_fd(struct uring* u);
+
+//queue a recv() (or a send(), if write is set) of up to n bytes of buf on
+//fd, given up on after timeout milliseconds (-1 for never). it's reaped
+//with tag, which can't be NULL
+void uring_queue(struct uring* u, int fd, void* buf, size_t n, int write,
+                 int timeout, void* tag);
+
+//submit everything queued, in one system call
+void uring_submit(struct uring* u);
+
+//pass each completion to done, with its tag and what recv() or send()
+//would have returned (or -errno, and -ECANCELED if it ran out of time)
+void uring_reap(struct uring* u, void (*done)(void* tag, int res));
+
+//numbers for the diagnostics page
+void uring_stats(unsigned long* accepted, unsigned long* completions,
+                 unsigned long* enters);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,215 @@
+/**************
+ ** Work-stealing pool for CPU-heavy work, see workpool.h
+ **/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+#include "workpool.h"
+
+static unsigned long tasks;
+static unsigned long stolen;
+static unsigned long inlined;
+
+//a job, on the stack of whoever is waiting for it
+struct task
+{
+    void (*fn)(void* arg);
+    void* arg;
+    int efd;     //a coroutine waits on this...
+    sem_t done;  //...anybody else on this
+};
+
+//a core's tasks: its own thread works from the bottom (newest first),
+//thieves from the top (oldest first)
+struct deque
+{
+    pthread_mutex_t lock;
+    struct task* ring[WORKPOOL_DEQUE];
+    unsigned top;
+    unsigned bottom;
+    int cpu;
+};
+
+static struct deque* deques;
+static int ndeques;
+static int dequeof[CPU_SETSIZE]; //the deque for each cpu, or -1
+static unsigned long nextdeque;  //for callers on a cpu without one
+static sem_t queued;             //one post per task in any deque
+
+static int push(struct deque* d, struct task* t)
+{
+    pthread_mutex_lock(&d->lock);
+    if(d->bottom - d->top == WORKPOOL_DEQUE)
+    {
+        pthread_mutex_unlock(&d->lock);
+        return -1;
+    }
+    d->ring[d->bottom++ % WORKPOOL_DEQUE] = t;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+static struct task* take(struct deque* d, int steal)
+{
+    struct task* t = NULL;
+    pthread_mutex_lock(&d->lock);
+    if(d->bottom != d->top)
+    {
+        if(steal)
+            t = d->ring[d->top++ % WORKPOOL_DEQUE];
+        else
+            t = d->ring[--d->bottom % WORKPOOL_DEQUE];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+static void* pool_thread(void* arg)
+{
+    int me = (int)(intptr_t)arg;
+    for(;;)
+    {
+        //a post means there's a task in some deque that nobody else has
+        //claimed, so the search always ends
+        while(sem_wait(&queued) < 0 && errno == EINTR)
+            ;
+        struct task* t = take(&deques[me], 0);
+        int i;
+        for(i = 1; !t; i++)
+        {
+            t = take(&deques[(me + i) % ndeques], 1);
+            if(t && (me + i) % ndeques != me)
+                __atomic_add_fetch(&stolen, 1, __ATOMIC_RELAXED);
+        }
+
+        t->fn(t->arg);
+        if(t->efd >= 0)
+        {
+            uint64_t one = 1;
+            ssize_t woken = write(t->efd, &one, sizeof(one));
+            (void)woken;
+        }
+        else
+        {
+            sem_post(&t->done);
+        }
+    }
+    return NULL;
+}
+
+int workpool_start(void)
+{
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return -1;
+    int i;
+    for(i = 0; i < CPU_SETSIZE; i++)
+        dequeof[i] = -1;
+    sem_init(&queued, 0, 0);
+    deques = calloc(CPU_COUNT(&allowed), sizeof(struct deque));
+
+    //all the deques have to be there before any thread goes stealing
+    int cpu;
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if(!CPU_ISSET(cpu, &allowed))
+            continue;
+        struct deque* d = &deques[ndeques];
+        pthread_mutex_init(&d->lock, NULL);
+        d->cpu = cpu;
+        dequeof[cpu] = ndeques++;
+    }
+    int started = 0;
+    for(i = 0; i < ndeques; i++)
+    {
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(deques[i].cpu, &one);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t tid;
+        if(pthread_create(&tid, &attr, pool_thread, (void*)(intptr_t)i) == 0)
+            started++;
+        pthread_attr_destroy(&attr);
+    }
+    //(a deque whose thread didn't start still gets its tasks stolen)
+    if(started == 0)
+        ndeques = 0;
+    return started > 0 ? 0 : -1;
+}
+
+void workpool_run(void (*fn)(void* arg), void* arg, int size)
+{
+    if(ndeques == 0)
+    {
+        fn(arg);
+        return;
+    }
+    struct task t;
+    t.fn = fn;
+    t.arg = arg;
+    t.efd = -1;
+    if(size < WORKPOOL_INLINE
+       || (coro_running()
+           && (t.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0))
+    {
+        __atomic_add_fetch(&inlined, 1, __ATOMIC_RELAXED);
+        fn(arg);
+        return;
+    }
+    if(t.efd < 0)
+        sem_init(&t.done, 0, 0);
+
+    int cpu = sched_getcpu();
+    int d = (cpu >= 0 && cpu < CPU_SETSIZE) ? dequeof[cpu] : -1;
+    if(d < 0)
+        d = __atomic_fetch_add(&nextdeque, 1, __ATOMIC_RELAXED) % ndeques;
+    if(push(&deques[d], &t) < 0)
+    {
+        //every task this core has queued is still waiting, so this one
+        //might as well not
+        if(t.efd >= 0)
+            close(t.efd);
+        else
+            sem_destroy(&t.done);
+        __atomic_add_fetch(&inlined, 1, __ATOMIC_RELAXED);
+        fn(arg);
+        return;
+    }
+    __atomic_add_fetch(&tasks, 1, __ATOMIC_RELAXED);
+    sem_post(&queued);
+
+    if(t.efd >= 0)
+    {
+        uint64_t count;
+        while(read(t.efd, &count, sizeof(count)) < 0)
+            coro_wait(t.efd, POLLIN, -1);
+        close(t.efd);
+    }
+    else
+    {
+        while(sem_wait(&t.done) < 0 && errno == EINTR)
+            ;
+        sem_destroy(&t.done);
+    }
+}
+
+void workpool_stats(unsigned long* ntasks, unsigned long* nstolen,
+                    unsigned long* ninlined)
+{
+    *ntasks = __atomic_load_n(&tasks, __ATOMIC_RELAXED);
+    *nstolen = __atomic_load_n(&stolen, __ATOMIC_RELAXED);
+    *ninlined = __atomic_load_n(&inlined, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+/*****
+ ** Work-stealing pool for CPU-heavy work
+ **
+ ** Compressing a whole object takes long enough that doing it on a
+ ** coroutine's worker holds up every other connection on that worker. So
+ ** with coroutines on, the big jobs go to a pool of threads, one pinned to
+ ** each core, with a deque of tasks each. A job is queued on the deque of
+ ** the core it was handed over from (so its data is likely still in that
+ ** core's cache); each pool thread takes the newest task off its own deque
+ ** first, and when that's empty steals the oldest off someone else's, so a
+ ** burst arriving on one core is spread over all of them.
+ **
+ ** The caller waits for its job as it would for I/O: a coroutine is
+ ** suspended on an eventfd, a thread blocks on a semaphore. Small jobs,
+ ** and every job when the pool isn't running or is full, are just run
+ ** where they are.
+ **/
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#define WORKPOOL_DEQUE  256   /* tasks queued per core */
+#define WORKPOOL_INLINE 16384 /* jobs on fewer bytes than this run in place */
+
+//start a pool thread for each core the process may run on (they inherit
+//the caller's signal mask). returns 0, or -1 if none could be started
+int workpool_start(void);
+
+//run fn(arg) on the pool, and return once it's done. size is roughly how
+//many bytes it works through, to decide whether it's worth handing over
+void workpool_run(void (*fn)(void* arg), void* arg, int size);
+
+//numbers for the diagnostics page
+void workpool_stats(unsigned long* tasks, unsigned long* stolen,
+                    unsigned long* inlined);
+
+#endif /* __WORKPOOL_H__ */